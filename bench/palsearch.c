@@ -0,0 +1,95 @@
+// -----------------------------------------------------------------------------------------------
+// Palette search microbenchmark
+//
+// Measures the time RxPaletteFindClosestColorYiq takes per query for single-layer palettes of
+// 16 to 256 colors. The palettes are created from a generated 512x512 image, and every pixel of
+// that image is queried against them, so the queries follow the color distribution of a real
+// conversion.
+//
+// The search method is fixed when the color reduction module is compiled, so this program is
+// linked against two builds of it (see the bench target of the Makefile):
+//   tree   RX_BRUTE_FORCE_MAX_COLORS=0: the K-D tree, or the linear search for 16 colors
+//   scan   RX_BRUTE_FORCE_MAX_COLORS=256: the AVX2 scan wherever the CPU supports it
+// The largest palette size at which the scan is still faster is the value to use for
+// RX_BRUTE_FORCE_MAX_COLORS. The checksums of both builds should match, except where the tree
+// resolves a tie to another equally close color.
+// -----------------------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "palette.h"
+
+#ifndef BENCH_METHOD
+#define BENCH_METHOD "search"
+#endif
+
+#define BENCH_WIDTH      512
+#define BENCH_HEIGHT     512
+#define BENCH_MIN_TIME   0.25  // seconds each palette size is measured for, at least
+
+static const unsigned int sBenchSizes[] = { 16, 24, 32, 48, 64, 96, 128, 192, 256 };
+
+static COLOR32 BenchRandom(unsigned int *state) {
+	*state = *state * 1664525u + 1013904223u;
+	return *state >> 8;
+}
+
+static void BenchCreateImage(COLOR32 *px, unsigned int width, unsigned int height) {
+	//smooth gradients in blocks of flat hues, with a little noise, like shaded pixel art
+	unsigned int state = 1;
+	for (unsigned int y = 0; y < height; y++) {
+		for (unsigned int x = 0; x < width; x++) {
+			unsigned int block = (x / 64) + (y / 64) * 8;
+			unsigned int shade = (x % 64) + (y % 64);
+			unsigned int noise = BenchRandom(&state) & 0xF;
+
+			unsigned int r = ((block * 37) & 0x7F) + shade / 2 + noise;
+			unsigned int g = ((block * 91) & 0x7F) + shade / 3 + noise;
+			unsigned int b = ((block * 53) & 0x7F) + shade / 4 + noise;
+			px[x + y * width] = (r & 0xFF) | ((g & 0xFF) << 8) | ((b & 0xFF) << 16) | 0xFF000000;
+		}
+	}
+}
+
+int main(void) {
+	unsigned int nPx = BENCH_WIDTH * BENCH_HEIGHT;
+	COLOR32 *px = (COLOR32 *) malloc(nPx * sizeof(COLOR32));
+	RxYiqColor *yiq = (RxYiqColor *) malloc(nPx * sizeof(RxYiqColor));
+	RxReduction *reduction = RxNew(NULL);
+	if (px == NULL || yiq == NULL || reduction == NULL) {
+		fprintf(stderr, "palsearch: out of memory\n");
+		return 1;
+	}
+
+	BenchCreateImage(px, BENCH_WIDTH, BENCH_HEIGHT);
+	RxConvertRgbToYiqBatch(px, yiq, nPx);
+
+	printf("%-8s %8s %14s %16s\n", "colors", "method", "ns/query", "checksum");
+	for (unsigned int i = 0; i < sizeof(sBenchSizes) / sizeof(sBenchSizes[0]); i++) {
+		COLOR32 pltt[RX_PALETTE_MAX_SIZE];
+		unsigned int nColors = sBenchSizes[i];
+		RxCreatePalette(reduction, px, BENCH_WIDTH, BENCH_HEIGHT, pltt, nColors, RX_FLAG_ALPHA_MODE_NONE, NULL);
+		RxPaletteLoad(reduction, pltt, nColors);
+
+		//repeat passes over the image until the minimum time has passed
+		unsigned long long nQueries = 0, checksum = 0;
+		clock_t start = clock(), elapsed;
+		do {
+			for (unsigned int j = 0; j < nPx; j++) {
+				checksum += RxPaletteFindClosestColorYiq(reduction, &yiq[j], NULL) * (j + 1);
+			}
+			nQueries += nPx;
+			elapsed = clock() - start;
+		} while (elapsed < (clock_t) (BENCH_MIN_TIME * CLOCKS_PER_SEC));
+
+		double ns = (double) elapsed / CLOCKS_PER_SEC * 1e9 / nQueries;
+		printf("%-8u %8s %14.1f %16llu\n", nColors, BENCH_METHOD, ns, checksum / (nQueries / nPx));
+	}
+
+	RxFree(reduction);
+	free(yiq);
+	free(px);
+	return 0;
+}
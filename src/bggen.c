@@ -24,6 +24,7 @@
 // -----------------------------------------------------------------------------------------------
 #include "bggen.h"
 #include "palette.h"
+#include "threadpool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,6 +39,8 @@
 #define FALSE 0
 #define TRUE  1
 
+#define BG_DIFF_ROUND_ROWS 16  // rows of the tile difference table per worker between progress updates
+
 #ifdef _MSC_VER
 #define inline __inline
 #endif
@@ -235,16 +238,14 @@ static void BgiAddTileToTotal(RxYiqColor *pxBlock, BgTile *tile) {
 	if (tile->flipMode & TILE_FLIPX) iXor ^= 007;
 	if (tile->flipMode & TILE_FLIPY) iXor ^= 070;
 
+	RxYiqColor yiq[64];
+	RxConvertRgbToYiqBatch(tile->px, yiq, 64);
 	for (unsigned int i = 0; i < 64; i++) {
-		COLOR32 col = tile->px[i];
 		RxYiqColor *dest = &pxBlock[i ^ iXor];
-
-		RxYiqColor yiq;
-		RxConvertRgbToYiq(col, &yiq);
-		dest->y += yiq.y;
-		dest->i += yiq.i;
-		dest->q += yiq.q;
-		dest->a += yiq.a;
+		dest->y += yiq[i].y;
+		dest->i += yiq[i].i;
+		dest->q += yiq[i].q;
+		dest->a += yiq[i].a;
 	}
 }
 
@@ -369,6 +370,33 @@ static inline void BgiPutDiff(float *diffBuff, int dim, int i, int j, float val)
 	diffBuff[BgiGetDiffEntry(i, j, dim)] = val;
 }
 
+typedef struct BgiTileDiffWork_ {
+	RxReduction *reduction;
+	BgTile *tiles;
+	unsigned int nTiles;
+	int allowFlip;
+	float *diffBuff;
+	unsigned char *flips;
+	unsigned int firstRow;
+} BgiTileDiffWork;
+
+static void BgiComputeTileDiffRow(void *param, unsigned int index, unsigned int worker) {
+	//compute the differences of tile i to every tile before it. Each row writes distinct entries.
+	BgiTileDiffWork *work = (BgiTileDiffWork *) param;
+	unsigned int nTiles = work->nTiles;
+	unsigned int i = work->firstRow + index;
+	(void) worker;
+
+	BgTile *t1 = &work->tiles[i];
+	for (unsigned int j = 0; j < i; j++) {
+		BgTile *t2 = &work->tiles[j];
+
+		float diff = (float) BgiTileDifference(work->reduction, t1, t2, &work->flips[i + j * nTiles], work->allowFlip);
+		BgiPutDiff(work->diffBuff, nTiles, j, i, diff);
+		work->flips[j + i * nTiles] = work->flips[i + j * nTiles];
+	}
+}
+
 int BgPerformCharacterCompression(
 	BgTile                 *tiles,
 	unsigned int            nTiles,
@@ -388,16 +416,26 @@ int BgPerformCharacterCompression(
 	unsigned char *flips = (unsigned char *) calloc(nTiles * nTiles, 1); //how must each tile be manipulated to best match its partner
 
 	RxReduction *reduction = RxNew(balance);
-	for (unsigned int i = 0; i < nTiles; i++) {
-		BgTile *t1 = &tiles[i];
-		for (unsigned int j = 0; j < i; j++) {
-			BgTile *t2 = &tiles[j];
 
-			float diff = (float) BgiTileDifference(reduction, t1, t2, &flips[i + j * nTiles], allowFlip);
-			BgiPutDiff(diffBuff, nTiles, j, i, diff);
-			flips[j + i * nTiles] = flips[i + j * nTiles];
-		}
-		*progress = (i * i) / nTiles * 500 / nTiles;
+	//compute tile differences on the thread pool, one row of the difference table per task
+	BgiTileDiffWork diffWork;
+	diffWork.reduction = reduction;
+	diffWork.tiles = tiles;
+	diffWork.nTiles = nTiles;
+	diffWork.allowFlip = allowFlip;
+	diffWork.diffBuff = diffBuff;
+	diffWork.flips = flips;
+
+	//rows are run in rounds, so that progress can be reported from this thread.
+	unsigned int nRowsRound = BG_DIFF_ROUND_ROWS * TpGetThreadCount();
+	for (diffWork.firstRow = 0; diffWork.firstRow < nTiles; diffWork.firstRow += nRowsRound) {
+		unsigned int nRound = nTiles - diffWork.firstRow;
+		if (nRound > nRowsRound) nRound = nRowsRound;
+
+		TpParallelFor(nRound, BgiComputeTileDiffRow, &diffWork);
+
+		unsigned int rowEnd = diffWork.firstRow + nRound;
+		*progress = (rowEnd * rowEnd) / nTiles * 500 / nTiles;
 	}
 
 	//first, combine tiles with a difference of 0.
@@ -526,9 +564,7 @@ int BgPerformCharacterCompression(
 			pxBlock[j].q /= nRep;
 			pxBlock[j].a /= nRep;
 		}
-		for (unsigned int j = 0; j < 64; j++) {
-			tile->px[j] = RxConvertYiqToRgb(&pxBlock[j]);
-		}
+		RxConvertYiqToRgbBatch(pxBlock, tile->px, 64);
 
 		//try to determine the most optimal palette. Child tiles can be different palettes.
 		int bestPalette = paletteBase;
@@ -577,19 +613,20 @@ int BgPerformCharacterCompression(
 void BgSetupTiles(
 	BgTile                 *tiles,
 	unsigned int            nTiles,
+	unsigned int            tilesX,
 	int                     nBits,
 	const COLOR32          *palette,
 	unsigned int            paletteSize,
 	unsigned int            nPalettes,
 	unsigned int            paletteBase,
 	unsigned int            paletteOffset,
-	int                     dither,
-	float                   diffuse,
+	const RxDitherSetting  *dither,
 	const RxBalanceSetting *balance
 ) {
 	RxReduction *reduction = RxNew(balance);
+	RxSetDitherMode(reduction, dither->mode);
 
-	if (!dither) diffuse = 0.0f;
+	float diffuse = dither->dither ? dither->diffuse : 0.0f;
 
 	unsigned int effectivePaletteOffset = paletteOffset;
 	unsigned int effectivePaletteSize = paletteSize;
@@ -625,12 +662,11 @@ void BgSetupTiles(
 		//(we will always have space for this). Reduction producing a color index 0 will be taken to be
 		//transparent.
 		int idxs[64];
+		RxSetDitherOrigin(reduction, (i % tilesX) * 8, (i / tilesX) * 8);
 		RxPaletteLoad(reduction, pal + effectivePaletteOffset - 1, effectivePaletteSize + 1);
 		RxReduceImage(reduction, tile->px, idxs, 8, 8, RX_FLAG_ALPHA_MODE_RESERVE | RX_FLAG_PRESERVE_ALPHA | RX_FLAG_NO_ALPHA_DITHER, diffuse);
+		RxConvertRgbToYiqBatch(tile->px, tile->pxYiq, 64);
 		for (int j = 0; j < 64; j++) {
-			//YIQ color
-			RxConvertRgbToYiq(tile->px[j], &tile->pxYiq[j]);
-
 			//adjust the color indices. Index 0 maps to 0, otherwise shift by the effective palette offset.
 			tile->indices[j] = idxs[j] == 0 ? 0 : (idxs[j] + effectivePaletteOffset - 1);
 			tile->px[j] = pal[tile->indices[j]];
@@ -663,7 +699,9 @@ void BgGenerate(
 	volatile int               *progress1,
 	volatile int               *progress1Max,
 	volatile int               *progress2,
-	volatile int               *progress2Max
+	volatile int               *progress2Max,
+	unsigned int               *pReclusterRuns,
+	unsigned int               *pReclusterIterations
 ) {
 	//palette setting
 	unsigned int nPalettes = params->paletteRegion.count;
@@ -751,11 +789,16 @@ void BgGenerate(
 	//create color palettes for the background.
 	if (nPalettes == 1) {
 		RxFlag flag = RX_FLAG_SORT_ALL | RX_FLAG_ALPHA_MODE_NONE;
-		RxGlbCreatePalette(imgBits, width, height, palette + (paletteBase << nBits) + usedPaletteOffset,
-			usedPaletteSize, &params->balance, flag, NULL);
+		RxReduction *reduction = RxNew(&params->balance);
+		RxApplyFlags(reduction, flag);
+		RxCreatePalette(reduction, imgBits, width, height, palette + (paletteBase << nBits) + usedPaletteOffset,
+			usedPaletteSize, flag, NULL);
+		RxGetReclusterStats(reduction, pReclusterRuns, pReclusterIterations);
+		RxFree(reduction);
 	} else {
 		RxCreateMultiplePalettes(imgBits, tilesX, tilesY, palette, paletteBase, nPalettes, 1 << nBits,
-			paletteSize, paletteOffset, !color0Transparent, &params->balance, progress1);
+			paletteSize, paletteOffset, !color0Transparent, &params->balance, progress1,
+			pReclusterRuns, pReclusterIterations);
 	}
 
 	//insert the reserved transparent color, if not marked as used for color.
@@ -785,8 +828,8 @@ void BgGenerate(
 	}
 
 	//match palettes to tiles
-	BgSetupTiles(tiles, nTiles, nBits, palette, paletteSize, nPalettes, paletteBase, paletteOffset,
-		params->dither.dither, params->dither.diffuse, &params->balance);
+	BgSetupTiles(tiles, nTiles, tilesX, nBits, palette, paletteSize, nPalettes, paletteBase, paletteOffset,
+		&params->dither, &params->balance);
 
 	//match tiles to each other
 	unsigned int nChars = nTiles;
@@ -870,7 +913,7 @@ static double BgiPaletteCharError(RxReduction *reduction, COLOR32 *block, RxYiqC
 		//convert source image pixel
 		RxYiqColor yiq;
 		COLOR32 col = block[i ^ iXor];
-		RxConvertRgbToYiq(col, &yiq);
+		RxConvertRgbToYiqCached(reduction, col, &yiq);
 
 		//char pixel
 		int index = character[i];
@@ -927,7 +970,7 @@ double BgiBestPaletteCharError(RxReduction *reduction, COLOR32 *block, RxYiqColo
 
 void BgAssemble(COLOR32 *imgBits, int width, int height, int nBits, COLOR *pals, int nPalettes,
 	unsigned char *chars, int nChars, unsigned short **pOutScreen, int *outScreenSize,
-	int balance, int colorBalance, int enhanceColors) {
+	int balance, int colorBalance, int enhanceColors, unsigned long long *pCacheHits, unsigned long long *pCacheLookups) {
 
 	int tilesX = width / 8;
 	int tilesY = height / 8;
@@ -938,6 +981,7 @@ void BgAssemble(COLOR32 *imgBits, int width, int height, int nBits, COLOR *pals,
 	balanceSetting.balance = balance;
 	balanceSetting.colorBalance = colorBalance;
 	balanceSetting.enhanceColors = enhanceColors;
+	balanceSetting.reclusterImprovement = RECLUSTER_IMPROVEMENT_DEFAULT; // no palettes are created
 
 	//init params and convert palette
 	RxYiqColor *paletteYiq = (RxYiqColor *) RxMemCalloc(nPalettes << nBits, sizeof(RxYiqColor));
@@ -1005,6 +1049,8 @@ void BgAssemble(COLOR32 *imgBits, int width, int height, int nBits, COLOR *pals,
 		}
 	}
 	
+	//report the use of the color conversion cache by the character matching
+	RxGetConversionCacheStats(reduction, pCacheHits, pCacheLookups);
 	RxFree(reduction);
 	RxMemFree(tiles);
 	RxMemFree(paletteYiq);
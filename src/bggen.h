@@ -145,19 +145,19 @@ typedef struct BgGenerateParameters_ {
 // 
 // Call this function after filling out the RGB color info in the tile array. The function will
 // associate each tile with its best fitting palette, index the tile with that palette, and
-// perform optional dithering.
+// perform optional dithering. The tiles are in row-major order with tilesX tiles per row.
 // -----------------------------------------------------------------------------------------------
 void BgSetupTiles(
 	BgTile                 *tiles,
 	unsigned int            nTiles,
+	unsigned int            tilesX,
 	int                     nBits,
 	const COLOR32          *palette,
 	unsigned int            paletteSize,
 	unsigned int            nPalettes,
 	unsigned int            paletteBase,
 	unsigned int            paletteOffset,
-	int                     dither,
-	float                   diffuse,
+	const RxDitherSetting  *dither,
 	const RxBalanceSetting *balance
 );
 
@@ -203,6 +203,8 @@ int BgPerformCharacterCompression(
 //   progress1Max                Progress 1 max
 //   progress2                   Progress 2
 //   progress2Max                Progress 2 max
+//   pReclusterRuns              Output number of palette refinements run (may be NULL)
+//   pReclusterIterations        Output total number of palette refinement iterations (may be NULL)
 // -----------------------------------------------------------------------------------------------
 void BgGenerate(
 	COLOR                      *pOutPalette,
@@ -218,10 +220,12 @@ void BgGenerate(
 	volatile int               *progress1,
 	volatile int               *progress1Max,
 	volatile int               *progress2,
-	volatile int               *progress2Max
+	volatile int               *progress2Max,
+	unsigned int               *pReclusterRuns,
+	unsigned int               *pReclusterIterations
 );
 
 
 void BgAssemble(COLOR32 *imgBits, int width, int height, int nBits, COLOR *pals, int nPalettes,
 	unsigned char *chars, int nChars, unsigned short **pOutScreen, int *outScreenSize,
-	int balance, int colorBalance, int enhanceColors);
+	int balance, int colorBalance, int enhanceColors, unsigned long long *pCacheHits, unsigned long long *pCacheLookups);
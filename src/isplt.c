@@ -30,6 +30,7 @@
 
 #include "color.h"
 #include "palette.h"
+#include "threadpool.h"
 
 #ifndef _MSC_VER
 #	define min(a,b) ((a)<(b)?(a):(b))
@@ -60,8 +61,27 @@
 #define restrict __restrict
 #endif
 
+//force inlining, used to generate copies of routines specialized on their arguments
+#ifdef _MSC_VER
+#define RX_FORCEINLINE __forceinline
+#else
+#define RX_FORCEINLINE inline __attribute__((always_inline))
+#endif
+
 #define RX_LARGE_NUMBER             1e32 // constant to represent large color difference
-#define RX_SLAB_SIZE            0x100000 // slab size of allocator
+#define RX_HISTOGRAM_MIN_BITS          5 // log2 of the smallest histogram hash table size
+#define RX_HISTOGRAM_INIT_COLORS  0x1000 // largest number of colors a new histogram is sized for
+#define RX_HISTOGRAM_BAND_ROWS        16 // rows per band when building a histogram in parallel
+#define RX_VORONOI_BLOCK_ENTRIES   0x400 // histogram entries per task when mapping entries to clusters
+#define RX_REDUCE_BAND_ROWS           16 // rows per band when indexing an image in parallel
+#ifndef RX_BRUTE_FORCE_MAX_COLORS
+#define RX_BRUTE_FORCE_MAX_COLORS    256 // largest single-layer palette searched by the vectorized scan (see bench/palsearch.c)
+#endif
+#define RX_DITHER_SPREAD_MAX_COLORS  256 // largest palette whose color spacing is measured for ordered dithering
+#define RX_PCA_MAX_SQUARINGS          16 // most squarings of a 4x4 covariance matrix to find its principal axis
+#define RX_PCA_TOLERANCE           1e-12 // tolerance of the principal axis squaring convergence
+#define RX_SORT_INSERTION_MAX         32 // largest histogram range sorted by insertion instead of radix sort
+#define RX_TILE_CANDIDATES            64 // nearest palettes linked as merge candidates per tile palette
 #define INV_512    0.0019531250000000000 // 1.0/512.0
 #define INV_511    0.0019569471624266144 // 1.0/511.0
 #define INV_255    0.0039215686274509800 // 1.0/255.0
@@ -79,12 +99,20 @@
 
 static int RxiPaletteFindClosestColor(RxReduction *reduction, const RxYiqColor *palette, unsigned int nColors, const RxYiqColor *col, double *outDiff);
 static RxStatus RxiPaletteLoadYiq(RxReduction *reduction, const RxYiqColor *pltt, unsigned int srcPitch, unsigned int nColors, RxBool overrideMode);
+static unsigned int RxiPaletteFindClosestColorYiq(RxReduction *reduction, const RxYiqColor *color, RxYiqColor *scratch, double *outDiff);
+static unsigned int RxiPaletteFindClosestColorCached(RxReduction *reduction, RxIndexCache *cache, COLOR32 rgb, const RxYiqColor *color, RxYiqColor *scratch);
+static void RxiHistFree(RxHistogram *histogram);
+static void RxiHistFreeFlat(RxHistFlat *flat);
+static int RxiHistAddColor1(RxHistogram *histogram, const RxYiqColor *col, double weight, RxBool *pCreated);
+static int RxiHistAddColorAny(RxHistogram *histogram, const RxYiqColor *col, double weight, RxBool *pCreated);
+static void RxiHistComputePrincipal1(RxReduction *reduction, int startIndex, int endIndex, double *axis, double *pVar);
+static void RxiHistComputePrincipalAny(RxReduction *reduction, int startIndex, int endIndex, double *axis, double *pVar);
 
 
 
 // ----- memory allocation wrappers for SIMD use
 
-#if defined(RX_SIMD) && !defined(_M_X64)
+#if defined(RX_SIMD) && !defined(RX_SIMD_X64)
 
 //alignment of memory to be allocated by RxMem* routines
 #define ALLOC_ALIGN sizeof(__m128)
@@ -116,9 +144,74 @@ void RxMemFree(void *p) {
 #endif
 
 
+// ----- runtime CPU dispatch
+
+#ifdef RX_SIMD
+
+//functions compiled for AVX2 must be marked for GCC and Clang. MSVC accepts the intrinsics anywhere.
+#ifdef _MSC_VER
+#define RX_TARGET_AVX2
+#else
+#define RX_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+typedef enum RxiSimdLevel_ {
+	RXI_SIMD_LEVEL_UNKNOWN,     // not yet detected
+	RXI_SIMD_LEVEL_SSE2,        // SSE2 baseline
+	RXI_SIMD_LEVEL_AVX2         // AVX2 supported by the CPU and OS
+} RxiSimdLevel;
+
+static volatile RxiSimdLevel sRxSimdLevel = RXI_SIMD_LEVEL_UNKNOWN;
+
+//the detected level is shared by all threads. MSVC makes volatile accesses atomic already.
+#ifdef _MSC_VER
+#define RxiLoadSimdLevel()         (sRxSimdLevel)
+#define RxiStoreSimdLevel(level)   (sRxSimdLevel = (level))
+#else
+#define RxiLoadSimdLevel()         __atomic_load_n(&sRxSimdLevel, __ATOMIC_RELAXED)
+#define RxiStoreSimdLevel(level)   __atomic_store_n(&sRxSimdLevel, (level), __ATOMIC_RELAXED)
+#endif
+
+static RxiSimdLevel RxiDetectSimdLevel(void) {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return RXI_SIMD_LEVEL_SSE2;
+
+	//OSXSAVE, AVX
+	__cpuid(info, 1);
+	if ((info[2] & 0x18000000) != 0x18000000) return RXI_SIMD_LEVEL_SSE2;
+
+	//OS must save the YMM state
+	if ((_xgetbv(0) & 0x6) != 0x6) return RXI_SIMD_LEVEL_SSE2;
+
+	//AVX2
+	__cpuidex(info, 7, 0);
+	if (!(info[1] & 0x20)) return RXI_SIMD_LEVEL_SSE2;
+	return RXI_SIMD_LEVEL_AVX2;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return RXI_SIMD_LEVEL_AVX2;
+	return RXI_SIMD_LEVEL_SSE2;
+#endif
+}
+
+static inline RxiSimdLevel RxiGetSimdLevel(void) {
+	//detection is idempotent, so threads detecting at the same time store the same level
+	RxiSimdLevel level = RxiLoadSimdLevel();
+	if (level == RXI_SIMD_LEVEL_UNKNOWN) {
+		level = RxiDetectSimdLevel();
+		RxiStoreSimdLevel(level);
+	}
+	return level;
+}
+
+#endif
+
+
 // ----- routines for operating on colors
 
-void RX_API RxConvertRgbToYiq(COLOR32 rgb, RxYiqColor *yiq) {
+static inline void RxiConvertRgbToYiq(COLOR32 rgb, RxYiqColor *yiq) {
 	//implementations using scalar and vector arithmetic
 #ifndef RX_SIMD
 	float r = (float) ((rgb >>  0) & 0xFF);
@@ -161,6 +254,10 @@ void RX_API RxConvertRgbToYiq(COLOR32 rgb, RxYiqColor *yiq) {
 #endif
 }
 
+void RX_API RxConvertRgbToYiq(COLOR32 rgb, RxYiqColor *yiq) {
+	RxiConvertRgbToYiq(rgb, yiq);
+}
+
 COLOR32 RX_API RxConvertYiqToRgb(const RxYiqColor *yiq) {
 	//scalar and SIMD versions
 #ifndef RX_SIMD
@@ -222,6 +319,177 @@ COLOR32 RX_API RxConvertYiqToRgb(const RxYiqColor *yiq) {
 #endif
 }
 
+#ifdef RX_SIMD
+
+//Batch conversion kernels. These work on 4 or 8 pixels at once with one vector per component, but
+//perform the same operations in the same order as the single color routines above, so that a color
+//converts to the same bits whichever way it is converted.
+
+static inline void RxiConvertRgbToYiq4(const COLOR32 *rgb, RxYiqColor *yiq, unsigned int stride) {
+	__m128i rgbVeci = _mm_loadu_si128((const __m128i *) rgb);
+	__m128i mask = _mm_set1_epi32(0xFF);
+
+	__m128 r = _mm_cvtepi32_ps(_mm_and_si128(rgbVeci, mask));
+	__m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(rgbVeci, 8), mask));
+	__m128 b = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(rgbVeci, 16), mask));
+	__m128 a = _mm_div_ps(_mm_cvtepi32_ps(_mm_srli_epi32(rgbVeci, 24)), _mm_set1_ps(255.0f));
+
+	//matrix transform, alpha premultiplication (adding zero like the single color routine does)
+	__m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.5146329f)), _mm_mul_ps(g, _mm_set1_ps(1.2303905f))), _mm_mul_ps(b, _mm_set1_ps(0.2588982f)));
+	__m128 i = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(-0.5885085f)), _mm_mul_ps(g, _mm_set1_ps(-0.3060195f))), _mm_mul_ps(b, _mm_set1_ps(0.8945280f)));
+	__m128 q = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.7227111f)), _mm_mul_ps(g, _mm_set1_ps(-1.3898515f))), _mm_mul_ps(b, _mm_set1_ps(0.6671403f)));
+	y = _mm_add_ps(_mm_mul_ps(y, a), _mm_setzero_ps());
+	i = _mm_add_ps(_mm_mul_ps(i, a), _mm_setzero_ps());
+	q = _mm_add_ps(_mm_mul_ps(q, a), _mm_setzero_ps());
+
+	//transpose to one vector per pixel
+	_MM_TRANSPOSE4_PS(y, i, q, a);
+	yiq[0 * stride].yiq = y;
+	yiq[1 * stride].yiq = i;
+	yiq[2 * stride].yiq = q;
+	yiq[3 * stride].yiq = a;
+}
+
+static inline void RxiConvertYiqToRgb4(const RxYiqColor *yiq, COLOR32 *rgb) {
+	__m128 y = yiq[0].yiq;
+	__m128 i = yiq[1].yiq;
+	__m128 q = yiq[2].yiq;
+	__m128 a = yiq[3].yiq;
+	_MM_TRANSPOSE4_PS(y, i, q, a);
+
+	//divide out alpha where a > 0, otherwise zero
+	__m128 nonzero = _mm_cmpgt_ps(a, _mm_setzero_ps());
+	y = _mm_and_ps(_mm_div_ps(y, a), nonzero);
+	i = _mm_and_ps(_mm_div_ps(i, a), nonzero);
+	q = _mm_and_ps(_mm_div_ps(q, a), nonzero);
+
+	__m128 zero = _mm_setzero_ps();
+	__m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, _mm_set1_ps( 0.49902150f)), _mm_mul_ps(i, _mm_set1_ps(-0.56700944f))), _mm_add_ps(_mm_mul_ps(q, _mm_set1_ps( 0.5666126f)), _mm_mul_ps(a, zero)));
+	__m128 g = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, _mm_set1_ps( 0.49902150f)), _mm_mul_ps(i, _mm_set1_ps( 0.07502532f))), _mm_add_ps(_mm_mul_ps(q, _mm_set1_ps(-0.29425290f)), _mm_mul_ps(a, zero)));
+	__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, _mm_set1_ps( 0.49902150f)), _mm_mul_ps(i, _mm_set1_ps( 0.77053964f))), _mm_add_ps(_mm_mul_ps(q, _mm_set1_ps( 0.27210910f)), _mm_mul_ps(a, zero)));
+	a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, zero), _mm_mul_ps(i, zero)), _mm_add_ps(_mm_mul_ps(q, zero), _mm_mul_ps(a, _mm_set1_ps(255.0f))));
+
+	//clamp, round and pack
+	__m128 maxVal = _mm_set1_ps(255.0f);
+	__m128i rI = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(r, zero), maxVal));
+	__m128i gI = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(g, zero), maxVal));
+	__m128i bI = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(b, zero), maxVal));
+	__m128i aI = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(a, zero), maxVal));
+	__m128i rgbaI = _mm_or_si128(_mm_or_si128(rI, _mm_slli_epi32(gI, 8)), _mm_or_si128(_mm_slli_epi32(bI, 16), _mm_slli_epi32(aI, 24)));
+	_mm_storeu_si128((__m128i *) rgb, rgbaI);
+}
+
+RX_TARGET_AVX2 static void RxiConvertRgbToYiqBatchAvx2(const COLOR32 *rgb, RxYiqColor *yiq, unsigned int stride, unsigned int n) {
+	__m256i mask = _mm256_set1_epi32(0xFF);
+	__m256 zero = _mm256_setzero_ps();
+
+	unsigned int j = 0;
+	for (; j + 8 <= n; j += 8) {
+		__m256i rgbVeci = _mm256_loadu_si256((const __m256i *) (rgb + j));
+		__m256 r = _mm256_cvtepi32_ps(_mm256_and_si256(rgbVeci, mask));
+		__m256 g = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(rgbVeci, 8), mask));
+		__m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(rgbVeci, 16), mask));
+		__m256 a = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(rgbVeci, 24)), _mm256_set1_ps(255.0f));
+
+		__m256 y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.5146329f)), _mm256_mul_ps(g, _mm256_set1_ps(1.2303905f))), _mm256_mul_ps(b, _mm256_set1_ps(0.2588982f)));
+		__m256 i = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(-0.5885085f)), _mm256_mul_ps(g, _mm256_set1_ps(-0.3060195f))), _mm256_mul_ps(b, _mm256_set1_ps(0.8945280f)));
+		__m256 q = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.7227111f)), _mm256_mul_ps(g, _mm256_set1_ps(-1.3898515f))), _mm256_mul_ps(b, _mm256_set1_ps(0.6671403f)));
+		y = _mm256_add_ps(_mm256_mul_ps(y, a), zero);
+		i = _mm256_add_ps(_mm256_mul_ps(i, a), zero);
+		q = _mm256_add_ps(_mm256_mul_ps(q, a), zero);
+
+		//transpose within each 128-bit lane: p04 holds pixels 0 and 4, and so on
+		__m256 yi01 = _mm256_unpacklo_ps(y, i), yi23 = _mm256_unpackhi_ps(y, i);
+		__m256 qa01 = _mm256_unpacklo_ps(q, a), qa23 = _mm256_unpackhi_ps(q, a);
+		__m256 p04 = _mm256_shuffle_ps(yi01, qa01, _MM_SHUFFLE(1, 0, 1, 0));
+		__m256 p15 = _mm256_shuffle_ps(yi01, qa01, _MM_SHUFFLE(3, 2, 3, 2));
+		__m256 p26 = _mm256_shuffle_ps(yi23, qa23, _MM_SHUFFLE(1, 0, 1, 0));
+		__m256 p37 = _mm256_shuffle_ps(yi23, qa23, _MM_SHUFFLE(3, 2, 3, 2));
+
+		RxYiqColor *out = yiq + j * stride;
+		out[0 * stride].yiq = _mm256_castps256_ps128(p04);
+		out[1 * stride].yiq = _mm256_castps256_ps128(p15);
+		out[2 * stride].yiq = _mm256_castps256_ps128(p26);
+		out[3 * stride].yiq = _mm256_castps256_ps128(p37);
+		out[4 * stride].yiq = _mm256_extractf128_ps(p04, 1);
+		out[5 * stride].yiq = _mm256_extractf128_ps(p15, 1);
+		out[6 * stride].yiq = _mm256_extractf128_ps(p26, 1);
+		out[7 * stride].yiq = _mm256_extractf128_ps(p37, 1);
+	}
+
+	for (; j < n; j++) RxiConvertRgbToYiq(rgb[j], &yiq[j * stride]);
+}
+
+RX_TARGET_AVX2 static void RxiConvertYiqToRgbBatchAvx2(const RxYiqColor *yiq, COLOR32 *rgb, unsigned int n) {
+	__m256 zero = _mm256_setzero_ps();
+	__m256 maxVal = _mm256_set1_ps(255.0f);
+
+	unsigned int j = 0;
+	for (; j + 8 <= n; j += 8) {
+		//transpose pixels 0-3 and 4-7, then join the halves
+		__m128 y0 = yiq[j + 0].yiq, i0 = yiq[j + 1].yiq, q0 = yiq[j + 2].yiq, a0 = yiq[j + 3].yiq;
+		__m128 y1 = yiq[j + 4].yiq, i1 = yiq[j + 5].yiq, q1 = yiq[j + 6].yiq, a1 = yiq[j + 7].yiq;
+		_MM_TRANSPOSE4_PS(y0, i0, q0, a0);
+		_MM_TRANSPOSE4_PS(y1, i1, q1, a1);
+		__m256 y = _mm256_insertf128_ps(_mm256_castps128_ps256(y0), y1, 1);
+		__m256 i = _mm256_insertf128_ps(_mm256_castps128_ps256(i0), i1, 1);
+		__m256 q = _mm256_insertf128_ps(_mm256_castps128_ps256(q0), q1, 1);
+		__m256 a = _mm256_insertf128_ps(_mm256_castps128_ps256(a0), a1, 1);
+
+		__m256 nonzero = _mm256_cmp_ps(a, zero, _CMP_GT_OQ);
+		y = _mm256_and_ps(_mm256_div_ps(y, a), nonzero);
+		i = _mm256_and_ps(_mm256_div_ps(i, a), nonzero);
+		q = _mm256_and_ps(_mm256_div_ps(q, a), nonzero);
+
+		__m256 r = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, _mm256_set1_ps( 0.49902150f)), _mm256_mul_ps(i, _mm256_set1_ps(-0.56700944f))), _mm256_add_ps(_mm256_mul_ps(q, _mm256_set1_ps( 0.5666126f)), _mm256_mul_ps(a, zero)));
+		__m256 g = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, _mm256_set1_ps( 0.49902150f)), _mm256_mul_ps(i, _mm256_set1_ps( 0.07502532f))), _mm256_add_ps(_mm256_mul_ps(q, _mm256_set1_ps(-0.29425290f)), _mm256_mul_ps(a, zero)));
+		__m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, _mm256_set1_ps( 0.49902150f)), _mm256_mul_ps(i, _mm256_set1_ps( 0.77053964f))), _mm256_add_ps(_mm256_mul_ps(q, _mm256_set1_ps( 0.27210910f)), _mm256_mul_ps(a, zero)));
+		a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, zero), _mm256_mul_ps(i, zero)), _mm256_add_ps(_mm256_mul_ps(q, zero), _mm256_mul_ps(a, maxVal)));
+
+		__m256i rI = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(r, zero), maxVal));
+		__m256i gI = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(g, zero), maxVal));
+		__m256i bI = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(b, zero), maxVal));
+		__m256i aI = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(a, zero), maxVal));
+		__m256i rgbaI = _mm256_or_si256(_mm256_or_si256(rI, _mm256_slli_epi32(gI, 8)), _mm256_or_si256(_mm256_slli_epi32(bI, 16), _mm256_slli_epi32(aI, 24)));
+		_mm256_storeu_si256((__m256i *) (rgb + j), rgbaI);
+	}
+
+	for (; j < n; j++) rgb[j] = RxConvertYiqToRgb(&yiq[j]);
+}
+
+#endif
+
+static void RxiConvertRgbToYiqBatch(const COLOR32 *rgb, RxYiqColor *yiq, unsigned int stride, unsigned int n) {
+	//convert n colors, writing each stride colors apart (for interleaving palette layers)
+	unsigned int j = 0;
+#ifdef RX_SIMD
+	if (RxiGetSimdLevel() >= RXI_SIMD_LEVEL_AVX2) {
+		RxiConvertRgbToYiqBatchAvx2(rgb, yiq, stride, n);
+		return;
+	}
+
+	for (; j + 4 <= n; j += 4) RxiConvertRgbToYiq4(rgb + j, yiq + j * stride, stride);
+#endif
+	for (; j < n; j++) RxiConvertRgbToYiq(rgb[j], &yiq[j * stride]);
+}
+
+void RX_API RxConvertRgbToYiqBatch(const COLOR32 *rgb, RxYiqColor *yiq, unsigned int n) {
+	RxiConvertRgbToYiqBatch(rgb, yiq, 1, n);
+}
+
+void RX_API RxConvertYiqToRgbBatch(const RxYiqColor *yiq, COLOR32 *rgb, unsigned int n) {
+	unsigned int j = 0;
+#ifdef RX_SIMD
+	if (RxiGetSimdLevel() >= RXI_SIMD_LEVEL_AVX2) {
+		RxiConvertYiqToRgbBatchAvx2(yiq, rgb, n);
+		return;
+	}
+
+	for (; j + 4 <= n; j += 4) RxiConvertYiqToRgb4(yiq + j, rgb + j);
+#endif
+	for (; j < n; j++) rgb[j] = RxConvertYiqToRgb(&yiq[j]);
+}
+
 static inline double RxiComputeColorDifference(RxReduction *reduction, const RxYiqColor *yiq1, const RxYiqColor *yiq2) {
 #ifndef RX_SIMD
 	double yw2 = reduction->yWeight2;
@@ -259,17 +527,21 @@ static inline double RxiComputeColorDifference(RxReduction *reduction, const RxY
 #endif
 }
 
-static inline double RxiComputeLayeredColorDifference(RxReduction *reduction, const RxYiqColor *yiq1, const RxYiqColor *yiq2) {
+static RX_FORCEINLINE double RxiComputeLayeredColorDifferenceN(RxReduction *reduction, const RxYiqColor *yiq1, const RxYiqColor *yiq2, unsigned int nLayers) {
 	double diff = 0.0;
 
 	//add multiple diffs
-	for (unsigned int i = 0; i < reduction->paletteLayers; i++) {
+	for (unsigned int i = 0; i < nLayers; i++) {
 		diff += RxiComputeColorDifference(reduction, &yiq1[i], &yiq2[i]);
 	}
 
 	return diff;
 }
 
+static inline double RxiComputeLayeredColorDifference(RxReduction *reduction, const RxYiqColor *yiq1, const RxYiqColor *yiq2) {
+	return RxiComputeLayeredColorDifferenceN(reduction, yiq1, yiq2, reduction->paletteLayers);
+}
+
 double RX_API RxComputeColorDifference(RxReduction *reduction, const RxYiqColor *yiq1, const RxYiqColor *yiq2) {
 	return RxiComputeColorDifference(reduction, yiq1, yiq2);
 }
@@ -290,7 +562,7 @@ static inline COLOR32 RxiMaskYiqToRgb(RxReduction *reduction, const RxYiqColor *
 
 static inline void RxiMaskYiq(RxReduction *reduction, const RxYiqColor *yiq, RxYiqColor *out) {
 	COLOR32 rgb = RxiMaskYiqToRgb(reduction, yiq);
-	RxConvertRgbToYiq(rgb, out);
+	RxiConvertRgbToYiq(rgb, out);
 }
 
 static inline RxBool RxiColorEqual(const RxYiqColor *a, const RxYiqColor *b) {
@@ -302,7 +574,7 @@ static inline RxBool RxiColorEqual(const RxYiqColor *a, const RxYiqColor *b) {
 #endif
 }
 
-static inline RxBool RxiColorVecEqual(const RxYiqColor *a, const RxYiqColor *b, unsigned int n) {
+static RX_FORCEINLINE RxBool RxiColorVecEqual(const RxYiqColor *a, const RxYiqColor *b, unsigned int n) {
 	RX_ASSUME(n > 0);
 
 #ifndef RX_SIMD
@@ -324,7 +596,7 @@ static inline void RxiColorCopy(RxYiqColor *dest, const RxYiqColor *src) {
 #endif
 }
 
-static inline void RxiColorVecCopy(RxYiqColor *dest, const RxYiqColor *src, unsigned int n) {
+static RX_FORCEINLINE void RxiColorVecCopy(RxYiqColor *dest, const RxYiqColor *src, unsigned int n) {
 	RX_ASSUME(n > 0);
 
 #ifndef RX_SIMD
@@ -494,6 +766,7 @@ void RX_API RxGetDefaultBalance(RxBalanceSetting *balance) {
 	balance->balance = RX_BALANCE_DEFAULT;           // lightness-color balance
 	balance->colorBalance = RX_COLORBALANCE_DEFAULT; // IQ balance
 	balance->enhanceColors = RX_TRUE;                // enhance largely used colors
+	balance->reclusterImprovement = RECLUSTER_IMPROVEMENT_DEFAULT; // refine until no color moves
 }
 
 void RX_API RxSetBalance(RxReduction *reduction, const RxBalanceSetting *balance) {
@@ -504,6 +777,7 @@ void RX_API RxSetBalance(RxReduction *reduction, const RxBalanceSetting *balance
 		effBalance.balance = balance->balance;
 		effBalance.colorBalance = balance->colorBalance;
 		effBalance.enhanceColors = balance->enhanceColors;
+		effBalance.reclusterImprovement = balance->reclusterImprovement;
 	} else {
 		//use the default balance parameters
 		RxGetDefaultBalance(&effBalance);
@@ -521,6 +795,7 @@ void RX_API RxSetBalance(RxReduction *reduction, const RxBalanceSetting *balance
 	RxiComputeAlphaInteraction(reduction);
 
 	reduction->enhanceColors = effBalance.enhanceColors;
+	RxSetReclusterPolicy(reduction, reduction->nReclusters, effBalance.reclusterImprovement);
 }
 
 RxStatus RX_API RxSetPaletteLayers(RxReduction *reduction, unsigned int nLayers) {
@@ -530,7 +805,23 @@ RxStatus RX_API RxSetPaletteLayers(RxReduction *reduction, unsigned int nLayers)
 	//the context must not have any histogram colors
 	if (reduction->histogram != NULL && reduction->histogram->nEntries > 0) return RX_STATUS_INCORRECT_STATE;
 
+	//an empty histogram kept for reuse is sized for the old layer count, so discard it.
+	if (reduction->histogram != NULL && reduction->histogram->nLayers != nLayers) {
+		RxiHistFree(reduction->histogram);
+		RxiHistFreeFlat(&reduction->histogramFlat);
+		reduction->histogram = NULL;
+	}
+
 	reduction->paletteLayers = nLayers;
+
+	//select the routines specialized for a single layer
+	if (nLayers == 1) {
+		reduction->histAddColor = RxiHistAddColor1;
+		reduction->computePrincipal = RxiHistComputePrincipal1;
+	} else {
+		reduction->histAddColor = RxiHistAddColorAny;
+		reduction->computePrincipal = RxiHistComputePrincipalAny;
+	}
 	return RX_STATUS_OK;
 }
 
@@ -545,10 +836,10 @@ static void RxiInit(RxReduction *reduction, const RxBalanceSetting *balance) {
 	reduction->meanI2 = MEAN_I2;
 	reduction->meanQ2 = MEAN_Q2;
 
+	reduction->nReclusters = RECLUSTER_DEFAULT;
 	RxSetBalance(reduction, balance);
 	RxSetPaletteLayers(reduction, 1);
 
-	reduction->nReclusters = RECLUSTER_DEFAULT;
 	reduction->nPaletteColors = RX_PALETTE_MAX_SIZE;
 	reduction->maskColors = RxMaskColorToDS15;
 	reduction->alphaMode = RX_ALPHA_NONE; // default: no alpha processing
@@ -573,7 +864,7 @@ void RX_API RxAssumeCompositingDistribution(RxReduction *reduction, const COLOR3
 
 		for (unsigned int i = 0; i < nCols; i++) {
 			RxYiqColor yiq;
-			RxConvertRgbToYiq(cols[i], &yiq);
+			RxiConvertRgbToYiq(cols[i], &yiq);
 
 			sumY += yiq.y;
 			sumI += yiq.i;
@@ -627,6 +918,119 @@ void RX_API RxSetProgressCallback(RxReduction *reduction, RxProgressCallback cal
 	reduction->progressCallbackData = userData;
 }
 
+void RX_API RxSetDitherMode(RxReduction *reduction, RxDitherMode mode) {
+	reduction->ditherMode = mode;
+}
+
+void RX_API RxSetDitherOrigin(RxReduction *reduction, unsigned int x, unsigned int y) {
+	reduction->ditherOriginX = x;
+	reduction->ditherOriginY = y;
+}
+
+void RX_API RxSetReclusterPolicy(RxReduction *reduction, int nReclusters, double minImprovement) {
+	if (nReclusters < 0) nReclusters = 0;
+	if (!(minImprovement > 0.0)) minImprovement = 0.0;
+	reduction->nReclusters = nReclusters;
+	reduction->reclusterMinImprovement = minImprovement;
+}
+
+void RX_API RxGetReclusterStats(RxReduction *reduction, unsigned int *pRuns, unsigned int *pIterations) {
+	if (pRuns != NULL) *pRuns = reduction->nReclusterRuns;
+	if (pIterations != NULL) *pIterations = reduction->nReclusterIterations;
+}
+
+
+
+// ----- RGB to YIQ conversion cache
+
+static RxYiqCache *RxiGetYiqCache(RxReduction *reduction) {
+	//the cache is allocated on first use. NULL when it could not be allocated, in which case colors
+	//are converted directly.
+	if (reduction->yiqCache != NULL) return reduction->yiqCache;
+
+	RxYiqCache *cache = (RxYiqCache *) RxMemAlloc(sizeof(RxYiqCache));
+	if (cache == NULL) return NULL;
+
+	RxYiqColor black;
+	RxiConvertRgbToYiq(0, &black);
+	for (unsigned int i = 0; i < (1 << RX_YIQ_CACHE_BITS); i++) {
+		cache->rgb[i] = 0;
+		RxiColorCopy(&cache->yiq[i], &black);
+	}
+	cache->nLookups = 0;
+	cache->nHits = 0;
+
+	reduction->yiqCache = cache;
+	return cache;
+}
+
+static inline void RxiConvertRgbToYiqCached(RxYiqCache *cache, COLOR32 rgb, RxYiqColor *yiq) {
+	if (cache == NULL) {
+		RxiConvertRgbToYiq(rgb, yiq);
+		return;
+	}
+
+	unsigned int slot = (rgb * 0x9E3779B1u) >> (32 - RX_YIQ_CACHE_BITS);
+	cache->nLookups++;
+	if (cache->rgb[slot] == rgb) {
+		cache->nHits++;
+	} else {
+		RxiConvertRgbToYiq(rgb, &cache->yiq[slot]);
+		cache->rgb[slot] = rgb;
+	}
+	RxiColorCopy(yiq, &cache->yiq[slot]);
+}
+
+void RX_API RxConvertRgbToYiqCached(RxReduction *reduction, COLOR32 rgb, RxYiqColor *yiq) {
+	RxiConvertRgbToYiqCached(RxiGetYiqCache(reduction), rgb, yiq);
+}
+
+void RX_API RxGetConversionCacheStats(RxReduction *reduction, unsigned long long *pHits, unsigned long long *pLookups) {
+	unsigned long long nHits = 0, nLookups = 0;
+	if (reduction->yiqCache != NULL) {
+		nHits = reduction->yiqCache->nHits;
+		nLookups = reduction->yiqCache->nLookups;
+	}
+
+	if (pHits != NULL) *pHits = nHits;
+	if (pLookups != NULL) *pLookups = nLookups;
+}
+
+
+
+// ----- color to palette index cache
+
+static RxStatus RxiIndexCacheReserve(RxReduction *reduction) {
+	//allocate a cache for each worker thread. New entries belong to no palette generation.
+	unsigned int nCaches = TpGetThreadCount();
+	if (reduction->nIndexCaches >= nCaches) return RX_STATUS_OK;
+
+	RxIndexCache *caches = (RxIndexCache *) RxMemCalloc(nCaches, sizeof(RxIndexCache));
+	if (caches == NULL) return RX_STATUS_NOMEM;
+
+	if (reduction->nIndexCaches > 0) memcpy(caches, reduction->indexCaches, reduction->nIndexCaches * sizeof(RxIndexCache));
+	RxMemFree(reduction->indexCaches);
+	reduction->indexCaches = caches;
+	reduction->nIndexCaches = nCaches;
+	return RX_STATUS_OK;
+}
+
+static inline RxIndexCache *RxiGetIndexCache(RxReduction *reduction, unsigned int worker) {
+	//NULL when no cache could be allocated, in which case every color is searched.
+	if (worker >= reduction->nIndexCaches) return NULL;
+	return &reduction->indexCaches[worker];
+}
+
+static void RxiIndexCacheInvalidate(RxReduction *reduction) {
+	//generation 0 marks unused entries. When the counter wraps, the entries are cleared instead.
+	if (++reduction->paletteGeneration != 0) return;
+
+	for (unsigned int i = 0; i < reduction->nIndexCaches; i++) {
+		memset(reduction->indexCaches[i].generation, 0, sizeof(reduction->indexCaches[i].generation));
+	}
+	reduction->paletteGeneration = 1;
+}
+
 static void RxiUpdateProgress(RxReduction *reduction, unsigned int progress, unsigned int progressMax) {
 	if (reduction->progressCallback != NULL) {
 		reduction->progressCallback(reduction, progress, progressMax, reduction->progressCallbackData);
@@ -644,8 +1048,8 @@ int RxColorLightnessComparator(const void *d1, const void *d2) {
 	if (a1 != a2) return a1 - a2;
 
 	RxYiqColor yiq1, yiq2;
-	RxConvertRgbToYiq(c1, &yiq1);
-	RxConvertRgbToYiq(c2, &yiq2);
+	RxiConvertRgbToYiq(c1, &yiq1);
+	RxiConvertRgbToYiq(c2, &yiq2);
 
 	if (yiq1.y < yiq2.y) return -1;
 	if (yiq1.y > yiq2.y) return 1;
@@ -662,49 +1066,6 @@ static int RxiYiqComparator(const void *d1, const void *d2) {
 }
 
 
-// ----- internal allocator routines
-
-static void *RxiSlabAlloc(RxSlab *allocator, unsigned int size) {
-	RX_ASSUME(size <= RX_SLAB_SIZE);
-
-	//if no slab is allocated, allocate one.
-	if (allocator->allocation == NULL) {
-		allocator->allocation = RxMemCalloc(RX_SLAB_SIZE, 1);
-		allocator->pos = 0;
-		if (allocator->allocation == NULL) return NULL;
-	}
-
-	//search for a slab with a suitable size.
-	while ((allocator->pos + size) > RX_SLAB_SIZE) {
-		if (allocator->next == NULL) {
-			RxSlab *next = calloc(1, sizeof(RxSlab));
-			if (next == NULL) return NULL;
-
-			next->allocation = RxMemCalloc(RX_SLAB_SIZE, 1);
-			next->pos = 0;
-			allocator->next = next;
-			if (next->allocation == NULL) return NULL;
-		}
-		allocator = allocator->next;
-	}
-
-	void *res = (void *) (((uintptr_t) allocator->allocation) + allocator->pos);
-	allocator->pos += size;
-	return res;
-}
-
-static void RxiSlabFreeAll(RxSlab *allocator) {
-	if (allocator->allocation != NULL) RxMemFree(allocator->allocation);
-	allocator->allocation = NULL;
-
-	if (allocator->next != NULL) {
-		RxiSlabFreeAll(allocator->next);
-		allocator->next = NULL;
-	}
-}
-
-
-
 // ----- histogram routines
 
 //hash a color for use in the histogram
@@ -720,223 +1081,581 @@ static inline unsigned int RxiHistHashColor(const RxYiqColor *yiq) {
 #endif
 }
 
-RxStatus RxHistInit(RxReduction *reduction) {
-	if (reduction->histogram != NULL) RxHistClear(reduction);
+//get the hash table slot to start probing at for a color hash (Fibonacci hashing)
+static inline unsigned int RxiHistTablePos(unsigned int hash, unsigned int tableBits) {
+	return (hash * 0x9E3779B1u) >> (32 - tableBits);
+}
 
-	reduction->histogram = (RxHistogram *) calloc(1, sizeof(RxHistogram));
-	if (reduction->histogram == NULL) return RX_STATUS_NOMEM;
+static RxStatus RxiHistAllocTable(RxHistogram *histogram, unsigned int tableBits) {
+	RxHistSlot *table = (RxHistSlot *) calloc((size_t) 1 << tableBits, sizeof(RxHistSlot));
+	if (table == NULL) return RX_STATUS_NOMEM;
+
+	//insert the existing entries. These are all distinct, so we only need to find an empty slot.
+	unsigned int mask = (1u << tableBits) - 1;
+	for (int i = 0; i < histogram->nEntries; i++) {
+		unsigned int pos = RxiHistTablePos(histogram->hashes[i], tableBits);
+		while (table[pos].generation == histogram->generation) pos = (pos + 1) & mask;
+
+		table[pos].generation = histogram->generation;
+		table[pos].index = i;
+	}
 
-	reduction->histogram->firstSlot = RX_HISTOGRAM_SIZE;
+	free(histogram->table);
+	histogram->table = table;
+	histogram->tableBits = tableBits;
 	return RX_STATUS_OK;
 }
 
-void RX_API RxHistAddColor(RxReduction *reduction, const RxYiqColor *col, double weight) {
-	RxHistogram *histogram = reduction->histogram;
-	if (reduction->status != RX_STATUS_OK) return;
+static RxStatus RxiHistReserve(RxHistogram *histogram, int capacity) {
+	if (capacity <= histogram->capacity) return RX_STATUS_OK;
+
+	RxYiqColor *colors = (RxYiqColor *) RxMemAlloc(capacity * histogram->nLayers * sizeof(RxYiqColor));
+	double *weights = (double *) malloc(capacity * sizeof(double));
+	unsigned int *hashes = (unsigned int *) malloc(capacity * sizeof(unsigned int));
+	if (colors == NULL || weights == NULL || hashes == NULL) {
+		RxMemFree(colors);
+		free(weights);
+		free(hashes);
+		return RX_STATUS_NOMEM;
+	}
+
+	//move the existing entries
+	if (histogram->nEntries > 0) {
+		memcpy(colors, histogram->colors, histogram->nEntries * histogram->nLayers * sizeof(RxYiqColor));
+		memcpy(weights, histogram->weights, histogram->nEntries * sizeof(double));
+		memcpy(hashes, histogram->hashes, histogram->nEntries * sizeof(unsigned int));
+	}
+	RxMemFree(histogram->colors);
+	free(histogram->weights);
+	free(histogram->hashes);
+
+	histogram->colors = colors;
+	histogram->weights = weights;
+	histogram->hashes = hashes;
+	histogram->capacity = capacity;
+	return RX_STATUS_OK;
+}
 
-	unsigned int nLayer = reduction->paletteLayers;
+static void RxiHistFree(RxHistogram *histogram) {
+	free(histogram->table);
+	RxMemFree(histogram->colors);
+	free(histogram->weights);
+	free(histogram->hashes);
+	free(histogram);
+}
+
+static void RxiHistFreeFlat(RxHistFlat *flat) {
+	RxMemFree(flat->color);
+	free(flat->weight);
+	free(flat->value);
+	free(flat->entry);
+	free(flat->diff);
+	free(flat->member);
+	free(flat->candidate);
+	memset(flat, 0, sizeof(*flat));
+}
+
+static RxHistogram *RxiHistNew(unsigned int nLayers, unsigned int nColorsHint) {
+	RxHistogram *histogram = (RxHistogram *) calloc(1, sizeof(RxHistogram));
+	if (histogram == NULL) return NULL;
+
+	histogram->generation = 1;
+	histogram->nLayers = nLayers;
+
+	//size the histogram for the expected number of colors, up to a limit. It grows as colors are added.
+	if (nColorsHint == 0 || nColorsHint > RX_HISTOGRAM_INIT_COLORS) nColorsHint = RX_HISTOGRAM_INIT_COLORS;
+
+	unsigned int tableBits = RX_HISTOGRAM_MIN_BITS;
+	while ((1u << tableBits) < 2 * nColorsHint) tableBits++;
+
+	if (RxiHistReserve(histogram, nColorsHint) != RX_STATUS_OK || RxiHistAllocTable(histogram, tableBits) != RX_STATUS_OK) {
+		RxiHistFree(histogram);
+		return NULL;
+	}
+	return histogram;
+}
 
-	//update the first slot index with hash of new color
-	int slotIndex = RxiHistHashColor(col);
-	if (slotIndex < histogram->firstSlot) histogram->firstSlot = slotIndex;
+static void RxiHistReset(RxHistogram *histogram) {
+	//keep the histogram memory for reuse. Advancing the generation empties the hash table.
+	histogram->nEntries = 0;
+	histogram->totalWeight = 0.0;
+	if (++histogram->generation == 0) {
+		//the generation wrapped around, so the stale slots must be cleared.
+		memset(histogram->table, 0, ((size_t) 1 << histogram->tableBits) * sizeof(RxHistSlot));
+		histogram->generation = 1;
+	}
+}
+
+static RxStatus RxiHistInit(RxReduction *reduction, unsigned int nColorsHint) {
+	//an existing histogram is emptied, keeping its memory.
+	if (reduction->histogram != NULL) return RxHistClear(reduction);
+
+	reduction->histogram = RxiHistNew(reduction->paletteLayers, nColorsHint);
+	if (reduction->histogram == NULL) return RX_STATUS_NOMEM;
+	return RX_STATUS_OK;
+}
 
-	//find a slot with the same YIQA, or create a new one if none exists.
-	RxHistEntry **ppslot = &histogram->entries[slotIndex];
-	int slotUsed = *ppslot != NULL;
-	while (*ppslot != NULL) {
-		RxHistEntry *slot = *ppslot;
+RxStatus RxHistInit(RxReduction *reduction) {
+	return RxiHistInit(reduction, 0);
+}
 
-		//matching slot? add weight
-		if (RxiColorVecEqual(slot->color, col, nLayer)) {
-			slot->weight += weight;
-			return;
+static RX_FORCEINLINE int RxiHistAddColorN(RxHistogram *histogram, const RxYiqColor *col, double weight, RxBool *pCreated, unsigned int nLayer) {
+	//returns the index of the color's entry, or -1 when out of memory.
+	unsigned int hash = RxiHistHashColor(col);
+
+	//find the slot with the same YIQA, or an empty slot if none exists.
+	unsigned int mask = (1u << histogram->tableBits) - 1;
+	unsigned int pos = RxiHistTablePos(hash, histogram->tableBits);
+	while (histogram->table[pos].generation == histogram->generation) {
+		unsigned int index = histogram->table[pos].index;
+
+		//matching entry? add weight
+		if (histogram->hashes[index] == hash && RxiColorVecEqual(&histogram->colors[index * nLayer], col, nLayer)) {
+			histogram->weights[index] += weight;
+			if (pCreated != NULL) *pCreated = RX_FALSE;
+			return (int) index;
 		}
 
-		ppslot = &slot->next;
+		pos = (pos + 1) & mask;
 	}
 
-	RxHistEntry *slot = (RxHistEntry *) RxiSlabAlloc(&histogram->allocator, sizeof(RxHistEntry) + nLayer * sizeof(RxYiqColor));
-	if (slot == NULL) {
-		reduction->status = RX_STATUS_NOMEM;
-		return;
+	//make room for the new entry, keeping the table at most half full.
+	if (histogram->nEntries >= histogram->capacity) {
+		if (RxiHistReserve(histogram, 2 * histogram->capacity) != RX_STATUS_OK) return -1;
+	}
+	if (2 * (histogram->nEntries + 1) > (1 << histogram->tableBits)) {
+		if (RxiHistAllocTable(histogram, histogram->tableBits + 1) != RX_STATUS_OK) return -1;
+
+		//find the empty slot in the new table
+		mask = (1u << histogram->tableBits) - 1;
+		pos = RxiHistTablePos(hash, histogram->tableBits);
+		while (histogram->table[pos].generation == histogram->generation) pos = (pos + 1) & mask;
 	}
 
 	//put new color
-	*ppslot = slot;
-	RxiColorVecCopy(slot->color, col, nLayer);
-	slot->weight = weight;
-	slot->next = NULL;
-	slot->value = 0.0;
-	histogram->nEntries++;
+	int index = histogram->nEntries++;
+	histogram->table[pos].generation = histogram->generation;
+	histogram->table[pos].index = index;
+	RxiColorVecCopy(&histogram->colors[index * nLayer], col, nLayer);
+	histogram->weights[index] = weight;
+	histogram->hashes[index] = hash;
 	histogram->totalWeight += weight;
+	if (pCreated != NULL) *pCreated = RX_TRUE;
+	return index;
+}
 
-	if (!slotUsed) {
-		if (reduction->histogram->nSlotsUsed < RX_HISTOGRAM_SMALL) {
-			reduction->histogram->slotIndices[reduction->histogram->nSlotsUsed] = slotIndex;
-		}
-		reduction->histogram->nSlotsUsed++;
-	}
+static int RxiHistAddColor1(RxHistogram *histogram, const RxYiqColor *col, double weight, RxBool *pCreated) {
+	return RxiHistAddColorN(histogram, col, weight, pCreated, 1);
 }
 
-RxStatus RX_API RxHistFinalize(RxReduction *reduction) {
-	if (reduction->status != RX_STATUS_OK) return reduction->status;
-	if (reduction->histogramFlat != NULL) free(reduction->histogramFlat);
+static int RxiHistAddColorAny(RxHistogram *histogram, const RxYiqColor *col, double weight, RxBool *pCreated) {
+	return RxiHistAddColorN(histogram, col, weight, pCreated, histogram->nLayers);
+}
 
-	if (reduction->histogram == NULL) {
-		reduction->histogramFlat = NULL;
-		return RX_STATUS_OK;
-	}
+void RX_API RxHistAddColor(RxReduction *reduction, const RxYiqColor *col, double weight) {
+	if (reduction->status != RX_STATUS_OK) return;
 
-	reduction->histogramFlat = (RxHistEntry **) calloc(reduction->histogram->nEntries, sizeof(RxHistEntry *));
-	if (reduction->histogramFlat == NULL) {
-		return reduction->status = RX_STATUS_NOMEM;
+	if (reduction->histAddColor(reduction->histogram, col, weight, NULL) < 0) {
+		reduction->status = RX_STATUS_NOMEM;
 	}
+}
+
+static RxStatus RxiHistComputeOrder(const RxHistogram *histogram, int *order) {
+	//entries are grouped by color hash, in the order they were added within each group. When there
+	//are few distinct hashes, the groups are ordered by their first use, otherwise by their hash.
+	int nEntries = histogram->nEntries;
+	const unsigned int *hashes = histogram->hashes;
 
-	RxHistEntry **pos = reduction->histogramFlat;
+	if (nEntries <= RX_HISTOGRAM_SMALL) {
+		//few entries: gather each group as we meet its first entry.
+		unsigned char placed[RX_HISTOGRAM_SMALL] = { 0 };
+		int pos = 0;
+		for (int i = 0; i < nEntries; i++) {
+			if (placed[i]) continue;
 
-	if (reduction->histogram->nSlotsUsed > RX_HISTOGRAM_SMALL) {
-		//check the histogram's slots in order
-		for (int i = reduction->histogram->firstSlot; i < RX_HISTOGRAM_SIZE; i++) {
-			RxHistEntry *entry = reduction->histogram->entries[i];
+			for (int j = i; j < nEntries; j++) {
+				if (hashes[j] != hashes[i]) continue;
 
-			while (entry != NULL) {
-				*(pos++) = entry;
-				entry = entry->next;
+				order[pos++] = j;
+				placed[j] = 1;
 			}
 		}
-	} else {
-		//check only slots in the small histogram list
-		for (int i = 0; i < reduction->histogram->nSlotsUsed; i++) {
-			RxHistEntry *entry = reduction->histogram->entries[reduction->histogram->slotIndices[i]];
+		return RX_STATUS_OK;
+	}
 
-			while (entry != NULL) {
-				*(pos++) = entry;
-				entry = entry->next;
+	int *temp = (int *) malloc(nEntries * sizeof(int));
+	if (temp == NULL) return RX_STATUS_NOMEM;
+
+	//stable radix sort by hash, low 9 bits first then high 8 bits
+	unsigned int counts[512];
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < nEntries; i++) counts[hashes[i] & 0x1FF]++;
+	for (unsigned int i = 0, sum = 0; i < 512; i++) {
+		unsigned int count = counts[i];
+		counts[i] = sum;
+		sum += count;
+	}
+	for (int i = 0; i < nEntries; i++) temp[counts[hashes[i] & 0x1FF]++] = i;
+
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < nEntries; i++) counts[hashes[i] >> 9]++;
+	for (unsigned int i = 0, sum = 0; i < 256; i++) {
+		unsigned int count = counts[i];
+		counts[i] = sum;
+		sum += count;
+	}
+	for (int i = 0; i < nEntries; i++) order[counts[hashes[temp[i]] >> 9]++] = temp[i];
+
+	//find the group boundaries, giving up once there are too many groups to reorder.
+	int groupStarts[RX_HISTOGRAM_SMALL + 1];
+	int nGroups = 0;
+	for (int i = 0; i < nEntries && nGroups <= RX_HISTOGRAM_SMALL; i++) {
+		if (i > 0 && hashes[order[i]] == hashes[order[i - 1]]) continue;
+		if (nGroups < RX_HISTOGRAM_SMALL) groupStarts[nGroups] = i;
+		nGroups++;
+	}
+
+	if (nGroups <= RX_HISTOGRAM_SMALL) {
+		//order the groups by their first entry, which is the first in the group since the sort is stable.
+		int groupOrder[RX_HISTOGRAM_SMALL];
+		groupStarts[nGroups] = nEntries;
+		for (int i = 0; i < nGroups; i++) {
+			int j = i;
+			for (; j > 0 && order[groupStarts[groupOrder[j - 1]]] > order[groupStarts[i]]; j--) {
+				groupOrder[j] = groupOrder[j - 1];
 			}
+			groupOrder[j] = i;
+		}
+
+		int pos = 0;
+		for (int i = 0; i < nGroups; i++) {
+			int g = groupOrder[i];
+			for (int j = groupStarts[g]; j < groupStarts[g + 1]; j++) temp[pos++] = order[j];
 		}
+		memcpy(order, temp, nEntries * sizeof(int));
 	}
 
+	free(temp);
 	return RX_STATUS_OK;
 }
 
-RxStatus RX_API RxHistAdd(RxReduction *reduction, const COLOR32 *img, unsigned int width, unsigned int height) {
-	if (reduction->histogram == NULL) {
-		RxStatus status = RxHistInit(reduction);
-		if (status != RX_STATUS_OK) return reduction->status = status;
-	}
-	
-	if (width == 0 || height == 0) return reduction->status;
-
-	//create YIQ data buffer, 1px overhang in all directions where pixels are duplicated
-	unsigned int padWidth = width + 2, padHeight = height + 2, nLayer = reduction->paletteLayers;
-	unsigned int nPxSrc = width * height;
-	
-	unsigned int bufferSize = padWidth * padHeight * nLayer;
-	RxYiqColor *yiqbuf = reduction->imgBuffer;
-	if (bufferSize > RX_TEMP_IMG_BUF_SIZE) {
-		//allocate buffer on the heap if large enough
-		yiqbuf = (RxYiqColor *) RxMemAlloc(bufferSize * sizeof(RxYiqColor));
-	}
-
-	if (yiqbuf == NULL) {
-		return reduction->status = RX_STATUS_NOMEM;
-	}
+RxStatus RX_API RxHistFinalize(RxReduction *reduction) {
+	if (reduction->status != RX_STATUS_OK) return reduction->status;
 
-	//convert input data into YIQ space. We rearrange the data to being indexed as
-	//[layer][y][x], to [y][x][layer].
-	for (unsigned int i = 0; i < nLayer; i++) {
-		const COLOR32 *imgI = img + i * nPxSrc;
+	RxHistFlat *flat = &reduction->histogramFlat;
+	flat->nEntries = 0;
+	if (reduction->histogram == NULL) return RX_STATUS_OK;
 
-		for (unsigned int y = 0; y < height; y++) {
-			for (unsigned int x = 0; x < width; x++) {
-				RxConvertRgbToYiq(imgI[x + y * width], &yiqbuf[((x + 1) + (y + 1) * padWidth) * nLayer + i]);
-			}
+	RxHistogram *histogram = reduction->histogram;
+	int nEntries = histogram->nEntries;
+	unsigned int nLayers = histogram->nLayers;
+	if (nEntries == 0) return RX_STATUS_OK;
+
+	if (nEntries > flat->capacity) {
+		RxiHistFreeFlat(flat);
+		flat->color = (RxYiqColor *) RxMemAlloc(nEntries * nLayers * sizeof(RxYiqColor));
+		flat->weight = (double *) malloc(nEntries * sizeof(double));
+		flat->value = (double *) malloc(nEntries * sizeof(double));
+		flat->entry = (int *) malloc(nEntries * sizeof(int));
+		flat->diff = (double *) malloc(nEntries * sizeof(double));
+		flat->member = (int *) malloc(nEntries * sizeof(int));
+		flat->candidate = (RxVoronoiCandidate *) malloc(nEntries * sizeof(RxVoronoiCandidate));
+		if (flat->color == NULL || flat->weight == NULL || flat->value == NULL || flat->entry == NULL
+			|| flat->diff == NULL || flat->member == NULL || flat->candidate == NULL) {
+			RxiHistFreeFlat(flat);
+			return reduction->status = RX_STATUS_NOMEM;
 		}
+		flat->capacity = nEntries;
 	}
 
-	//copy pixels into the overhang areas
-	for (unsigned int y = 0; y < height; y++) {
-		RxYiqColor *row = &yiqbuf[(y + 1) * padWidth * nLayer];
+	//the order is computed into the cluster indices, which are unused until clustering.
+	int *order = flat->entry;
+	RxStatus status = RxiHistComputeOrder(histogram, order);
+	if (status != RX_STATUS_OK) return reduction->status = status;
 
-		RxiColorVecCopy(&row[0], &row[1 * nLayer], nLayer);
-		RxiColorVecCopy(&row[(width + 1) * nLayer], &row[width * nLayer], nLayer);
+	for (int i = 0; i < nEntries; i++) {
+		int index = order[i];
+		RxiColorVecCopy(&flat->color[i * nLayers], &histogram->colors[index * nLayers], nLayers);
+		flat->weight[i] = histogram->weights[index];
+		flat->value[i] = 0.0;
+		flat->entry[i] = 0;
 	}
-	RxiColorVecCopy(&yiqbuf[0 * padWidth * nLayer], &yiqbuf[padWidth * nLayer], padWidth * nLayer);
-	RxiColorVecCopy(&yiqbuf[(height + 1) * padWidth * nLayer], &yiqbuf[height * padWidth * nLayer], padWidth * nLayer);
-
-
-	for (unsigned int y = 0; y < height; y++) {
-		
-		RxYiqColor *row0 = &yiqbuf[(y + 0) * padWidth * nLayer];
-		RxYiqColor *row1 = &yiqbuf[(y + 1) * padWidth * nLayer];
-		RxYiqColor *row2 = &yiqbuf[(y + 2) * padWidth + nLayer];
-
-		for (unsigned int x = 0; x < width; x++) {
 
-			RxYiqColor *top = &row0[(x + 1) * nLayer];
-			RxYiqColor *bottom = &row2[(x + 1) * nLayer];
-			RxYiqColor *left = &row1[(x + 0) * nLayer];
-			RxYiqColor *right = &row1[(x + 2) * nLayer];
-			RxYiqColor *center = &row1[(x + 1) * nLayer];
+	flat->nEntries = nEntries;
+	return RX_STATUS_OK;
+}
 
-			//copy the center color to a temporary location as we may modify the color based on the alpha
-			//mode, and do not want this to affect the weighting calculations of other pixels.
-			RxYiqColor *col = reduction->tempLayeredColor;
-			RxiColorVecCopy(col, center, nLayer);
+static inline double RxiHistComputePixel(RxReduction *reduction, const RxYiqColor *yiqbuf, unsigned int padWidth, unsigned int x, unsigned int y, RxYiqColor *col) {
+	unsigned int nLayer = reduction->paletteLayers;
 
-			//when we calculate the weight of multiple colors, we take the weight to be the sum of weights
-			//of individual colors. This allows a color where there exist completely transparent pixels
-			//but receive a nonzero weight since one color may be opaque. Only when all individual colors
-			//have a zero weight do we discard an input pixel.
+	const RxYiqColor *row0 = &yiqbuf[(y + 0) * padWidth * nLayer];
+	const RxYiqColor *row1 = &yiqbuf[(y + 1) * padWidth * nLayer];
+	const RxYiqColor *row2 = &yiqbuf[(y + 2) * padWidth + nLayer];
 
-			//compute weight, accumulated per layer
-			double totalWeight = 0.0;
-			for (unsigned int i = 0; i < reduction->paletteLayers; i++) {
-				double yInter = 0.25 * (left[i].y + right[i].y + top[i].y + bottom[i].y);
-				double yCenter = center->y;
-				double yDiff = fabs(yCenter - yInter);
-				double weight = 16.0 - fabs(16.0 - yDiff) / 8.0;
-				if (weight < 1.0) weight = 1.0;
-
-				//process the alpha value.
-				switch (reduction->alphaMode) {
-					case RX_ALPHA_NONE:
-					case RX_ALPHA_RESERVE:
-						//we use tha alpha threshold here since these alpha modes imply binary alpha.
-						if (col[i].a < reduction->fAlphaThreshold) {
-							RxiColorMakeTransparent(&col[i]);
-							weight = 0.0;
-						} else {
-							RxiColorMakeOpaque(&col[i]);
-						}
-						break;
+	const RxYiqColor *top = &row0[(x + 1) * nLayer];
+	const RxYiqColor *bottom = &row2[(x + 1) * nLayer];
+	const RxYiqColor *left = &row1[(x + 0) * nLayer];
+	const RxYiqColor *right = &row1[(x + 2) * nLayer];
+	const RxYiqColor *center = &row1[(x + 1) * nLayer];
 
-					case RX_ALPHA_PIXEL:
-						//we'll discard alpha=0 since it doesn't need to appear in the palette.
-						weight *= col[i].a;
-						if (col[i].a > 0.0f) RxiColorMakeOpaque(&col[i]);
-						break;
+	//copy the center color to a temporary location as we may modify the color based on the alpha
+	//mode, and do not want this to affect the weighting calculations of other pixels.
+	RxiColorVecCopy(col, center, nLayer);
 
-					case RX_ALPHA_PALETTE:
-						//we explicitly must pass all alpha values.
-						break;
+	//when we calculate the weight of multiple colors, we take the weight to be the sum of weights
+	//of individual colors. This allows a color where there exist completely transparent pixels
+	//but receive a nonzero weight since one color may be opaque. Only when all individual colors
+	//have a zero weight do we discard an input pixel.
 
-					default:
-						//must not reach here
-						RX_ASSUME(0);
+	//compute weight, accumulated per layer
+	double totalWeight = 0.0;
+	for (unsigned int i = 0; i < nLayer; i++) {
+		double yInter = 0.25 * (left[i].y + right[i].y + top[i].y + bottom[i].y);
+		double yCenter = center->y;
+		double yDiff = fabs(yCenter - yInter);
+		double weight = 16.0 - fabs(16.0 - yDiff) / 8.0;
+		if (weight < 1.0) weight = 1.0;
+
+		//process the alpha value.
+		switch (reduction->alphaMode) {
+			case RX_ALPHA_NONE:
+			case RX_ALPHA_RESERVE:
+				//we use tha alpha threshold here since these alpha modes imply binary alpha.
+				if (col[i].a < reduction->fAlphaThreshold) {
+					RxiColorMakeTransparent(&col[i]);
+					weight = 0.0;
+				} else {
+					RxiColorMakeOpaque(&col[i]);
 				}
+				break;
 
-				totalWeight += weight;
-			}
+			case RX_ALPHA_PIXEL:
+				//we'll discard alpha=0 since it doesn't need to appear in the palette.
+				weight *= col[i].a;
+				if (col[i].a > 0.0f) RxiColorMakeOpaque(&col[i]);
+				break;
 
-			//add the color to the histogram only if its total weight was nonzero.
-			if (totalWeight > 0.0) {
-				RxHistAddColor(reduction, col, totalWeight);
-			}
+			case RX_ALPHA_PALETTE:
+				//we explicitly must pass all alpha values.
+				break;
+
+			default:
+				//must not reach here
+				RX_ASSUME(0);
 		}
+
+		totalWeight += weight;
 	}
+	return totalWeight;
+}
 
-	if (yiqbuf != reduction->imgBuffer) RxMemFree(yiqbuf);
+//workspace of one band of rows of RxHistAdd
+typedef struct RxiHistBand_ {
+	RxHistogram *histogram;       // distinct colors of the band
+	int *pxEntries;               // per pixel: entry in the band histogram, or -1 for pixels without weight
+	double *pxWeights;            // per pixel: weight
+	RxStatus status;
+} RxiHistBand;
+
+typedef struct RxiHistAddWork_ {
+	RxReduction *reduction;
+	const COLOR32 *img;
+	RxYiqColor *yiqbuf;
+	unsigned int width;
+	unsigned int height;
+	unsigned int padWidth;
+	unsigned int firstBand;       // index of the first band of the current round
+	RxiHistBand *bands;           // band workspaces of the current round
+} RxiHistAddWork;
+
+static void RxiHistConvertBand(void *param, unsigned int index, unsigned int worker) {
+	RxiHistAddWork *work = (RxiHistAddWork *) param;
+	(void) worker;
+	unsigned int nLayer = work->reduction->paletteLayers, width = work->width, padWidth = work->padWidth;
+	unsigned int yStart = index * RX_HISTOGRAM_BAND_ROWS, yEnd = yStart + RX_HISTOGRAM_BAND_ROWS;
+	if (yEnd > work->height) yEnd = work->height;
+
+	//convert input data into YIQ space. We rearrange the data to being indexed as
+	//[layer][y][x], to [y][x][layer].
+	for (unsigned int i = 0; i < nLayer; i++) {
+		const COLOR32 *imgI = work->img + i * width * work->height;
+
+		for (unsigned int y = yStart; y < yEnd; y++) {
+			RxiConvertRgbToYiqBatch(imgI + y * width, &work->yiqbuf[(1 + (y + 1) * padWidth) * nLayer + i], nLayer, width);
+		}
+	}
+}
+
+static void RxiHistAddBand(void *param, unsigned int index, unsigned int worker) {
+	(void) worker;
+	RxiHistAddWork *work = (RxiHistAddWork *) param;
+	RxiHistBand *band = &work->bands[index];
+	unsigned int yStart = (work->firstBand + index) * RX_HISTOGRAM_BAND_ROWS, yEnd = yStart + RX_HISTOGRAM_BAND_ROWS;
+	if (yEnd > work->height) yEnd = work->height;
+
+	//collect the distinct colors of the band, and remember the entry and weight of every pixel.
+	RxYiqColor col[RX_PALETTE_MAX_COUNT];
+	unsigned int iPx = 0;
+	for (unsigned int y = yStart; y < yEnd; y++) {
+		for (unsigned int x = 0; x < work->width; x++) {
+			double weight = RxiHistComputePixel(work->reduction, work->yiqbuf, work->padWidth, x, y, col);
+
+			band->pxWeights[iPx] = weight;
+			band->pxEntries[iPx] = -1;
+			if (weight > 0.0) {
+				band->pxEntries[iPx] = work->reduction->histAddColor(band->histogram, col, weight, NULL);
+				if (band->pxEntries[iPx] < 0) {
+					band->status = RX_STATUS_NOMEM;
+					return;
+				}
+			}
+			iPx++;
+		}
+	}
+	band->status = RX_STATUS_OK;
+}
+
+static RxStatus RxiHistMergeBand(RxReduction *reduction, const RxiHistBand *band, unsigned int nPx, int *map, RxBool *created) {
+	//add the band's colors in the order they were found, which is the order the pixels would add them in.
+	RxHistogram *histogram = reduction->histogram;
+	const RxHistogram *bandHistogram = band->histogram;
+	for (int i = 0; i < bandHistogram->nEntries; i++) {
+		map[i] = reduction->histAddColor(histogram, &bandHistogram->colors[i * bandHistogram->nLayers], 0.0, &created[i]);
+		if (map[i] < 0) return RX_STATUS_NOMEM;
+	}
+
+	//add the weights pixel by pixel, so the sums round exactly as if the pixels were added one at a time.
+	//The total weight counts the first weight of every new color.
+	for (unsigned int i = 0; i < nPx; i++) {
+		int entry = band->pxEntries[i];
+		if (entry < 0) continue;
+
+		if (created[entry]) {
+			histogram->totalWeight += band->pxWeights[i];
+			created[entry] = RX_FALSE;
+		}
+		histogram->weights[map[entry]] += band->pxWeights[i];
+	}
+	return RX_STATUS_OK;
+}
+
+static RxStatus RxiHistAddBands(RxReduction *reduction, RxiHistAddWork *work, unsigned int nBands) {
+	//bands are processed in rounds. The bands of a round are built in parallel and merged in order.
+	unsigned int nBandsRound = 2 * TpGetThreadCount();
+	if (nBandsRound > nBands) nBandsRound = nBands;
+
+	unsigned int nBandPx = RX_HISTOGRAM_BAND_ROWS * work->width;
+	RxiHistBand *bands = (RxiHistBand *) calloc(nBandsRound, sizeof(RxiHistBand));
+	int *map = (int *) malloc(nBandPx * sizeof(int));
+	RxBool *created = (RxBool *) malloc(nBandPx * sizeof(RxBool));
+
+	RxStatus status = RX_STATUS_OK;
+	if (bands == NULL || map == NULL || created == NULL) status = RX_STATUS_NOMEM;
+
+	for (unsigned int i = 0; i < nBandsRound && status == RX_STATUS_OK; i++) {
+		bands[i].histogram = RxiHistNew(reduction->paletteLayers, nBandPx);
+		bands[i].pxEntries = (int *) malloc(nBandPx * sizeof(int));
+		bands[i].pxWeights = (double *) malloc(nBandPx * sizeof(double));
+		if (bands[i].histogram == NULL || bands[i].pxEntries == NULL || bands[i].pxWeights == NULL) status = RX_STATUS_NOMEM;
+	}
+
+	work->bands = bands;
+	for (unsigned int firstBand = 0; firstBand < nBands && status == RX_STATUS_OK; firstBand += nBandsRound) {
+		unsigned int nRound = nBands - firstBand;
+		if (nRound > nBandsRound) nRound = nBandsRound;
+
+		for (unsigned int i = 0; i < nRound; i++) RxiHistReset(bands[i].histogram);
+		work->firstBand = firstBand;
+		TpParallelFor(nRound, RxiHistAddBand, work);
+
+		for (unsigned int i = 0; i < nRound && status == RX_STATUS_OK; i++) {
+			unsigned int yStart = (firstBand + i) * RX_HISTOGRAM_BAND_ROWS, nRows = RX_HISTOGRAM_BAND_ROWS;
+			if (yStart + nRows > work->height) nRows = work->height - yStart;
+
+			status = bands[i].status;
+			if (status == RX_STATUS_OK) status = RxiHistMergeBand(reduction, &bands[i], nRows * work->width, map, created);
+		}
+	}
+
+	if (bands != NULL) {
+		for (unsigned int i = 0; i < nBandsRound; i++) {
+			if (bands[i].histogram != NULL) RxiHistFree(bands[i].histogram);
+			free(bands[i].pxEntries);
+			free(bands[i].pxWeights);
+		}
+	}
+	free(bands);
+	free(map);
+	free(created);
+	return status;
+}
+
+RxStatus RX_API RxHistAdd(RxReduction *reduction, const COLOR32 *img, unsigned int width, unsigned int height) {
+	if (reduction->histogram == NULL) {
+		//small images get a histogram sized for their pixel count
+		RxStatus status = RxiHistInit(reduction, width * height);
+		if (status != RX_STATUS_OK) return reduction->status = status;
+	}
+	
+	if (width == 0 || height == 0) return reduction->status;
+	if (reduction->status != RX_STATUS_OK) return reduction->status;
+
+	//create YIQ data buffer, 1px overhang in all directions where pixels are duplicated
+	unsigned int padWidth = width + 2, padHeight = height + 2, nLayer = reduction->paletteLayers;
+	
+	unsigned int bufferSize = padWidth * padHeight * nLayer;
+	RxYiqColor *yiqbuf = reduction->imgBuffer;
+	if (bufferSize > RX_TEMP_IMG_BUF_SIZE) {
+		//allocate buffer on the heap if large enough
+		yiqbuf = (RxYiqColor *) RxMemAlloc(bufferSize * sizeof(RxYiqColor));
+	}
+
+	if (yiqbuf == NULL) {
+		return reduction->status = RX_STATUS_NOMEM;
+	}
+
+	//the image is processed in bands of rows, which are independent given the padded YIQ buffer.
+	RxiHistAddWork work = { 0 };
+	work.reduction = reduction;
+	work.img = img;
+	work.yiqbuf = yiqbuf;
+	work.width = width;
+	work.height = height;
+	work.padWidth = padWidth;
+
+	unsigned int nBands = (height + RX_HISTOGRAM_BAND_ROWS - 1) / RX_HISTOGRAM_BAND_ROWS;
+	TpParallelFor(nBands, RxiHistConvertBand, &work);
+
+	//copy pixels into the overhang areas
+	for (unsigned int y = 0; y < height; y++) {
+		RxYiqColor *row = &yiqbuf[(y + 1) * padWidth * nLayer];
+
+		RxiColorVecCopy(&row[0], &row[1 * nLayer], nLayer);
+		RxiColorVecCopy(&row[(width + 1) * nLayer], &row[width * nLayer], nLayer);
+	}
+	RxiColorVecCopy(&yiqbuf[0 * padWidth * nLayer], &yiqbuf[padWidth * nLayer], padWidth * nLayer);
+	RxiColorVecCopy(&yiqbuf[(height + 1) * padWidth * nLayer], &yiqbuf[height * padWidth * nLayer], padWidth * nLayer);
+
+	if (nBands > 1 && TpGetThreadCount() > 1) {
+		//build the histograms of bands in parallel and merge them.
+		RxStatus status = RxiHistAddBands(reduction, &work, nBands);
+		if (status != RX_STATUS_OK) reduction->status = status;
+	} else {
+		//add pixels one at a time
+		RxYiqColor *col = reduction->tempLayeredColor;
+		for (unsigned int y = 0; y < height; y++) {
+			for (unsigned int x = 0; x < width; x++) {
+				double totalWeight = RxiHistComputePixel(reduction, yiqbuf, padWidth, x, y, col);
+
+				//add the color to the histogram only if its total weight was nonzero.
+				if (totalWeight > 0.0) {
+					RxHistAddColor(reduction, col, totalWeight);
+				}
+			}
+		}
+	}
+
+	if (yiqbuf != reduction->imgBuffer) RxMemFree(yiqbuf);
 
 	return reduction->status;
 }
@@ -945,12 +1664,11 @@ double RX_API RxHistComputePaletteErrorYiq(RxReduction *reduction, const RxYiqCo
 	double error = 0.0;
 
 	//sum total weighted squared differences
+	RxHistFlat *flat = &reduction->histogramFlat;
 	for (int i = 0; i < reduction->histogram->nEntries; i++) {
-		RxHistEntry *entry = reduction->histogramFlat[i];
-
 		double diff = 0.0;
-		(void) RxiPaletteFindClosestColor(reduction, palette, nColors, &entry->color[0], &diff);
-		error += diff * entry->weight;
+		(void) RxiPaletteFindClosestColor(reduction, palette, nColors, &flat->color[i * reduction->paletteLayers], &diff);
+		error += diff * flat->weight[i];
 
 		if (error >= maxError) return maxError;
 	}
@@ -965,7 +1683,7 @@ double RX_API RxHistComputePaletteError(RxReduction *reduction, const COLOR32 *p
 
 	//convert palette colors
 	for (unsigned int i = 0; i < nColors; i++) {
-		RxConvertRgbToYiq(palette[i], &yiqPalette[i]);
+		RxiConvertRgbToYiq(palette[i], &yiqPalette[i]);
 	}
 
 	double error = RxHistComputePaletteErrorYiq(reduction, yiqPalette, nColors, maxError);
@@ -994,14 +1712,6 @@ static int RxiPaletteFindClosestColor(RxReduction *reduction, const RxYiqColor *
 	return leastIndex;
 }
 
-static int RxiPaletteFindClosestRgbColor(RxReduction *reduction, const RxYiqColor *palette, unsigned int nColors, COLOR32 col, double *outDiff) {
-	//TODO: col: scalar color?
-	RxYiqColor yiq;
-	RxConvertRgbToYiq(col, &yiq);
-
-	return RxiPaletteFindClosestColor(reduction, palette, nColors, &yiq, outDiff);
-}
-
 
 
 // ----- clustering code
@@ -1017,46 +1727,131 @@ static void RxiColorNodeFreeAll(RxReduction *reduction) {
 	}
 
 	memset(reduction->colorNodes, 0, sizeof(reduction->colorNodes));
+	reduction->nSplitHeap = 0;
 }
 
-static RxColorNode *RxiFindSplittableColorNode(RxReduction *reduction) {
-	RxColorNode *found = NULL;
+static COLOR32 *RxiColorNodeGetMasked(RxReduction *reduction, RxColorNode *node) {
+	//the masked RGB colors are stored after the node's YIQ colors
+	return (COLOR32 *) (node->color + reduction->paletteLayers);
+}
 
-	for (unsigned int i = 0; i < reduction->nUsedColors; i++) {
-		RxColorNode *node = reduction->colorNodes[i];
-		
-		//if the node is splittable, choose it at a higher priority
-		if (node->canSplit && (found == NULL || node->priority > found->priority)) {
-			found = node;
-		}
+static void RxiColorNodeAddToList(RxReduction *reduction, RxColorNode *node) {
+	//slot new node into the array. Nodes stay in creation order, which the serial number records.
+	RX_ASSUME(reduction->nUsedColors < RX_PALETTE_MAX_SIZE);
+	node->heapIndex = -1;
+	node->serial = reduction->nodeSerial++;
+	reduction->colorNodes[reduction->nUsedColors++] = node;
+}
+
+// ----- split heap: splittable nodes ordered by priority, ties going to the earliest created node
+
+static RxBool RxiSplitHeapBefore(const RxColorNode *a, const RxColorNode *b) {
+	if (a->priority != b->priority) return a->priority > b->priority;
+	return a->serial < b->serial;
+}
+
+static void RxiSplitHeapPlace(RxReduction *reduction, RxColorNode *node, unsigned int i) {
+	reduction->splitHeap[i] = node;
+	node->heapIndex = i;
+}
+
+static void RxiSplitHeapSiftUp(RxReduction *reduction, unsigned int i) {
+	RxColorNode *node = reduction->splitHeap[i];
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 2;
+		if (!RxiSplitHeapBefore(node, reduction->splitHeap[parent])) break;
+
+		RxiSplitHeapPlace(reduction, reduction->splitHeap[parent], i);
+		i = parent;
 	}
-	return found;
+	RxiSplitHeapPlace(reduction, node, i);
+}
+
+static void RxiSplitHeapSiftDown(RxReduction *reduction, unsigned int i) {
+	RxColorNode *node = reduction->splitHeap[i];
+	unsigned int n = reduction->nSplitHeap;
+	while (1) {
+		unsigned int child = 2 * i + 1;
+		if (child >= n) break;
+		if (child + 1 < n && RxiSplitHeapBefore(reduction->splitHeap[child + 1], reduction->splitHeap[child])) child++;
+		if (!RxiSplitHeapBefore(reduction->splitHeap[child], node)) break;
+
+		RxiSplitHeapPlace(reduction, reduction->splitHeap[child], i);
+		i = child;
+	}
+	RxiSplitHeapPlace(reduction, node, i);
+}
+
+static void RxiSplitHeapPush(RxReduction *reduction, RxColorNode *node) {
+	//only splittable nodes are queued
+	if (!node->canSplit) return;
+
+	RX_ASSUME(reduction->nSplitHeap < RX_PALETTE_MAX_SIZE);
+	unsigned int i = reduction->nSplitHeap++;
+	RxiSplitHeapPlace(reduction, node, i);
+	RxiSplitHeapSiftUp(reduction, i);
 }
 
-static void RxiHistComputePrincipal(RxReduction *reduction, int startIndex, int endIndex, double *axis, double *pVar) {
-	//clear work
-	memset(&reduction->pcaWork, 0, sizeof(reduction->pcaWork));
+static void RxiSplitHeapRemove(RxReduction *reduction, RxColorNode *node) {
+	if (node->heapIndex < 0) return;
 
-	double (*mtx)[4 * RX_PALETTE_MAX_COUNT] = reduction->pcaWork.cov;
-	double *means = reduction->pcaWork.means;   // vector: mean of each dimension
-	double *x = reduction->pcaWork.x;           // vector: temporary storage for each input vector
+	unsigned int i = (unsigned int) node->heapIndex;
+	node->heapIndex = -1;
+
+	//move the last node into the hole, and restore the heap order in whichever direction it's out of order.
+	RxColorNode *last = reduction->splitHeap[--reduction->nSplitHeap];
+	if (last == node) return;
+
+	RxiSplitHeapPlace(reduction, last, i);
+	if (i > 0 && RxiSplitHeapBefore(last, reduction->splitHeap[(i - 1) / 2])) {
+		RxiSplitHeapSiftUp(reduction, i);
+	} else {
+		RxiSplitHeapSiftDown(reduction, i);
+	}
+}
+
+static RxColorNode *RxiSplitHeapPop(RxReduction *reduction) {
+	//pop the highest priority splittable node
+	if (reduction->nSplitHeap == 0) return NULL;
+
+	RxColorNode *found = reduction->splitHeap[0];
+	RxiSplitHeapRemove(reduction, found);
+	return found;
+}
+
+//principal component analysis work, with the matrices stored with a row pitch
+typedef struct RxiPcaView_ {
+	double *x;
+	double *means;
+	double *cov;
+	double *z;
+	double *e;
+	double *b;
+	double *E;
+} RxiPcaView;
+
+static RX_FORCEINLINE void RxiHistComputePrincipalN(RxReduction *reduction, int startIndex, int endIndex, double *axis, double *pVar, unsigned int nLayers, const RxiPcaView *work, unsigned int pitch) {
+	//the means and the used part of the matrices must be cleared.
+	double *mtx = work->cov;
+	double *means = work->means;   // vector: mean of each dimension
+	double *x = work->x;           // vector: temporary storage for each input vector
 	double sumWeight = 0.0;
 
 	//dimension of vectors is 4 * [number of palettes] (YIQA for each input layer)
-	unsigned int dim = 4 * reduction->paletteLayers;
+	unsigned int dim = 4 * nLayers;
 
 	//compute the covariance matrix for the input range of colors.
 	for (int i = startIndex; i < endIndex; i++) {
-		RxHistEntry *entry = reduction->histogramFlat[i];
+		const RxYiqColor *color = &reduction->histogramFlat.color[i * nLayers];
 
-		for (unsigned int j = 0; j < reduction->paletteLayers; j++) {
-			x[j * 4 + 0] = reduction->yWeight * entry->color[j].y;
-			x[j * 4 + 1] = reduction->iWeight * entry->color[j].i;
-			x[j * 4 + 2] = reduction->qWeight * entry->color[j].q;
-			x[j * 4 + 3] = reduction->aWeight * entry->color[j].a;
+		for (unsigned int j = 0; j < nLayers; j++) {
+			x[j * 4 + 0] = reduction->yWeight * color[j].y;
+			x[j * 4 + 1] = reduction->iWeight * color[j].i;
+			x[j * 4 + 2] = reduction->qWeight * color[j].q;
+			x[j * 4 + 3] = reduction->aWeight * color[j].a;
 		}
 
-		double weight = entry->weight;
+		double weight = reduction->histogramFlat.weight[i];
 
 		if (reduction->alphaMode == RX_ALPHA_PALETTE) {
 			//in palette alpha mode, we ignore the alpha channel when running PCA, and scale the
@@ -1064,13 +1859,13 @@ static void RxiHistComputePrincipal(RxReduction *reduction, int startIndex, int
 			//creation of the histogram).
 			//TODO: how best to handle in the case where multiple palette layers make this no
 			//longer mathematically valid?
-			if (entry->color[0].a > 0.0f) {
-				double invA = 1.0 / entry->color[0].a;
+			if (color[0].a > 0.0f) {
+				double invA = 1.0 / color[0].a;
 				x[0] *= invA;
 				x[1] *= invA;
 				x[2] *= invA;
 			}
-			weight *= entry->color[0].a;
+			weight *= color[0].a;
 			x[3] = 0.0;
 		}
 
@@ -1081,7 +1876,7 @@ static void RxiHistComputePrincipal(RxReduction *reduction, int startIndex, int
 
 			//update covariances (upper diagonal elements)
 			for (unsigned int k = j; k < dim; k++) {
-				mtx[j][k] += weight * x[j] * x[k];
+				mtx[j * pitch + k] += weight * x[j] * x[k];
 			}
 		}
 
@@ -1097,10 +1892,10 @@ static void RxiHistComputePrincipal(RxReduction *reduction, int startIndex, int
 		for (unsigned int j = 0; j < dim; j++) {
 			if (i > j) {
 				//below diagonal: mirror elements on above diagonal
-				mtx[i][j] = mtx[j][i];
+				mtx[i * pitch + j] = mtx[j * pitch + i];
 			} else {
 				//finalize covariance calculation
-				mtx[i][j] = mtx[i][j] / sumWeight - means[i] * means[j];
+				mtx[i * pitch + j] = mtx[i * pitch + j] / sumWeight - means[i] * means[j];
 			}
 		}
 	}
@@ -1108,14 +1903,14 @@ static void RxiHistComputePrincipal(RxReduction *reduction, int startIndex, int
 	// ----- Jacobi eigenvalue calculation on the covariance matrix
 
 	//fill identity
-	double (*E)[4 * RX_PALETTE_MAX_COUNT] = reduction->pcaWork.E;
-	for (unsigned int i = 0; i < dim; i++) E[i][i] = 1.0;
+	double *E = work->E;
+	for (unsigned int i = 0; i < dim; i++) E[i * pitch + i] = 1.0;
 
-	double *z = reduction->pcaWork.z, *e = reduction->pcaWork.e, *b = reduction->pcaWork.b;
+	double *z = work->z, *e = work->e, *b = work->b;
 	memset(z, 0, dim * sizeof(double));
 
 	for (unsigned int i = 0; i < dim; i++) {
-		e[i] = mtx[i][i];
+		e[i] = mtx[i * pitch + i];
 		b[i] = e[i];
 	}
 	
@@ -1124,7 +1919,7 @@ static void RxiHistComputePrincipal(RxReduction *reduction, int startIndex, int
 		double sum = 0.0;
 		for (unsigned int k = 0; k < dim - 1; k++) {
 			for (unsigned int l = k + 1; l < dim; l++) {
-				sum += fabs(mtx[k][l]);
+				sum += fabs(mtx[k * pitch + l]);
 			}
 		}
 		if (sum == 0.0) break;
@@ -1134,24 +1929,24 @@ static void RxiHistComputePrincipal(RxReduction *reduction, int startIndex, int
 
 		for (unsigned int k = 0; k < dim - 1; k++) {
 			for (unsigned int l = k + 1; l < dim; l++) {
-				double g = 100.0 * fabs(mtx[k][l]);
+				double g = 100.0 * fabs(mtx[k * pitch + l]);
 				if (iter > 4 && (fabs(e[k]) + g) == fabs(e[k]) && (fabs(e[l]) + g) == fabs(e[l])) {
-					mtx[k][l] = 0.0;
+					mtx[k * pitch + l] = 0.0;
 					continue;
 				}
 
 				//"small" values
-				if (fabs(mtx[k][l]) <= th) continue;
+				if (fabs(mtx[k * pitch + l]) <= th) continue;
 
 				double d, f, h = e[l] - e[k];
 				if ((fabs(h) + g) == fabs(h)) {
-					d = mtx[k][l] / h;
-					f = d * mtx[k][l];
+					d = mtx[k * pitch + l] / h;
+					f = d * mtx[k * pitch + l];
 				} else {
-					double y = 0.5 * h / mtx[k][l];
+					double y = 0.5 * h / mtx[k * pitch + l];
 					d = 1.0 / (fabs(y) + sqrt(1.0 + y * y));
 					if (y < 0) d = -d;
-					f = d * mtx[k][l];
+					f = d * mtx[k * pitch + l];
 				}
 
 				double c2 = 1.0 / sqrt(1.0 + d * d);
@@ -1161,29 +1956,29 @@ static void RxiHistComputePrincipal(RxReduction *reduction, int startIndex, int
 				z[l] += f;
 				e[k] -= f;
 				e[l] += f;
-				mtx[k][l] = 0.0;
+				mtx[k * pitch + l] = 0.0;
 
 				//rotations
 				for (unsigned int i = 0; i < k; i++) {
-					double Sik = mtx[i][k], Sil = mtx[i][l];
-					mtx[i][k] = c * Sik - s * Sil;
-					mtx[i][l] = s * Sik + c * Sil;
+					double Sik = mtx[i * pitch + k], Sil = mtx[i * pitch + l];
+					mtx[i * pitch + k] = c * Sik - s * Sil;
+					mtx[i * pitch + l] = s * Sik + c * Sil;
 				}
 				for (unsigned int i = k + 1; i < l; i++) {
-					double Ski = mtx[k][i], Sil = mtx[i][l];
-					mtx[k][i] = c * Ski - s * Sil;
-					mtx[i][l] = s * Ski + c * Sil;
+					double Ski = mtx[k * pitch + i], Sil = mtx[i * pitch + l];
+					mtx[k * pitch + i] = c * Ski - s * Sil;
+					mtx[i * pitch + l] = s * Ski + c * Sil;
 				}
 				for (unsigned int i = l + 1; i < dim; i++) {
-					double Ski = mtx[k][i], Sli = mtx[l][i];
-					mtx[k][i] = c * Ski - s * Sli;
-					mtx[l][i] = s * Ski + c * Sli;
+					double Ski = mtx[k * pitch + i], Sli = mtx[l * pitch + i];
+					mtx[k * pitch + i] = c * Ski - s * Sli;
+					mtx[l * pitch + i] = s * Ski + c * Sli;
 				}
 
 				for (unsigned int i = 0; i < dim; i++) {
-					double Eik = E[i][k], Eil = E[i][l];
-					E[i][k] = c * Eik - s * Eil;
-					E[i][l] = s * Eik + c * Eil;
+					double Eik = E[i * pitch + k], Eil = E[i * pitch + l];
+					E[i * pitch + k] = c * Eik - s * Eil;
+					E[i * pitch + l] = s * Eik + c * Eil;
 				}
 			}
 		}
@@ -1207,14 +2002,132 @@ static void RxiHistComputePrincipal(RxReduction *reduction, int startIndex, int
 
 	//return the loadings and variance of PC1
 	for (unsigned int i = 0; i < dim; i++) {
-		axis[i] = E[i][eigenNo];
+		axis[i] = E[i * pitch + eigenNo];
 	}
 	*pVar = e[eigenNo];
 }
 
+static void RxiHistComputePrincipal1(RxReduction *reduction, int startIndex, int endIndex, double *axis, double *pVar) {
+	//single layer: accumulate only the 10 unique terms of the 4x4 covariance matrix.
+	double sy = 0.0, si = 0.0, sq = 0.0, sa = 0.0, sumWeight = 0.0;
+	double syy = 0.0, syi = 0.0, syq = 0.0, sya = 0.0, sii = 0.0, siq = 0.0, sia = 0.0, sqq = 0.0, sqa = 0.0, saa = 0.0;
+
+	for (int i = startIndex; i < endIndex; i++) {
+		const RxYiqColor *color = &reduction->histogramFlat.color[i];
+		double y = reduction->yWeight * color->y;
+		double c = reduction->iWeight * color->i;
+		double q = reduction->qWeight * color->q;
+		double a = reduction->aWeight * color->a;
+		double weight = reduction->histogramFlat.weight[i];
+
+		if (reduction->alphaMode == RX_ALPHA_PALETTE) {
+			//ignore alpha and scale the weight by it, as in RxiHistComputePrincipalN.
+			if (color->a > 0.0f) {
+				double invA = 1.0 / color->a;
+				y *= invA;
+				c *= invA;
+				q *= invA;
+			}
+			weight *= color->a;
+			a = 0.0;
+		}
+
+		double wy = weight * y, wi = weight * c, wq = weight * q, wa = weight * a;
+		sy += wy; si += wi; sq += wq; sa += wa;
+		syy += wy * y; syi += wy * c; syq += wy * q; sya += wy * a;
+		sii += wi * c; siq += wi * q; sia += wi * a;
+		sqq += wq * q; sqa += wq * a;
+		saa += wa * a;
+		sumWeight += weight;
+	}
+
+	memset(axis, 0, 4 * sizeof(double));
+	*pVar = 0.0;
+	if (!(sumWeight > 0.0)) {
+		axis[0] = 1.0;
+		return;
+	}
+
+	//finalize the covariance matrix
+	double my = sy / sumWeight, mi = si / sumWeight, mq = sq / sumWeight, ma = sa / sumWeight;
+	double C[4][4];
+	C[0][0] = syy / sumWeight - my * my;
+	C[0][1] = C[1][0] = syi / sumWeight - my * mi;
+	C[0][2] = C[2][0] = syq / sumWeight - my * mq;
+	C[0][3] = C[3][0] = sya / sumWeight - my * ma;
+	C[1][1] = sii / sumWeight - mi * mi;
+	C[1][2] = C[2][1] = siq / sumWeight - mi * mq;
+	C[1][3] = C[3][1] = sia / sumWeight - mi * ma;
+	C[2][2] = sqq / sumWeight - mq * mq;
+	C[2][3] = C[3][2] = sqa / sumWeight - mq * ma;
+	C[3][3] = saa / sumWeight - ma * ma;
+
+	//the dominant eigenvector is found by repeatedly squaring the matrix. Each power of it is scaled
+	//to unit trace, and converges to the rank-1 projection onto PC1, at which point the trace of its
+	//square is also 1.
+	double P[4][4], T[4][4];
+	memcpy(P, C, sizeof(P));
+	for (int iter = 0; iter < RX_PCA_MAX_SQUARINGS; iter++) {
+		double tr = P[0][0] + P[1][1] + P[2][2] + P[3][3];
+		if (!(tr > 0.0)) break;
+
+		for (int j = 0; j < 4; j++) {
+			for (int k = j; k < 4; k++) {
+				T[j][k] = (P[j][0] * P[0][k] + P[j][1] * P[1][k] + P[j][2] * P[2][k] + P[j][3] * P[3][k]) / (tr * tr);
+				T[k][j] = T[j][k];
+			}
+		}
+		memcpy(P, T, sizeof(P));
+		
+		if ((T[0][0] + T[1][1] + T[2][2] + T[3][3]) > 1.0 - RX_PCA_TOLERANCE) break;
+	}
+
+	//the column with the largest diagonal element is the best conditioned multiple of PC1.
+	int col = 0;
+	for (int j = 1; j < 4; j++) {
+		if (P[j][j] > P[col][col]) col = j;
+	}
+	if (!(P[col][col] > 0.0)) {
+		//no variance
+		axis[0] = 1.0;
+		return;
+	}
+
+	double v[4], w[4];
+	double mag = sqrt(P[0][col] * P[0][col] + P[1][col] * P[1][col] + P[2][col] * P[2][col] + P[3][col] * P[3][col]);
+	for (int j = 0; j < 4; j++) v[j] = P[j][col] / mag;
+
+	//one power iteration step with the covariance matrix to polish it, and the Rayleigh quotient for
+	//its variance.
+	for (int j = 0; j < 4; j++) w[j] = C[j][0] * v[0] + C[j][1] * v[1] + C[j][2] * v[2] + C[j][3] * v[3];
+	double var = v[0] * w[0] + v[1] * w[1] + v[2] * w[2] + v[3] * w[3];
+	mag = sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2] + w[3] * w[3]);
+	if (mag > 0.0) {
+		for (int j = 0; j < 4; j++) v[j] = w[j] / mag;
+	}
+
+	memcpy(axis, v, sizeof(v));
+	*pVar = fabs(var);
+}
+
+static void RxiHistComputePrincipalAny(RxReduction *reduction, int startIndex, int endIndex, double *axis, double *pVar) {
+	//any number of layers: the matrices are allocated for the largest layer count. Only the rows and
+	//columns in use are cleared.
+	RxPcaWork *work = &reduction->pcaWork;
+	unsigned int dim = 4 * reduction->paletteLayers;
+	memset(work->means, 0, dim * sizeof(double));
+	for (unsigned int i = 0; i < dim; i++) {
+		memset(work->cov[i], 0, dim * sizeof(double));
+		memset(work->E[i], 0, dim * sizeof(double));
+	}
+
+	RxiPcaView view = { work->x, work->means, &work->cov[0][0], work->z, work->e, work->b, &work->E[0][0] };
+	RxiHistComputePrincipalN(reduction, startIndex, endIndex, axis, pVar, reduction->paletteLayers, &view, 4 * RX_PALETTE_MAX_COUNT);
+}
+
 static void RxiHistChooseSplitAxis(RxReduction *reduction, int startIndex, int endIndex, double *axis) {
 	double varColor;
-	RxiHistComputePrincipal(reduction, startIndex, endIndex, axis, &varColor);
+	reduction->computePrincipal(reduction, startIndex, endIndex, axis, &varColor);
 	
 	//if not in the palette alpha mode, do not separately consider alpha.
 	if (reduction->alphaMode != RX_ALPHA_PALETTE) return;
@@ -1225,12 +2138,12 @@ static void RxiHistChooseSplitAxis(RxReduction *reduction, int startIndex, int e
 		//accumulate sum and sum squares
 		double Sa = 0.0, Saa = 0.0, totalWeight = 0.0;
 		for (int i = startIndex; i < endIndex; i++) {
-			RxHistEntry *entry = reduction->histogramFlat[i];
-			double a = entry->color[j].a * reduction->aWeight;
+			double weight = reduction->histogramFlat.weight[i];
+			double a = reduction->histogramFlat.color[i * reduction->paletteLayers + j].a * reduction->aWeight;
 
-			Sa += entry->weight * a;
-			Saa += entry->weight * a * a;
-			totalWeight += entry->weight;
+			Sa += weight * a;
+			Saa += weight * a * a;
+			totalWeight += weight;
 		}
 
 		if (totalWeight > 0.0) {
@@ -1244,24 +2157,118 @@ static void RxiHistChooseSplitAxis(RxReduction *reduction, int startIndex, int e
 	}
 }
 
-static int RxiHistEntryComparator(const void *p1, const void *p2) {
-	const RxHistEntry *e1 = *(const RxHistEntry **) p1;
-	const RxHistEntry *e2 = *(const RxHistEntry **) p2;
+//sort key of an entry of the finalized histogram
+typedef struct RxiHistSortKey_ {
+	uint64_t key;
+	int index;
+} RxiHistSortKey;
+
+static RX_FORCEINLINE uint64_t RxiHistSortKeyFromDouble(double d) {
+	//map a double to an unsigned integer of the same order. Negative zero is first made positive so
+	//that it ties with zero.
+	union {
+		double d;
+		uint64_t u;
+	} bits;
+	bits.d = d + 0.0;
+
+	//flip all bits of negative numbers, and only the sign bit of positive numbers.
+	if (bits.u >> 63) return ~bits.u;
+	return bits.u | (1ull << 63);
+}
 
-	double d = e1->value - e2->value;
-	if (d < 0.0) return -1;
-	if (d > 0.0) return 1;
-	return 0;
+static void RxiHistSortKeys(RxiHistSortKey *keys, RxiHistSortKey *temp, int nKeys) {
+	//stable sort by key. Small ranges (the majority of node splits) use an insertion sort.
+	if (nKeys <= RX_SORT_INSERTION_MAX) {
+		for (int i = 1; i < nKeys; i++) {
+			RxiHistSortKey k = keys[i];
+			int j = i;
+			while (j > 0 && keys[j - 1].key > k.key) {
+				keys[j] = keys[j - 1];
+				j--;
+			}
+			keys[j] = k;
+		}
+		return;
+	}
+
+	//otherwise, LSD radix sort with a histogram of each byte of the keys gathered in one pass.
+	unsigned int counts[8][256];
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < nKeys; i++) {
+		uint64_t k = keys[i].key;
+		for (int b = 0; b < 8; b++) {
+			counts[b][(k >> (b * 8)) & 0xFF]++;
+		}
+	}
+
+	RxiHistSortKey *src = keys, *dst = temp;
+	for (int b = 0; b < 8; b++) {
+		unsigned int *count = counts[b];
+
+		//skip passes where all keys share this byte
+		if (count[(src[0].key >> (b * 8)) & 0xFF] == (unsigned int) nKeys) continue;
+
+		unsigned int offs = 0;
+		for (int i = 0; i < 256; i++) {
+			unsigned int n = count[i];
+			count[i] = offs;
+			offs += n;
+		}
+		for (int i = 0; i < nKeys; i++) {
+			dst[count[(src[i].key >> (b * 8)) & 0xFF]++] = src[i];
+		}
+
+		RxiHistSortKey *swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != keys) memcpy(keys, src, nKeys * sizeof(RxiHistSortKey));
 }
 
-static int RxiHistEntryWeightComparator(const void *p1, const void *p2) {
-	const RxHistEntry *e1 = *(const RxHistEntry **) p1;
-	const RxHistEntry *e2 = *(const RxHistEntry **) p2;
+static void RxiHistSortRange(RxReduction *reduction, int startIndex, int endIndex, const double *keySrc, RxBool descending) {
+	RxHistFlat *flat = &reduction->histogramFlat;
+	unsigned int nLayers = reduction->paletteLayers;
+	int nColors = endIndex - startIndex;
+	if (nColors < 2) return;
+
+	//the key buffer holds the keys and their radix sort scratch. The temporary buffer holds one array
+	//of the range at a time while it's reordered.
+	RxiHistSortKey *keys = (RxiHistSortKey *) malloc(2 * nColors * sizeof(RxiHistSortKey));
+	RxYiqColor *temp = (RxYiqColor *) RxMemAlloc(nColors * nLayers * sizeof(RxYiqColor));
+	if (keys == NULL || temp == NULL) {
+		free(keys);
+		RxMemFree(temp);
+		reduction->status = RX_STATUS_NOMEM;
+		return;
+	}
 
-	double d = e2->weight - e1->weight; // descending
-	if (d < 0.0) return -1;
-	if (d > 0.0) return 1;
-	return 0;
+	//sort keys with their indices. Descending order is an ascending sort of negated keys.
+	for (int i = 0; i < nColors; i++) {
+		keys[i].key = RxiHistSortKeyFromDouble(descending ? -keySrc[startIndex + i] : keySrc[startIndex + i]);
+		keys[i].index = startIndex + i;
+	}
+	RxiHistSortKeys(keys, keys + nColors, nColors);
+
+	//apply the sorted order to each array
+	for (int i = 0; i < nColors; i++) {
+		RxiColorVecCopy(&temp[i * nLayers], &flat->color[keys[i].index * nLayers], nLayers);
+	}
+	memcpy(&flat->color[startIndex * nLayers], temp, nColors * nLayers * sizeof(RxYiqColor));
+
+	double *tempDouble = (double *) temp;
+	for (int i = 0; i < nColors; i++) tempDouble[i] = flat->weight[keys[i].index];
+	memcpy(&flat->weight[startIndex], tempDouble, nColors * sizeof(double));
+	for (int i = 0; i < nColors; i++) tempDouble[i] = flat->value[keys[i].index];
+	memcpy(&flat->value[startIndex], tempDouble, nColors * sizeof(double));
+
+	int *tempInt = (int *) temp;
+	for (int i = 0; i < nColors; i++) tempInt[i] = flat->entry[keys[i].index];
+	memcpy(&flat->entry[startIndex], tempInt, nColors * sizeof(int));
+
+	RxMemFree(temp);
+	free(keys);
 }
 
 static inline double RxiVec4Mag(double x, double y, double z, double w) {
@@ -1281,7 +2288,6 @@ static double RxiComputePcScore(RxReduction *reduction, const RxYiqColor *col, c
 
 void RX_API RxHistSort(RxReduction *reduction, int startIndex, int endIndex) {
 	double principal[4 * RX_PALETTE_MAX_COUNT];
-	RxHistEntry **thisHistogram = &reduction->histogramFlat[startIndex];
 	RxiHistChooseSplitAxis(reduction, startIndex, endIndex, principal);
 
 	//check principal component, make sure principal[0] >= 0
@@ -1293,36 +2299,37 @@ void RX_API RxHistSort(RxReduction *reduction, int startIndex, int endIndex) {
 	}
 
 	//compute dot products with the split axis.
+	RxHistFlat *flat = &reduction->histogramFlat;
 	for (int i = startIndex; i < endIndex; i++) {
-		RxHistEntry *histEntry = reduction->histogramFlat[i];
-		histEntry->value = RxiComputePcScore(reduction, histEntry->color, principal);
+		flat->value[i] = RxiComputePcScore(reduction, &flat->color[i * reduction->paletteLayers], principal);
 	}
 
 	//sort colors by dot product with the vector
-	int nColors = endIndex - startIndex;
-	qsort(thisHistogram, nColors, sizeof(RxHistEntry *), RxiHistEntryComparator);
+	RxiHistSortRange(reduction, startIndex, endIndex, flat->value, RX_FALSE);
 }
 
 unsigned int RX_API RxHistGetTopN(RxReduction *reduction, unsigned int n, RxYiqColor *cols, double *weights) {
 	if (reduction->histogram == NULL) return 0; // no histogram
 
 	//sort histogram
-	qsort(reduction->histogramFlat, reduction->histogram->nEntries, sizeof(RxHistEntry *), RxiHistEntryWeightComparator);
+	RxHistFlat *flat = &reduction->histogramFlat;
+	RxiHistSortRange(reduction, 0, reduction->histogram->nEntries, flat->weight, RX_TRUE);
 
 	//get top N items
 	unsigned int nGet = n;
 	if (nGet > (unsigned int) reduction->histogram->nEntries) nGet = reduction->histogram->nEntries;
 
 	for (unsigned int i = 0; i < nGet; i++) {
-		if (weights != NULL) weights[i] = reduction->histogramFlat[i]->weight;
-		RxiColorCopy(&cols[i], reduction->histogramFlat[i]->color);
+		if (weights != NULL) weights[i] = flat->weight[i];
+		RxiColorCopy(&cols[i], &flat->color[i * reduction->paletteLayers]);
 	}
 	return nGet;
 }
 
 static RxColorNode *RxiTreeNodeAlloc(RxReduction *reduction) {
-	//allocate the node structure plus enough color entries for the number of palette layers
-	RxColorNode *node = (RxColorNode *) RxMemCalloc(1, sizeof(RxColorNode) + reduction->paletteLayers * sizeof(RxYiqColor));
+	//allocate the node structure plus enough color entries and masked colors for the number of palette layers
+	RxColorNode *node = (RxColorNode *) RxMemCalloc(1, sizeof(RxColorNode) + reduction->paletteLayers * (sizeof(RxYiqColor) + sizeof(COLOR32)));
+	if (node != NULL) node->heapIndex = -1;
 	return node;
 }
 
@@ -1330,14 +2337,17 @@ static void RxiColorNodeInit(RxReduction *reduction, RxColorNode *node, int star
 	node->startIndex = startIndex;
 	node->endIndex = endIndex;
 	node->canSplit = RX_TRUE;
+	node->dupChecked = RX_FALSE;
+
+	RxHistFlat *flat = &reduction->histogramFlat;
+	unsigned int nLayers = reduction->paletteLayers;
 
 	//calculate the pivot index, as well as average YIQA values.
 	int nColors = node->endIndex - node->startIndex;
 	if (nColors < 2) {
 		//1 color: set leaf color to the single histogram color and its weight
-		RxHistEntry *entry = reduction->histogramFlat[node->startIndex];
-		RxiColorVecCopy(node->color, entry->color, reduction->paletteLayers);
-		node->weight = entry->weight;
+		RxiColorVecCopy(node->color, &flat->color[node->startIndex * nLayers], nLayers);
+		node->weight = flat->weight[node->startIndex];
 		node->canSplit = RX_FALSE;
 		return;
 	}
@@ -1349,10 +2359,9 @@ static void RxiColorNodeInit(RxReduction *reduction, RxColorNode *node, int star
 	double projMax = -RX_LARGE_NUMBER;
 	double projMin = RX_LARGE_NUMBER;
 	for (int i = node->startIndex; i < node->endIndex; i++) {
-		RxHistEntry *histEntry = reduction->histogramFlat[i];
-		double proj = RxiComputePcScore(reduction, histEntry->color, principal);
+		double proj = RxiComputePcScore(reduction, &flat->color[i * nLayers], principal);
 
-		histEntry->value = proj;
+		flat->value[i] = proj;
 		if (proj > projMax) projMax = proj;
 		if (proj < projMin) projMin = proj;
 	}
@@ -1373,8 +2382,12 @@ static void RxiColorNodeInit(RxReduction *reduction, RxColorNode *node, int star
 	}
 
 	//sort colors by dot product with the vector
-	RxHistEntry **thisHistogram = reduction->histogramFlat + node->startIndex;
-	qsort(thisHistogram, nColors, sizeof(RxHistEntry *), RxiHistEntryComparator);
+	RxiHistSortRange(reduction, node->startIndex, node->endIndex, flat->value, RX_FALSE);
+	if (reduction->status != RX_STATUS_OK) {
+		RxMemFree(splits);
+		free(splitWeightL);
+		return;
+	}
 
 	//gather statistics for splitting
 	double totalWeight = 0.0;
@@ -1385,31 +2398,31 @@ static void RxiColorNodeInit(RxReduction *reduction, RxColorNode *node, int star
 	double totalA[3 * RX_PALETTE_MAX_COUNT] = { 0 };  // total alpha interactions
 
 	for (int i = 0; i < nColors; i++) {
-		RxHistEntry *entry = thisHistogram[i];
-		double weight = entry->weight;
+		const RxYiqColor *color = &flat->color[(node->startIndex + i) * nLayers];
+		double weight = flat->weight[node->startIndex + i];
 
 		//accumulate sum of squares
 		for (unsigned int j = 0; j < reduction->paletteLayers; j++) {
-			double cy = reduction->yWeight * entry->color[j].y;
-			double ci = reduction->iWeight * entry->color[j].i;
-			double cq = reduction->qWeight * entry->color[j].q;
-			double ca = reduction->aWeight * entry->color[j].a;
+			double cy = reduction->yWeight * color[j].y;
+			double ci = reduction->iWeight * color[j].i;
+			double cq = reduction->qWeight * color[j].q;
+			double ca = reduction->aWeight * color[j].a;
 			sumSq += weight * RxiVec4Mag(cy, ci, cq, ca);
 		}
 
 		//accumulate means
 		RxLongColor *split = &splits[i * reduction->paletteLayers];
 		for (unsigned int j = 0; j < reduction->paletteLayers; j++) {
-			RxiAddWeightedLongColor(&total[j], &entry->color[j], weight);  // accumulate YIQA
+			RxiAddWeightedLongColor(&total[j], &color[j], weight);  // accumulate YIQA
 
 			memcpy(&split[j], &total[j], sizeof(RxLongColor));
 		}
 
 		for (unsigned int j = 0; j < reduction->paletteLayers; j++) {
-			double aWeight = entry->weight * entry->color[j].a;
-			totalA[j * 3 + 0] += aWeight * entry->color[j].y;
-			totalA[j * 3 + 1] += aWeight * entry->color[j].i;
-			totalA[j * 3 + 2] += aWeight * entry->color[j].q;
+			double aWeight = weight * color[j].a;
+			totalA[j * 3 + 0] += aWeight * color[j].y;
+			totalA[j * 3 + 1] += aWeight * color[j].i;
+			totalA[j * 3 + 2] += aWeight * color[j].q;
 		}
 
 		//accumulate total weight
@@ -1545,35 +2558,34 @@ static void RxiColorNodeSplit(RxReduction *reduction, RxColorNode *node) {
 	}
 
 	//slot new node into the array
-	RX_ASSUME(reduction->nUsedColors < RX_PALETTE_MAX_SIZE);
-	reduction->colorNodes[reduction->nUsedColors++] = rNode;
+	RxiColorNodeAddToList(reduction, rNode);
 
-	//init left and right nodes
+	//init left and right nodes, and queue them for splitting
 	RxiColorNodeInit(reduction, rNode, node->pivotIndex, node->endIndex);
 	RxiColorNodeInit(reduction, lNode, node->startIndex, node->pivotIndex);
+	RxiSplitHeapPush(reduction, rNode);
+	RxiSplitHeapPush(reduction, lNode);
 }
 
-static RxColorNode *RxiColorNodeFindByColor(RxReduction *reduction, const RxColorNode *src, unsigned int *pIndex) {
-	
+static void RxiColorNodeComputeMasked(RxReduction *reduction, RxColorNode *node) {
+	COLOR32 *masked = RxiColorNodeGetMasked(reduction, node);
+	for (unsigned int j = 0; j < reduction->paletteLayers; j++) {
+		masked[j] = RxiMaskYiqToRgb(reduction, &node->color[j]);
+	}
+}
+
+static RxBool RxiColorNodeMaskedEqual(RxReduction *reduction, RxColorNode *node1, RxColorNode *node2) {
+	return memcmp(RxiColorNodeGetMasked(reduction, node1), RxiColorNodeGetMasked(reduction, node2),
+		reduction->paletteLayers * sizeof(COLOR32)) == 0;
+}
+
+static RxColorNode *RxiColorNodeFindByColor(RxReduction *reduction, RxColorNode *src, unsigned int *pIndex) {
+	//find the first node with the same masked color
 	for (unsigned int i = 0; i < reduction->nUsedColors; i++) {
 		RxColorNode *node = reduction->colorNodes[i];
 		if (node == src) continue; // do not return the query node
 
-		//check the color matches
-		RxBool differ = 0;
-		for (unsigned int j = 0; j < reduction->paletteLayers; j++) {
-			COLOR32 compare = RxiMaskYiqToRgb(reduction, &src->color[j]);
-			COLOR32 thisRgb = RxiMaskYiqToRgb(reduction, &node->color[j]);
-
-			if (compare != thisRgb) {
-				//not the node we're looking for
-				differ = RX_TRUE;
-				break;
-			}
-		}
-
-		//found macthing node
-		if (!differ) {
+		if (RxiColorNodeMaskedEqual(reduction, src, node)) {
 			*pIndex = i;
 			return node;
 		}
@@ -1583,6 +2595,27 @@ static RxColorNode *RxiColorNodeFindByColor(RxReduction *reduction, const RxColo
 	return NULL;
 }
 
+static int RxiColorNodeFindFirstDuplicate(RxReduction *reduction) {
+	//find the first node with a duplicate color. Nodes whose colors were already checked have no
+	//duplicates among themselves, so any duplicate pair involves an unchecked node.
+	int found = -1;
+	for (unsigned int i = 0; i < reduction->nUsedColors; i++) {
+		RxColorNode *node = reduction->colorNodes[i];
+		if (node->dupChecked) continue;
+
+		//nodes before the current one that was found can match
+		unsigned int end = (found < 0) ? reduction->nUsedColors : (unsigned int) found;
+		for (unsigned int j = 0; j < end; j++) {
+			if (j == i) continue;
+			if (RxiColorNodeMaskedEqual(reduction, node, reduction->colorNodes[j])) {
+				found = (j < i) ? (int) j : (int) i;
+				break;
+			}
+		}
+	}
+	return found;
+}
+
 static void RxiColorNodeDeleteByIndex(RxReduction *reduction, unsigned int iNode) {
 	RX_ASSUME(iNode < reduction->nUsedColors);
 
@@ -1627,56 +2660,183 @@ static void RxiPaletteToRgb(RxReduction *reduction) {
 	}
 }
 
-static void RxiVoronoiAccumulateClusters(RxReduction *reduction) {
-	RxTotalBuffer *totalsBuffer = reduction->blockTotals;
-	memset(totalsBuffer, 0, sizeof(reduction->blockTotals));
+static void RxiVoronoiMapBlock(void *param, unsigned int index, unsigned int worker) {
+	(void) worker;
+	RxReduction *reduction = (RxReduction *) param;
+	RxHistFlat *flat = &reduction->histogramFlat;
+	unsigned int nLayers = reduction->paletteLayers;
+	RxYiqColor scratch[RX_PALETTE_MAX_COUNT];
 
-	//remap histogram points to palette colors, and accumulate the error
-	for (int i = 0; i < reduction->histogram->nEntries; i++) {
-		RxHistEntry *entry = reduction->histogramFlat[i];
+	int start = index * RX_VORONOI_BLOCK_ENTRIES, end = start + RX_VORONOI_BLOCK_ENTRIES;
+	if (end > reduction->histogram->nEntries) end = reduction->histogram->nEntries;
 
-		double bestDistance;
-		int bestIndex = RxPaletteFindClosestColorYiq(reduction, entry->color, &bestDistance);
+	//remap histogram points to palette colors
+	for (int i = start; i < end; i++) {
+		flat->entry[i] = RxiPaletteFindClosestColorYiq(reduction, &flat->color[i * nLayers], scratch, &flat->diff[i]);
+	}
+}
+
+static void RxiVoronoiSumCluster(void *param, unsigned int index, unsigned int worker) {
+	(void) worker;
+	RxReduction *reduction = (RxReduction *) param;
+	RxHistFlat *flat = &reduction->histogramFlat;
+	RxTotalBuffer *totals = &reduction->blockTotals[index];
+	unsigned int nLayers = reduction->paletteLayers;
+
+	//members are visited in entry order, so the sums do not depend on how clusters are split among threads.
+	for (unsigned int k = 0; k < totals->count; k++) {
+		int i = flat->member[totals->start + k];
+		const RxYiqColor *color = &flat->color[i * nLayers];
 
 		//add to total. YIQ colors scaled by alpha to be unscaled later.
-		double weight = entry->weight;
-		totalsBuffer[bestIndex].weight += weight;
-		totalsBuffer[bestIndex].error += weight * bestDistance;
-		totalsBuffer[bestIndex].count++;
+		double weight = flat->weight[i];
+		totals->weight += weight;
+		totals->error += weight * flat->diff[i];
 
-		for (unsigned int j = 0; j < reduction->paletteLayers; j++) {
-			RxiAddWeightedLongColor(&totalsBuffer[bestIndex].sum[j], &entry->color[j], weight);
+		for (unsigned int j = 0; j < nLayers; j++) {
+			RxiAddWeightedLongColor(&totals->sum[j], &color[j], weight);
 		}
-		entry->entry = bestIndex;
 	}
 }
 
-static void RxiVoronoiMoveToCluster(RxReduction *reduction, RxHistEntry *entry, int idxTo, double newDifference, double oldDifference) {
+static void RxiVoronoiListMembers(RxReduction *reduction, unsigned int nClusters) {
+	RxTotalBuffer *totalsBuffer = reduction->blockTotals;
+	RxHistFlat *flat = &reduction->histogramFlat;
+	int nEntries = reduction->histogram->nEntries;
+
+	//list the members of each cluster in entry order
+	for (unsigned int i = 0; i < nClusters; i++) totalsBuffer[i].count = 0;
+	for (int i = 0; i < nEntries; i++) totalsBuffer[flat->entry[i]].count++;
+
+	unsigned int start = 0;
+	for (unsigned int i = 0; i < nClusters; i++) {
+		totalsBuffer[i].start = start;
+		start += totalsBuffer[i].count;
+		totalsBuffer[i].count = 0;
+	}
+	for (int i = 0; i < nEntries; i++) {
+		RxTotalBuffer *totals = &totalsBuffer[flat->entry[i]];
+		flat->member[totals->start + totals->count++] = i;
+	}
+}
+
+static void RxiVoronoiAccumulateClusters(RxReduction *reduction) {
+	RxTotalBuffer *totalsBuffer = reduction->blockTotals;
+	memset(totalsBuffer, 0, sizeof(reduction->blockTotals));
+
+	//map histogram entries to their nearest palette colors in parallel blocks.
+	RxHistFlat *flat = &reduction->histogramFlat;
+	int nEntries = reduction->histogram->nEntries;
+	unsigned int nBlocks = (nEntries + RX_VORONOI_BLOCK_ENTRIES - 1) / RX_VORONOI_BLOCK_ENTRIES;
+	TpParallelFor(nBlocks, RxiVoronoiMapBlock, reduction);
+
+	unsigned int nClusters = 0;
+	for (int i = 0; i < nEntries; i++) {
+		if (flat->entry[i] >= (int) nClusters) nClusters = flat->entry[i] + 1;
+	}
+	RxiVoronoiListMembers(reduction, nClusters);
+
+	//accumulate each cluster. Each cluster is summed in the same order as a serial pass over the
+	//entries would, so the totals are exact regardless of the thread count.
+	if (nBlocks > 1) {
+		TpParallelFor(nClusters, RxiVoronoiSumCluster, reduction);
+	} else {
+		for (unsigned int i = 0; i < nClusters; i++) RxiVoronoiSumCluster(reduction, i, 0);
+	}
+}
+
+static void RxiVoronoiMoveToCluster(RxReduction *reduction, int histIndex, int idxTo, double newDifference, double oldDifference) {
 	RxTotalBuffer *totalsBuffer = reduction->blockTotals;
-	int idxFrom = entry->entry;
+	RxHistFlat *flat = &reduction->histogramFlat;
+	const RxYiqColor *color = &flat->color[histIndex * reduction->paletteLayers];
+	int idxFrom = flat->entry[histIndex];
 
-	double weight = entry->weight;
+	double weight = flat->weight[histIndex];
 	for (unsigned int j = 0; j < reduction->paletteLayers; j++) {
 		//add weight to "to" cluster
-		RxiAddWeightedLongColor(&totalsBuffer[idxTo].sum[j], &entry->color[j], weight);
+		RxiAddWeightedLongColor(&totalsBuffer[idxTo].sum[j], &color[j], weight);
 
 		//remove weight from "from" cluster
-		RxiAddWeightedLongColor(&totalsBuffer[idxFrom].sum[j], &entry->color[j], -weight);
+		RxiAddWeightedLongColor(&totalsBuffer[idxFrom].sum[j], &color[j], -weight);
 	}
 
-	totalsBuffer[idxTo].weight += entry->weight;
+	totalsBuffer[idxTo].weight += weight;
 	totalsBuffer[idxTo].error += newDifference;
 	totalsBuffer[idxTo].count++;
 
-	totalsBuffer[idxFrom].weight -= entry->weight;
+	totalsBuffer[idxFrom].weight -= weight;
 	totalsBuffer[idxFrom].error -= oldDifference;
 	totalsBuffer[idxFrom].count--;
 
-	entry->entry = idxTo;
+	flat->entry[histIndex] = idxTo;
+}
+
+static unsigned int RxiVoronoiListCandidates(RxReduction *reduction) {
+	RxTotalBuffer *totalsBuffer = reduction->blockTotals;
+	RxHistFlat *flat = &reduction->histogramFlat;
+	unsigned int nLayers = reduction->paletteLayers;
+	int nEntries = reduction->histogram->nEntries;
+
+	//list the entries that could be moved to a degenerate cluster, with the error they would remove.
+	unsigned int nCandidates = 0;
+	for (int j = 0; j < nEntries; j++) {
+		const RxYiqColor *color = &flat->color[j * nLayers];   // histogram color
+		double weight = flat->weight[j];
+		RxYiqColor *yiq1 = reduction->paletteYiq[flat->entry[j]]; // ceontroid of the cluster the color belongs to
+
+		//a cluster with only one member is never split.
+		if (totalsBuffer[flat->entry[j]].count <= 1) continue;
+
+		//calculate the masked histogram color
+		RxYiqColor *yiqNewCentroid = reduction->tempLayeredColor;
+
+		//if we mask colors, check this entry against the palette with clamping. If they compare equal,
+		//then we say that this color is as close as it will be to a palette color and we won't include
+		//this in our search candidates.
+		RxBool same = RX_TRUE;
+		for (unsigned int k = 0; k < nLayers; k++) {
+			COLOR32 palMasked = RxiMaskYiqToRgb(reduction, &yiq1[k]);
+			COLOR32 histMasked = RxiMaskYiqToRgb(reduction, &color[k]);
+			RxiConvertRgbToYiq(histMasked, &yiqNewCentroid[k]);
+
+			//check if the histogram and palette still differ after masking
+			if (histMasked != palMasked) {
+				//colors differ
+				same = RX_FALSE;
+			}
+		}
+		if (same) continue; // this difference can't be reconciled (mask to the same color)
+
+		//calculate the difference between the histogram color and its currently assigned best centroid,
+		//and to the new centroid it would create.
+		double diff = RxiComputeColorDifference(reduction, yiq1, &color[0]) * weight;
+		double newDifference = RxiComputeLayeredColorDifference(reduction, color, yiqNewCentroid) * weight;
+		if (!(diff - newDifference > 0.0)) continue;
+
+		RxVoronoiCandidate *cand = &flat->candidate[nCandidates++];
+		cand->index = j;
+		cand->diff = diff;
+		cand->newDiff = newDifference;
+	}
+	return nCandidates;
+}
+
+static RxBool RxiCentroidMoved(RxReduction *reduction, const RxYiqColor *from, const RxYiqColor *to) {
+	//check if any RGBA channel of any layer moved by more than the move tolerance
+	int tolerance = (int) reduction->moveTolerance;
+	for (unsigned int j = 0; j < reduction->paletteLayers; j++) {
+		COLOR32 c1 = RxConvertYiqToRgb(&from[j]), c2 = RxConvertYiqToRgb(&to[j]);
+		for (unsigned int k = 0; k < 32; k += 8) {
+			int d = (int) ((c1 >> k) & 0xFF) - (int) ((c2 >> k) & 0xFF);
+			if (d > tolerance || -d > tolerance) return RX_TRUE;
+		}
+	}
+	return RX_FALSE;
 }
 
 static int RxiVoronoiIterate(RxReduction *reduction) {
 	RxTotalBuffer *totalsBuffer = reduction->blockTotals;
+	RxHistFlat *flat = &reduction->histogramFlat;
 	unsigned int nLayers = reduction->paletteLayers;
 
 	//load the palette into the acceleration structure
@@ -1685,6 +2845,16 @@ static int RxiVoronoiIterate(RxReduction *reduction) {
 	//map histogram colors to existing clusters and accumulate error.
 	RxiVoronoiAccumulateClusters(reduction);
 
+	//stop when the last iteration improved the total error by too small a fraction of it.
+	if (reduction->reclusterMinImprovement > 0.0) {
+		double error = 0.0;
+		for (unsigned int i = 0; i < reduction->nUsedColors; i++) error += totalsBuffer[i].error;
+
+		double lastError = reduction->reclusterError;
+		reduction->reclusterError = error;
+		if (reduction->reclusterIteration > 0 && (lastError - error) < reduction->reclusterMinImprovement * lastError) return 0;
+	}
+
 	//new centroid indexes, when created
 	unsigned int *newCentroidIdxs = reduction->newCentroids;
 	unsigned int nNewCentroids = 0;
@@ -1693,59 +2863,48 @@ static int RxiVoronoiIterate(RxReduction *reduction) {
 	//if any palette color would have zero weight, we assign it a color with the highest
 	//squared deviation from its palette color (scaled by weight).
 	//when we do this, we recompute the cluster bounds.
-	int nHistEntries = reduction->histogram->nEntries;
+	unsigned int nCandidates = 0;
+	RxBool candidatesListed = RX_FALSE;
 	for (unsigned int i = reduction->nPinnedClusters; i < reduction->nUsedColors; i++) {
 		if (totalsBuffer[i].weight > 0.0) continue;
 
+		//the candidates only depend on clusters that are not degenerate, so they are listed once.
+		if (!candidatesListed) {
+			nCandidates = RxiVoronoiListCandidates(reduction);
+			candidatesListed = RX_TRUE;
+		}
+
 		//find the color furthest from its center and create a centroid for it in place of this one.
 		double largestDifference = 0.0, largestDifferenceReduction = 0.0;
-		int farthestIndex = -1;
-		for (int j = 0; j < nHistEntries; j++) {
-			RxHistEntry *entry = reduction->histogramFlat[j];       // histogram color
-			RxYiqColor *yiq1 = reduction->paletteYiq[entry->entry]; // ceontroid of the cluster the color belongs to
+		RxVoronoiCandidate *farthest = NULL;
+		for (unsigned int c = 0; c < nCandidates; c++) {
+			RxVoronoiCandidate *cand = &flat->candidate[c];
+			int j = cand->index;
+			if (j == -1) continue; // already moved to a new centroid
 
 			//do not move a cluster with only one member
-			if (totalsBuffer[entry->entry].count <= 1) continue;
-
-			//calculate the masked histogram color
-			RxYiqColor *yiqNewCentroid = reduction->tempLayeredColor;
-
-			//if we mask colors, check this entry against the palette with clamping. If they compare equal,
-			//then we say that this color is as close as it will be to a palette color and we won't include
-			//this in our search candidates.
-			RxBool same = RX_TRUE;
-			for (unsigned int k = 0; k < nLayers; k++) {
-				COLOR32 palMasked = RxiMaskYiqToRgb(reduction, &yiq1[k]);
-				COLOR32 histMasked = RxiMaskYiqToRgb(reduction, &entry->color[k]);
-				RxConvertRgbToYiq(histMasked, &yiqNewCentroid[k]);
-
-				//check if the histogram and palette still differ after masking
-				if (histMasked != palMasked) {
-					//colors differ
-					same = RX_FALSE;
-				}
-			}
-			if (same) continue; // this difference can't be reconciled (mask to the same color)
-
-			//calculate the difference between the histogram color and its currently assigned best centroid.
-			double diff = RxiComputeColorDifference(reduction, yiq1, &entry->color[0]) * entry->weight;
+			if (totalsBuffer[flat->entry[j]].count <= 1) continue;
 
 			//we subtract the difference to the new centroid to calcualate the reduction in the error sum of
 			//squares. The highest reduction is desired.
-			double newDifference = RxiComputeLayeredColorDifference(reduction, entry->color, yiqNewCentroid) * entry->weight;
-			
-			double diffReduction = diff - newDifference;
-			if (diffReduction > 0.0 && diffReduction > largestDifferenceReduction) {
+			double diffReduction = cand->diff - cand->newDiff;
+			if (diffReduction > largestDifferenceReduction) {
 				//lastly, since an earlier cluster reassignment may have produced a cluster matching
 				//what would be this entry's new centroid, we'll check the existing centroids and assign
 				//to an existing one if it exists.
+				RxYiqColor *yiqNewCentroid = reduction->tempLayeredColor;
+				for (unsigned int k = 0; k < nLayers; k++) {
+					RxiMaskYiq(reduction, &flat->color[j * nLayers + k], &yiqNewCentroid[k]);
+				}
+
 				RxBool found = RX_FALSE;
 				for (unsigned int k = 0; k < nNewCentroids; k++) {
 					unsigned int idx = newCentroidIdxs[k];
 					//check that all layers of the colors match
 					if (RxiColorVecEqual(reduction->paletteYiq[idx], yiqNewCentroid, nLayers)) {
 						//remap to the existing centroid
-						RxiVoronoiMoveToCluster(reduction, entry, idx, newDifference, diff);
+						RxiVoronoiMoveToCluster(reduction, j, idx, cand->newDiff, cand->diff);
+						cand->index = -1;
 						found = RX_TRUE;
 						break;
 					}
@@ -1755,29 +2914,34 @@ static int RxiVoronoiIterate(RxReduction *reduction) {
 				//new centroid creation.
 				if (!found) {
 					largestDifferenceReduction = diffReduction;
-					largestDifference = diff;
-					farthestIndex = j;
+					largestDifference = cand->diff;
+					farthest = cand;
 				}
 			}
 		}
 
-		if (farthestIndex != -1) {
+		if (farthest != NULL) {
 			//get RGB of new point (will be used when checking identical remapped colors)
-			RxHistEntry *entry = reduction->histogramFlat[farthestIndex];
+			int farthestIndex = farthest->index;
+			const RxYiqColor *color = &flat->color[farthestIndex * nLayers];
 			for (unsigned int j = 0; j < nLayers; j++) {
-				RxiMaskYiq(reduction, &entry->color[j], &reduction->paletteYiq[i][j]);
+				RxiMaskYiq(reduction, &color[j], &reduction->paletteYiq[i][j]);
 			}
 
 			//move centroid
-			double newDifference = RxiComputeLayeredColorDifference(reduction, entry->color, reduction->paletteYiq[i]) * entry->weight;
-			RxiVoronoiMoveToCluster(reduction, entry, i, newDifference, largestDifference);
+			double newDifference = RxiComputeLayeredColorDifference(reduction, color, reduction->paletteYiq[i]) * flat->weight[farthestIndex];
+			RxiVoronoiMoveToCluster(reduction, farthestIndex, i, newDifference, largestDifference);
 			newCentroidIdxs[nNewCentroids++] = i;
+			farthest->index = -1;
 		} else {
 			//no best point was found for replacement.
 			return 0; // stop
 		}
 	}
 
+	//entries were moved between clusters, so list the cluster members again.
+	if (nNewCentroids > 0) RxiVoronoiListMembers(reduction, reduction->nUsedColors);
+
 	//average out the colors in the new partitions
 	unsigned int nMovedClusters = 0;
 	for (unsigned int i = reduction->nPinnedClusters; i < reduction->nUsedColors; i++) {
@@ -1797,17 +2961,17 @@ static int RxiVoronoiIterate(RxReduction *reduction) {
 		//we do not update the centroid.
 		//this ensures that the total error is at least monotonically decreasing.
 		double errNewCluster = 0.0;
-		for (int j = 0; j < reduction->histogram->nEntries; j++) {
-			if (reduction->histogramFlat[j]->entry != (int) i) continue;
-
-			RxHistEntry *hist = reduction->histogramFlat[j];
-			errNewCluster += hist->weight * RxiComputeLayeredColorDifference(reduction, hist->color, yiq);
+		const int *members = &flat->member[totalsBuffer[i].start];
+		for (unsigned int k = 0; k < totalsBuffer[i].count; k++) {
+			int j = members[k];
+			errNewCluster += flat->weight[j] * RxiComputeLayeredColorDifference(reduction, &flat->color[j * nLayers], yiq);
 		}
 
 		//if the new cluster is an improvement over the old cluster
 		if (errNewCluster < totalsBuffer[i].error) {
+			//with a move tolerance, small moves are still made but do not keep the iteration going.
+			if (reduction->moveTolerance == 0 || RxiCentroidMoved(reduction, reduction->paletteYiq[i], yiq)) nMovedClusters++;
 			RxiColorVecCopy(reduction->paletteYiq[i], yiq, nLayers);
-			nMovedClusters++;
 		}
 	}
 
@@ -1831,20 +2995,15 @@ static void RxiVoronoiRecluster(RxReduction *reduction) {
 	//voronoi iteration
 	reduction->reclusterIteration = 0;
 	while (RxiVoronoiIterate(reduction));
+	reduction->nReclusterRuns++;
+	reduction->nReclusterIterations += reduction->reclusterIteration;
 
 	//load palette accelerator
 	RxiPaletteLoadYiq(reduction, &reduction->paletteYiq[0][0], RX_PALETTE_MAX_COUNT, reduction->nUsedColors, RX_TRUE);
 
 	//delete any entries we couldn't use and shrink the palette size.
 	RxTotalBuffer *totalsBuffer = reduction->blockTotals;
-	memset(totalsBuffer, 0, sizeof(reduction->blockTotals));
-	for (int i = 0; i < reduction->histogram->nEntries; i++) {
-		RxYiqColor *histColor = reduction->histogramFlat[i]->color;
-
-		//find nearest, add to total
-		int bestIndex = RxPaletteFindClosestColorYiq(reduction, histColor, NULL);
-		totalsBuffer[bestIndex].weight += reduction->histogramFlat[i]->weight;
-	}
+	RxiVoronoiAccumulateClusters(reduction);
 
 	//weight==0 => delete
 	unsigned int nRemoved = 0;
@@ -1881,7 +3040,7 @@ static void RxiVoronoiLoad(RxReduction *reduction, const COLOR32 *pltt, unsigned
 		const COLOR32 *thisPltt = pltt + nColors * j;
 
 		memcpy(&reduction->paletteRgb[j * reduction->nUsedColors], thisPltt, nColors * sizeof(COLOR32));
-		for (unsigned int i = 0; i < nColors; i++) RxConvertRgbToYiq(thisPltt[i], &reduction->paletteYiq[i][j]);
+		for (unsigned int i = 0; i < nColors; i++) RxiConvertRgbToYiq(thisPltt[i], &reduction->paletteYiq[i][j]);
 	}
 }
 
@@ -1900,72 +3059,91 @@ static void RxiAdjustHistogramIndices(RxReduction *reduction, int cutStart, int
 	}
 }
 
+static void RxiArrayMoveRangesToEnd(void *array, size_t size, void *tempbuf, int start1, int end1, int start2, int end2, int nTotal) {
+	//move the ranges [start1, end1) and [start2, end2) to the end of the array, keeping the order of the rest
+	unsigned char *base = (unsigned char *) array, *temp = (unsigned char *) tempbuf;
+	int nCols1 = end1 - start1, nCols2 = end2 - start2;
+	memcpy(&temp[0], &base[start1 * size], nCols1 * size);
+	memcpy(&temp[nCols1 * size], &base[start2 * size], nCols2 * size);
+
+	int loc1 = start1, loc2 = start1 + start2 - end1, loc3 = start1 + start2 - end1 + nTotal - end2;
+	memmove(&base[loc1 * size], &base[end1 * size], (start2 - end1) * size);
+	memmove(&base[loc2 * size], &base[end2 * size], (nTotal - end2) * size);
+	memcpy(&base[loc3 * size], temp, (nCols1 + nCols2) * size);
+}
+
 static int RxiMergeColorNodes(RxReduction *reduction) {
 	if (reduction->status != RX_STATUS_OK) return 0;
 	if (reduction->nUsedColors < 2) return 0; // no merge possible
 
-	//duplicate color test
+	//masked colors of nodes created or changed since the last check
 	for (unsigned int i = 0; i < reduction->nUsedColors; i++) {
 		RxColorNode *node = reduction->colorNodes[i];
+		if (!node->dupChecked) RxiColorNodeComputeMasked(reduction, node);
+	}
 
-		unsigned int nDupMerge = 0;
-		while (1) {
-			//find duplicate nodes until no duplicates are found
-			unsigned int iDup;
-			RxColorNode *dup = RxiColorNodeFindByColor(reduction, node, &iDup);
-			if (dup == NULL) break;
-
-			//we should combine these two nodes into one node of combined weight.
-			int start1, end1, start2, end2;
-			if (node->startIndex < dup->startIndex) {
-				start1 = node->startIndex, end1 = node->endIndex;
-				start2 = dup->startIndex, end2 = dup->endIndex;
-			} else {
-				start1 = dup->startIndex, end1 = dup->endIndex;
-				start2 = node->startIndex, end2 = node->endIndex;
-			}
-
-			int nCols1 = end1 - start1, nCols2 = end2 - start2;
-			int nColsMove = nCols1 + nCols2;
-			int nHist = reduction->histogram->nEntries;
-
-			//delete the duplicate node.
-			RxiColorNodeDeleteByIndex(reduction, iDup);
-
-			//we'll combine the histogram entries from both nodes into one. To accomplish this, we'll need to rearrange
-			//the histogram array.
-			int loc1 = start1, loc2 = start1 + start2 - end1, loc3 = start1 + start2 - end1 + nHist - end2, loc4 = nHist;
-			RxHistEntry **tempbuf = (RxHistEntry **) calloc(nColsMove, sizeof(RxHistEntry *));
-			memcpy(&tempbuf[0], &reduction->histogramFlat[start1], nCols1 * sizeof(RxHistEntry *));
-			memcpy(&tempbuf[nCols1], &reduction->histogramFlat[start2], nCols2 * sizeof(RxHistEntry *));
+	//duplicate color test
+	int iFirst = RxiColorNodeFindFirstDuplicate(reduction);
+	if (iFirst < 0) {
+		//no duplicates: all nodes are checked now.
+		for (unsigned int i = 0; i < reduction->nUsedColors; i++) reduction->colorNodes[i]->dupChecked = RX_TRUE;
+		return 0;
+	}
 
-			memmove(&reduction->histogramFlat[loc1], &reduction->histogramFlat[end1], (start2 - end1) * sizeof(RxHistEntry *));
-			memmove(&reduction->histogramFlat[loc2], &reduction->histogramFlat[end2], (nHist - end2) * sizeof(RxHistEntry *));
-			memcpy(&reduction->histogramFlat[loc3], tempbuf, nColsMove * sizeof(RxHistEntry *));
-			free(tempbuf);
+	RxColorNode *node = reduction->colorNodes[iFirst];
+	while (1) {
+		//find duplicate nodes until no duplicates are found
+		unsigned int iDup;
+		RxColorNode *dup = RxiColorNodeFindByColor(reduction, node, &iDup);
+		if (dup == NULL) break;
+
+		//we should combine these two nodes into one node of combined weight.
+		int start1, end1, start2, end2;
+		if (node->startIndex < dup->startIndex) {
+			start1 = node->startIndex, end1 = node->endIndex;
+			start2 = dup->startIndex, end2 = dup->endIndex;
+		} else {
+			start1 = dup->startIndex, end1 = dup->endIndex;
+			start2 = node->startIndex, end2 = node->endIndex;
+		}
 
-			//adjust the histogram indices of tree nodes
-			RxiAdjustHistogramIndices(reduction, start1, nCols1);
-			RxiAdjustHistogramIndices(reduction, start2 - nCols1, nCols2); // adjust starting index by amount we cut above
+		int nCols1 = end1 - start1, nCols2 = end2 - start2;
+		int nColsMove = nCols1 + nCols2;
+		int nHist = reduction->histogram->nEntries;
+
+		//delete the duplicate node.
+		RxiSplitHeapRemove(reduction, dup);
+		RxiColorNodeDeleteByIndex(reduction, iDup);
+
+		//we'll combine the histogram entries from both nodes into one. To accomplish this, we'll need to rearrange
+		//the array. Only colors and weights are moved, since the node is recalculated below.
+		int loc3 = start1 + start2 - end1 + nHist - end2, loc4 = nHist;
+		RxHistFlat *flat = &reduction->histogramFlat;
+		size_t colorSize = reduction->paletteLayers * sizeof(RxYiqColor);
+		unsigned char *tempbuf = (unsigned char *) RxMemAlloc(nColsMove * colorSize);
+		if (tempbuf == NULL) {
+			reduction->status = RX_STATUS_NOMEM;
+			return 0;
+		}
 
-			//we recalculate the new combined node.
-			RxiColorNodeInit(reduction, node, loc3, loc4);
-			if (reduction->status != RX_STATUS_OK) return 0; // early exit
+		RxiArrayMoveRangesToEnd(flat->color, colorSize, tempbuf, start1, end1, start2, end2, nHist);
+		RxiArrayMoveRangesToEnd(flat->weight, sizeof(double), tempbuf, start1, end1, start2, end2, nHist);
+		RxMemFree(tempbuf);
 
-			node->canSplit = 0; // HACK
+		//adjust the histogram indices of tree nodes
+		RxiAdjustHistogramIndices(reduction, start1, nCols1);
+		RxiAdjustHistogramIndices(reduction, start2 - nCols1, nCols2); // adjust starting index by amount we cut above
 
-			//remove node from existence
-			nDupMerge++;
-			continue;
-		}
+		//we recalculate the new combined node.
+		RxiColorNodeInit(reduction, node, loc3, loc4);
+		if (reduction->status != RX_STATUS_OK) return 0; // early exit
 
-		if (nDupMerge > 0) {
-			return 1; // may be more to merge
-		}
+		node->canSplit = 0; // HACK
+		RxiSplitHeapRemove(reduction, node);
+		RxiColorNodeComputeMasked(reduction, node);
 	}
 
-	//fall-through: there was nothing to merge
-	return 0;
+	return 1; // may be more to merge
 }
 
 RxStatus RX_API RxComputePalette(RxReduction *reduction, unsigned int nColors) {
@@ -1975,7 +3153,7 @@ RxStatus RX_API RxComputePalette(RxReduction *reduction, unsigned int nColors) {
 	reduction->nUsedColors = 0;
 	RxiCreatePaletteUpdateProgress(reduction);
 
-	if (reduction->histogramFlat == NULL || reduction->histogram->nEntries == 0) {
+	if (reduction->histogramFlat.nEntries == 0) {
 		return reduction->status;
 	}
 
@@ -1984,13 +3162,16 @@ RxStatus RX_API RxComputePalette(RxReduction *reduction, unsigned int nColors) {
 	
 	//create the root cluster holding all colors
 	RxColorNode *head = RxiTreeNodeAlloc(reduction);
+	reduction->nSplitHeap = 0;
+	reduction->nodeSerial = 0;
 	RxiColorNodeInit(reduction, head, 0, reduction->histogram->nEntries);
-	reduction->colorNodes[reduction->nUsedColors++] = head;
+	RxiColorNodeAddToList(reduction, head);
+	RxiSplitHeapPush(reduction, head);
 
 	//main color reduction loop
 	while (reduction->nUsedColors < reduction->nPaletteColors) {
-		//split and initialize children for the found node.
-		RxColorNode *node = RxiFindSplittableColorNode(reduction);
+		//split and initialize children for the highest priority node.
+		RxColorNode *node = RxiSplitHeapPop(reduction);
 		if (node != NULL) RxiColorNodeSplit(reduction, node); // split node
 
 		//when we would reach a termination condition, check first if any colors would be duplicates of each other.
@@ -2024,6 +3205,47 @@ RxStatus RX_API RxComputePalette(RxReduction *reduction, unsigned int nColors) {
 	return reduction->status;
 }
 
+RxStatus RX_API RxComputePaletteFrom(RxReduction *reduction, const COLOR32 *seed, unsigned int nSeedColors, unsigned int nColors, unsigned int tolerance) {
+	//max palette size check
+	if (nColors > RX_PALETTE_MAX_SIZE) return RX_STATUS_INVALID;
+	if (nSeedColors > nColors) nSeedColors = nColors;
+
+	reduction->nPaletteColors = nColors;
+	reduction->reclusterIteration = 0;
+	reduction->nPinnedClusters = 0;
+	reduction->nUsedColors = 0;
+	RxiCreatePaletteUpdateProgress(reduction);
+
+	if (reduction->histogramFlat.nEntries == 0) {
+		return reduction->status;
+	}
+
+	//load the masked seed colors as the initial centroids. Colors past the end of the seed start as
+	//copies of its first color. They are left empty, so the Voronoi iteration moves them to the worst
+	//represented colors.
+	for (unsigned int j = 0; j < reduction->paletteLayers; j++) {
+		for (unsigned int i = 0; i < nColors; i++) {
+			COLOR32 col = 0;
+			if (nSeedColors > 0) col = seed[j * nSeedColors + (i < nSeedColors ? i : 0)];
+			RxiConvertRgbToYiq(reduction->maskColors(col), &reduction->paletteYiq[i][j]);
+		}
+	}
+	reduction->nUsedColors = nColors;
+
+	//perform voronoi iteration
+	reduction->moveTolerance = tolerance;
+	RxiVoronoiRecluster(reduction);
+	reduction->moveTolerance = 0;
+
+	//palette to RGB
+	RxiPaletteToRgb(reduction);
+
+	//load the palette into the accelerator.
+	RxiPaletteLoadYiq(reduction, &reduction->paletteYiq[0][0], RX_PALETTE_MAX_COUNT, reduction->nUsedColors, RX_FALSE);
+
+	return reduction->status;
+}
+
 static int RxiIsColorVectorAllEqual(const RxYiqColor *yiq, unsigned int n) {
 	//check colors 1...n-1
 	for (unsigned int i = 1; i < n; i++) {
@@ -2116,14 +3338,9 @@ RxStatus RX_API RxGetPalette(RxReduction *reduction, COLOR32 *pltt, unsigned int
 }
 
 RxStatus RX_API RxHistClear(RxReduction *reduction) {
-	if (reduction->histogramFlat != NULL) free(reduction->histogramFlat);
-	reduction->histogramFlat = NULL;
+	reduction->histogramFlat.nEntries = 0;
 
-	if (reduction->histogram != NULL) {
-		RxiSlabFreeAll(&reduction->histogram->allocator);
-		free(reduction->histogram);
-		reduction->histogram = NULL;
-	}
+	if (reduction->histogram != NULL) RxiHistReset(reduction->histogram);
 
 	reduction->nUsedColors = 0;
 	memset(reduction->paletteRgb, 0, sizeof(reduction->paletteRgb));
@@ -2132,11 +3349,10 @@ RxStatus RX_API RxHistClear(RxReduction *reduction) {
 
 static void RxiDestroy(RxReduction *reduction) {
 	RxPaletteFree(reduction);
-	if (reduction->histogramFlat != NULL) free(reduction->histogramFlat);
-	if (reduction->histogram != NULL) {
-		RxiSlabFreeAll(&reduction->histogram->allocator);
-		free(reduction->histogram);
-	}
+	RxMemFree(reduction->yiqCache);
+	RxMemFree(reduction->indexCaches);
+	RxiHistFreeFlat(&reduction->histogramFlat);
+	if (reduction->histogram != NULL) RxiHistFree(reduction->histogram);
 }
 
 void RX_API RxFree(RxReduction *reduction) {
@@ -2144,17 +3360,22 @@ void RX_API RxFree(RxReduction *reduction) {
 	RxMemFree(reduction);
 }
 
-RxStatus RX_API RxGlbCreatePalette(const COLOR32 *img, unsigned int width, unsigned int height, COLOR32 *pal, unsigned int nColors, const RxBalanceSetting *balance, RxFlag flag, unsigned int *pOutCols) {
+static RxStatus RxiGlbCreatePalette(const COLOR32 *img, unsigned int width, unsigned int height, COLOR32 *pal, unsigned int nColors, const RxBalanceSetting *balance, RxFlag flag, unsigned int *pOutCols, unsigned int *pReclusterRuns, unsigned int *pReclusterIterations) {
 	RxReduction *reduction = RxNew(balance);
 	if (reduction == NULL) return RX_STATUS_NOMEM;
 
 	RxApplyFlags(reduction, flag);
 
 	RxStatus status = RxCreatePalette(reduction, img, width, height, pal, nColors, flag, pOutCols);
+	RxGetReclusterStats(reduction, pReclusterRuns, pReclusterIterations);
 	RxFree(reduction);
 	return status;
 }
 
+RxStatus RX_API RxGlbCreatePalette(const COLOR32 *img, unsigned int width, unsigned int height, COLOR32 *pal, unsigned int nColors, const RxBalanceSetting *balance, RxFlag flag, unsigned int *pOutCols) {
+	return RxiGlbCreatePalette(img, width, height, pal, nColors, balance, flag, pOutCols, NULL, NULL);
+}
+
 RxStatus RX_API RxCreatePalette(RxReduction *reduction, const COLOR32 *px, unsigned int width, unsigned int height, COLOR32 *pal, unsigned int nColors, RxFlag flag, unsigned int *pOutCols) {
 	RxHistAdd(reduction, px, width, height);
 	RxHistFinalize(reduction);
@@ -2190,24 +3411,100 @@ RxStatus RX_API RxCreatePalette(RxReduction *reduction, const COLOR32 *px, unsig
 // ----- character map color reduction routines
 
 #define RX_TILE_PALETTE_COUNT_MAX 16 // max palettes produced
+#define RX_TILE_FEATURES           8 // dimension of the palette summary used to find merge candidates
+#define RX_TILE_NONE         UINT_MAX // end of a palette member list
 
 typedef struct RxiTile_ {
 	COLOR32 rgb[64];                         // RGBA 8x8 block color
 	uint8_t indices[64];                     // indices into color palette per 8x8 pixels
 	RxYiqColor palette[RX_PALETTE_MAX_SIZE]; // YIQ color palette
 	int useCounts[RX_PALETTE_MAX_SIZE];
+	RxYiqColor histColors[64];               // histogram of the 8x8 block, in the order colors were added
+	double histWeights[64];
+	unsigned int nHistEntries;
 	unsigned int palIndex;                   // points to the index of the tile that is maintaining the palette this tile uses
 	unsigned int nUsedColors;                // number of filled slots
 	unsigned int nSwallowed;
+	unsigned int nextMember;                 // next tile using the same palette, in ascending order, or RX_TILE_NONE
+	unsigned int firstMember;                // for a representative tile, the first tile using its palette
+	unsigned int version;                    // for a representative tile, incremented when its palette changes
 } RxiTile;
 
+typedef struct RxiTileLink_ {
+	unsigned int partner;                    // representative tile of the candidate palette
+	double cost;                             // cost of this palette absorbing the candidate palette
+} RxiTileLink;
+
+typedef struct RxiTileLinks_ {
+	RxiTileLink *links;                      // palettes that are candidates for merging with this one
+	unsigned int nLinks;
+	unsigned int capLinks;
+} RxiTileLinks;
+
+typedef struct RxiTileMerge_ {
+	double cost;                             // cost of the palette of index1 absorbing the palette of index2
+	unsigned int index1;
+	unsigned int index2;
+	unsigned int version1;                   // versions of the palettes the cost was computed for
+	unsigned int version2;
+} RxiTileMerge;
+
+typedef struct RxiTileMergeQueue_ {
+	RxiTileMerge *entries;                   // min-heap of candidate merges, possibly stale
+	unsigned int nEntries;
+	unsigned int capEntries;
+	unsigned int nCompact;                   // entry count at which stale entries are purged
+} RxiTileMergeQueue;
+
+typedef struct RxiTileNeighbor_ {
+	float dist;                              // distance between palette summaries
+	unsigned int index;
+} RxiTileNeighbor;
+
+//workspace of RxCreateMultiplePalettes for the stages run in parallel over tiles
+typedef struct RxiTileWork_ {
+	RxReduction **reductions;                // one reduction per worker
+	RxiTile *tiles;
+	unsigned int nTiles;
+	const COLOR32 *imgBits;
+	unsigned int tilesX;
+	int nColsPerPalette;
+
+	const RxiTileNeighbor *sorted;           // representative tiles sorted by their first feature
+	const float *features;                   // per tile: palette summary
+	unsigned int nReps;
+	unsigned int maxNeighbors;
+	RxiTileNeighbor *neighbors;              // per sorted tile: its nearest representative tiles
+	unsigned int *nNeighbors;
+	double *costs;                           // per neighbor: cost of absorbing it, then of being absorbed by it
+
+	const RxYiqColor *yiqPalette;            // palettes being refined
+	int nPalettes;
+	int *bestPalettes;                       // per tile: index of the palette best suited
+	COLOR32 *palettes;
+} RxiTileWork;
+
 static void RxiTileCopy(RxiTile *dest, const COLOR32 *pxOrigin, unsigned int width) {
 	for (int y = 0; y < 8; y++) {
 		memcpy(dest->rgb + y * 8, pxOrigin + y * width, 8 * sizeof(COLOR32));
 	}
 }
 
-static double RxiTileComputePaletteDifference(RxReduction *reduction, const RxiTile *tile1, const RxiTile *tile2) {
+static void RxiTileHistLoad(RxReduction *reduction, const RxYiqColor *colors, const double *weights, unsigned int nEntries) {
+	for (unsigned int i = 0; i < nEntries; i++) {
+		RxHistAddColor(reduction, &colors[i], weights[i]);
+	}
+}
+
+static void RxiTileHistLoadPalette(RxReduction *reduction, const RxiTile *tiles, unsigned int index) {
+	//load the histograms of the tiles using a palette in ascending tile order, the order their pixels
+	//would be added in
+	for (unsigned int i = tiles[index].firstMember; i != RX_TILE_NONE; i = tiles[i].nextMember) {
+		RxiTileHistLoad(reduction, tiles[i].histColors, tiles[i].histWeights, tiles[i].nHistEntries);
+	}
+}
+
+static double RxiTileComputePaletteDifference(RxReduction *reduction, const RxiTile *tile1, const RxiTile *tile2, unsigned int nColsPerPalette) {
 	//if either palette has 0 colors, return 0 (perfect fit)
 	if (tile1->nUsedColors == 0 || tile2->nUsedColors == 0) return 0.0;
 
@@ -2230,7 +3527,7 @@ static double RxiTileComputePaletteDifference(RxReduction *reduction, const RxiT
 	if (totalDiff == 0.0) return 0.0;
 
 	//imperfect fit. 
-	unsigned int fullSize = 2 * reduction->nPaletteColors;
+	unsigned int fullSize = 2 * nColsPerPalette;
 	if (tile1->nUsedColors + tile2->nUsedColors < fullSize) {
 		//one or two palettes not full. Scale down
 		totalDiff *= sqrt(((double) (tile1->nUsedColors + tile2->nUsedColors)) / fullSize);
@@ -2244,36 +3541,368 @@ static double RxiTileComputePaletteDifference(RxReduction *reduction, const RxiT
 	return totalDiff;
 }
 
-static double RxiTileFindSimilarTiles(const RxiTile *tiles, const double *similarities, unsigned int nTiles, unsigned int *i1, unsigned int *i2) {
-	//find a pair of tiles. Both must be representative tiles.
+static double RxiTileComputeMergeCost(RxReduction *reduction, const RxiTile *tiles, unsigned int nColsPerPalette, unsigned int index1, unsigned int index2) {
+	//cost of the palette maintained by index1 absorbing the palette maintained by index2
+	return RxiTileComputePaletteDifference(reduction, &tiles[index2], &tiles[index1], nColsPerPalette);
+}
 
-	double leastDiff = RX_LARGE_NUMBER;
-	unsigned int best1 = 0, best2 = 1;
+static void RxiTileComputeFeature(RxReduction *reduction, const RxiTile *tile, float *feature) {
+	//summarize a palette by the weighted mean and spread of its colors in scaled YIQA space
+	double sum[4] = { 0 }, sum2[4] = { 0 }, total = 0.0;
+	for (unsigned int i = 0; i < tile->nUsedColors; i++) {
+		double w = (double) tile->useCounts[i];
+		if (w == 0.0) continue;
+
+		const RxYiqColor *yiq = &tile->palette[i];
+		double x[4] = {
+			reduction->yWeight * yiq->y,
+			reduction->iWeight * yiq->i,
+			reduction->qWeight * yiq->q,
+			reduction->aWeight * yiq->a
+		};
+		for (int k = 0; k < 4; k++) {
+			sum[k] += w * x[k];
+			sum2[k] += w * x[k] * x[k];
+		}
+		total += w;
+	}
 
-	for (unsigned int i = 0; i < nTiles; i++) {
-		const RxiTile *tile1 = &tiles[i];
-		if (tile1->palIndex != i) continue;
+	for (int k = 0; k < 4; k++) {
+		double mean = 0.0, var = 0.0;
+		if (total > 0.0) {
+			mean = sum[k] / total;
+			var = sum2[k] / total - mean * mean;
+			if (var < 0.0) var = 0.0;
+		}
+		feature[k] = (float) mean;
+		feature[k + 4] = (float) sqrt(var);
+	}
+}
 
-		for (unsigned int j = 0; j < nTiles; j++) {
-			const RxiTile *tile2 = &tiles[j];
+static int RxiTileFeatureKeyComparator(const void *e1, const void *e2) {
+	const RxiTileNeighbor *n1 = (const RxiTileNeighbor *) e1;
+	const RxiTileNeighbor *n2 = (const RxiTileNeighbor *) e2;
+	if (n1->dist < n2->dist) return -1;
+	if (n1->dist > n2->dist) return  1;
+	if (n1->index < n2->index) return -1;
+	if (n1->index > n2->index) return  1;
+	return 0;
+}
 
-			if (tile2->palIndex != j) continue;
-			if (i == j) continue;
+static inline RxBool RxiTileNeighborWorse(const RxiTileNeighbor *n1, const RxiTileNeighbor *n2) {
+	return n1->dist > n2->dist || (n1->dist == n2->dist && n1->index > n2->index);
+}
 
-			//test difference
-			if (similarities[i * nTiles + j] <= leastDiff) {
-				leastDiff = similarities[i * nTiles + j];
-				best1 = i;
-				best2 = j;
-				if (!leastDiff) goto Done;
+static void RxiTileNeighborOffer(RxiTileNeighbor *heap, unsigned int *pnHeap, unsigned int maxHeap, float dist, unsigned int index) {
+	//keep the maxHeap nearest neighbors in a max-heap, the farthest kept at the root
+	RxiTileNeighbor n = { dist, index };
+	unsigned int nHeap = *pnHeap, i;
+
+	if (nHeap < maxHeap) {
+		i = nHeap++;
+		while (i > 0) {
+			unsigned int parent = (i - 1) / 2;
+			if (!RxiTileNeighborWorse(&n, &heap[parent])) break;
+			heap[i] = heap[parent];
+			i = parent;
+		}
+		heap[i] = n;
+		*pnHeap = nHeap;
+		return;
+	}
+
+	if (!RxiTileNeighborWorse(&heap[0], &n)) return;
+	i = 0;
+	while (1) {
+		unsigned int child = 2 * i + 1;
+		if (child >= nHeap) break;
+		if (child + 1 < nHeap && RxiTileNeighborWorse(&heap[child + 1], &heap[child])) child++;
+		if (!RxiTileNeighborWorse(&heap[child], &n)) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = n;
+}
+
+static int RxiTileLinkFind(const RxiTileLinks *node, unsigned int partner) {
+	for (unsigned int i = 0; i < node->nLinks; i++) {
+		if (node->links[i].partner == partner) return (int) i;
+	}
+	return -1;
+}
+
+static void RxiTileLinkAdd(RxiTileLinks *node, unsigned int partner, double cost) {
+	if (node->nLinks == node->capLinks) {
+		node->capLinks = node->capLinks ? (node->capLinks * 2) : RX_TILE_CANDIDATES;
+		node->links = (RxiTileLink *) realloc(node->links, node->capLinks * sizeof(RxiTileLink));
+	}
+	node->links[node->nLinks].partner = partner;
+	node->links[node->nLinks].cost = cost;
+	node->nLinks++;
+}
+
+static void RxiTileLinkRemove(RxiTileLinks *node, unsigned int partner) {
+	int i = RxiTileLinkFind(node, partner);
+	if (i == -1) return;
+
+	node->links[i] = node->links[--node->nLinks];
+}
+
+static void RxiTileConnect(RxiTileLinks *graph, unsigned int index1, unsigned int index2, double cost12, double cost21) {
+	//links are kept symmetric, each end holding the cost of absorbing the other
+	if (RxiTileLinkFind(&graph[index1], index2) != -1) return;
+
+	RxiTileLinkAdd(&graph[index1], index2, cost12);
+	RxiTileLinkAdd(&graph[index2], index1, cost21);
+}
+
+static void RxiTileFindNeighbors(void *param, unsigned int i, unsigned int worker) {
+	//find the nearest representative tiles to the i-th in sorted order, and the costs of merging with them.
+	RxiTileWork *work = (RxiTileWork *) param;
+	RxReduction *reduction = work->reductions[worker];
+	const RxiTileNeighbor *sorted = work->sorted;
+	unsigned int nReps = work->nReps, maxNeighbors = work->maxNeighbors;
+
+	unsigned int index = sorted[i].index;
+	const float *f1 = work->features + index * RX_TILE_FEATURES;
+	RxiTileNeighbor *neighbors = work->neighbors + i * RX_TILE_CANDIDATES;
+	unsigned int nNeighbors = 0;
+
+	for (int dir = -1; dir <= 1; dir += 2) {
+		for (int j = (int) i + dir; j >= 0 && j < (int) nReps; j += dir) {
+			float d0 = sorted[j].dist - sorted[i].dist;
+			if (nNeighbors == maxNeighbors && d0 * d0 > neighbors[0].dist) break;
+
+			const float *f2 = work->features + sorted[j].index * RX_TILE_FEATURES;
+			float dist = 0.0f;
+			for (int k = 0; k < RX_TILE_FEATURES; k++) {
+				dist += (f1[k] - f2[k]) * (f1[k] - f2[k]);
 			}
+			RxiTileNeighborOffer(neighbors, &nNeighbors, maxNeighbors, dist, sorted[j].index);
+		}
+	}
+
+	double *costs = work->costs + 2 * i * RX_TILE_CANDIDATES;
+	for (unsigned int j = 0; j < nNeighbors; j++) {
+		costs[2 * j + 0] = RxiTileComputeMergeCost(reduction, work->tiles, work->nColsPerPalette, index, neighbors[j].index);
+		costs[2 * j + 1] = RxiTileComputeMergeCost(reduction, work->tiles, work->nColsPerPalette, neighbors[j].index, index);
+	}
+	work->nNeighbors[i] = nNeighbors;
+}
+
+static void RxiTileBuildCandidates(RxiTileWork *work, RxiTileLinks *graph, volatile int *progress) {
+	//summarize each representative tile's palette
+	const RxiTile *tiles = work->tiles;
+	unsigned int nTiles = work->nTiles, nReps = 0;
+	RxiTileNeighbor *sorted = (RxiTileNeighbor *) calloc(nTiles, sizeof(RxiTileNeighbor));
+	float *features = (float *) calloc(nTiles, RX_TILE_FEATURES * sizeof(float));
+	for (unsigned int i = 0; i < nTiles; i++) {
+		if (tiles[i].palIndex != i) continue;
+
+		RxiTileComputeFeature(work->reductions[0], &tiles[i], features + i * RX_TILE_FEATURES);
+		sorted[nReps].dist = features[i * RX_TILE_FEATURES];
+		sorted[nReps].index = i;
+		nReps++;
+	}
+
+	if (nReps < 2) {
+		free(features);
+		free(sorted);
+		return;
+	}
+
+	//sort by the first feature so that a search may stop once that alone is too far
+	qsort(sorted, nReps, sizeof(RxiTileNeighbor), RxiTileFeatureKeyComparator);
+
+	//search neighbors in parallel, then link them in order
+	work->sorted = sorted;
+	work->features = features;
+	work->nReps = nReps;
+	work->maxNeighbors = min(nReps - 1, RX_TILE_CANDIDATES);
+	work->neighbors = (RxiTileNeighbor *) calloc(nReps, RX_TILE_CANDIDATES * sizeof(RxiTileNeighbor));
+	work->nNeighbors = (unsigned int *) calloc(nReps, sizeof(unsigned int));
+	work->costs = (double *) calloc(nReps, 2 * RX_TILE_CANDIDATES * sizeof(double));
+	TpParallelFor(nReps, RxiTileFindNeighbors, work);
+
+	for (unsigned int i = 0; i < nReps; i++) {
+		const RxiTileNeighbor *neighbors = work->neighbors + i * RX_TILE_CANDIDATES;
+		const double *costs = work->costs + 2 * i * RX_TILE_CANDIDATES;
+		for (unsigned int j = 0; j < work->nNeighbors[i]; j++) {
+			RxiTileConnect(graph, sorted[i].index, neighbors[j].index, costs[2 * j + 0], costs[2 * j + 1]);
+		}
+		if (progress != NULL) (*progress)++;
+	}
+
+	free(work->neighbors);
+	free(work->nNeighbors);
+	free(work->costs);
+	free(features);
+	free(sorted);
+}
+
+static void RxiTileMergeLinks(RxiTileLinks *graph, unsigned int index1, unsigned int index2) {
+	//the palette of index1 absorbs the palette of index2 and inherits its candidates.
+	RxiTileLinks *node2 = &graph[index2];
+	for (unsigned int i = 0; i < node2->nLinks; i++) {
+		unsigned int partner = node2->links[i].partner;
+		RxiTileLinkRemove(&graph[partner], index2);
+		if (partner == index1) continue;
+
+		if (RxiTileLinkFind(&graph[index1], partner) == -1) {
+			//costs are computed once the merged palette is known
+			RxiTileLinkAdd(&graph[index1], partner, 0.0);
+			RxiTileLinkAdd(&graph[partner], index1, 0.0);
+		}
+	}
+
+	free(node2->links);
+	node2->links = NULL;
+	node2->nLinks = 0;
+	node2->capLinks = 0;
+}
+
+static void RxiTileUpdateLinks(RxReduction *reduction, const RxiTile *tiles, unsigned int nColsPerPalette, RxiTileLinks *graph, unsigned int index) {
+	//recompute merge costs in both directions for a palette that has changed
+	RxiTileLinks *node = &graph[index];
+	for (unsigned int i = 0; i < node->nLinks; i++) {
+		unsigned int partner = node->links[i].partner;
+		RxiTileLinks *node2 = &graph[partner];
+
+		node->links[i].cost = RxiTileComputeMergeCost(reduction, tiles, nColsPerPalette, index, partner);
+		node2->links[RxiTileLinkFind(node2, index)].cost = RxiTileComputeMergeCost(reduction, tiles, nColsPerPalette, partner, index);
+	}
+}
+
+static inline RxBool RxiTileMergeBefore(const RxiTileMerge *m1, const RxiTileMerge *m2) {
+	//cheapest merge first. Ties go to the last pair in order of (index1, index2), except for a
+	//perfect fit, where they go to the first.
+	if (m1->cost != m2->cost) return m1->cost < m2->cost;
+
+	RxBool first = m1->index1 < m2->index1 || (m1->index1 == m2->index1 && m1->index2 < m2->index2);
+	return (m1->cost == 0.0) ? first : !first;
+}
+
+static inline RxBool RxiTileMergeValid(const RxiTile *tiles, const RxiTileMerge *merge) {
+	const RxiTile *tile1 = &tiles[merge->index1], *tile2 = &tiles[merge->index2];
+	return tile1->palIndex == merge->index1 && tile1->version == merge->version1
+		&& tile2->palIndex == merge->index2 && tile2->version == merge->version2;
+}
+
+static void RxiTileMergeSiftDown(RxiTileMergeQueue *queue, unsigned int i) {
+	RxiTileMerge *heap = queue->entries;
+	RxiTileMerge merge = heap[i];
+
+	while (1) {
+		unsigned int child = 2 * i + 1;
+		if (child >= queue->nEntries) break;
+		if (child + 1 < queue->nEntries && RxiTileMergeBefore(&heap[child + 1], &heap[child])) child++;
+		if (!RxiTileMergeBefore(&heap[child], &merge)) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = merge;
+}
+
+static void RxiTileMergeCompact(RxiTileMergeQueue *queue, const RxiTile *tiles) {
+	//purge merges of palettes that have since changed and restore the heap
+	unsigned int nValid = 0;
+	for (unsigned int i = 0; i < queue->nEntries; i++) {
+		if (RxiTileMergeValid(tiles, &queue->entries[i])) queue->entries[nValid++] = queue->entries[i];
+	}
+	queue->nEntries = nValid;
+
+	for (unsigned int i = nValid / 2; i > 0; i--) RxiTileMergeSiftDown(queue, i - 1);
+	queue->nCompact = max(2 * nValid, queue->nCompact);
+}
+
+static void RxiTileMergePush(RxiTileMergeQueue *queue, const RxiTile *tiles, unsigned int index1, unsigned int index2, double cost) {
+	if (queue->nEntries >= queue->nCompact) RxiTileMergeCompact(queue, tiles);
+	if (queue->nEntries == queue->capEntries) {
+		queue->capEntries = queue->capEntries ? (queue->capEntries * 2) : RX_TILE_CANDIDATES;
+		queue->entries = (RxiTileMerge *) realloc(queue->entries, queue->capEntries * sizeof(RxiTileMerge));
+	}
+
+	RxiTileMerge merge;
+	merge.cost = cost;
+	merge.index1 = index1;
+	merge.index2 = index2;
+	merge.version1 = tiles[index1].version;
+	merge.version2 = tiles[index2].version;
+
+	RxiTileMerge *heap = queue->entries;
+	unsigned int i = queue->nEntries++;
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 2;
+		if (!RxiTileMergeBefore(&merge, &heap[parent])) break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = merge;
+}
+
+static void RxiTileMergePushLinks(RxiTileMergeQueue *queue, const RxiTile *tiles, const RxiTileLinks *graph, unsigned int index) {
+	//queue the merges of a palette with its candidates, in both directions
+	const RxiTileLinks *node = &graph[index];
+	for (unsigned int i = 0; i < node->nLinks; i++) {
+		unsigned int partner = node->links[i].partner;
+		const RxiTileLinks *node2 = &graph[partner];
+
+		RxiTileMergePush(queue, tiles, index, partner, node->links[i].cost);
+		RxiTileMergePush(queue, tiles, partner, index, node2->links[RxiTileLinkFind(node2, index)].cost);
+	}
+}
+
+static RxBool RxiTileMergePop(RxiTileMergeQueue *queue, const RxiTile *tiles, unsigned int *i1, unsigned int *i2, double *pCost) {
+	//find a pair of tiles. Both must be representative tiles, with palettes unchanged since queued.
+	while (queue->nEntries > 0) {
+		RxiTileMerge merge = queue->entries[0];
+		queue->entries[0] = queue->entries[--queue->nEntries];
+		if (queue->nEntries > 0) RxiTileMergeSiftDown(queue, 0);
+
+		if (RxiTileMergeValid(tiles, &merge)) {
+			*i1 = merge.index1;
+			*i2 = merge.index2;
+			*pCost = merge.cost;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void RxiTileMergeQueueAll(RxiTileMergeQueue *queue, const RxiTile *tiles, const RxiTileLinks *graph, unsigned int nTiles) {
+	//queue each link from the end that holds its cost
+	for (unsigned int i = 0; i < nTiles; i++) {
+		if (tiles[i].palIndex != i) continue;
+
+		const RxiTileLinks *node = &graph[i];
+		for (unsigned int j = 0; j < node->nLinks; j++) {
+			RxiTileMergePush(queue, tiles, i, node->links[j].partner, node->links[j].cost);
 		}
 	}
+}
 
-Done:
-	*i1 = best1;
-	*i2 = best2;
-	return leastDiff;
+static void RxiTileMergeMembers(RxiTile *tiles, unsigned int index1, unsigned int index2) {
+	//move the tiles using the palette of index2 to the palette of index1, keeping ascending order
+	unsigned int *link = &tiles[index1].firstMember;
+	unsigned int a = tiles[index1].firstMember, b = tiles[index2].firstMember;
+	while (a != RX_TILE_NONE && b != RX_TILE_NONE) {
+		if (a < b) {
+			*link = a;
+			link = &tiles[a].nextMember;
+			a = tiles[a].nextMember;
+		} else {
+			tiles[b].palIndex = index1;
+			*link = b;
+			link = &tiles[b].nextMember;
+			b = tiles[b].nextMember;
+		}
+	}
+	if (a != RX_TILE_NONE) {
+		*link = a;
+	} else {
+		*link = b;
+		for (; b != RX_TILE_NONE; b = tiles[b].nextMember) tiles[b].palIndex = index1;
+	}
 }
 
 static COLOR32 RxiChooseMultiPaletteColor0(RxReduction *reduction) {
@@ -2289,7 +3918,7 @@ static COLOR32 RxiChooseMultiPaletteColor0(RxReduction *reduction) {
 	RxHistInit(reduction);
 	for (unsigned int i = 0; i < nCol; i++) {
 		RxYiqColor maskYiq;
-		RxConvertRgbToYiq(RxiMaskYiqToRgb(reduction, &histCols[i]), &maskYiq);
+		RxiConvertRgbToYiq(RxiMaskYiqToRgb(reduction, &histCols[i]), &maskYiq);
 		RxHistAddColor(reduction, &maskYiq, weights[i]);
 	}
 	RxHistFinalize(reduction);
@@ -2308,6 +3937,88 @@ static void RxiGetPalette0Rgb(RxReduction *reduction, COLOR32 *dest, unsigned in
 	for (unsigned int i = 0; i < nCols; i++) dest[i] = reduction->paletteRgb[i][0];
 }
 
+static void RxiTileCreatePalette(void *param, unsigned int index, unsigned int worker) {
+	//create the palette of one tile from its own pixels
+	RxiTileWork *work = (RxiTileWork *) param;
+	RxReduction *reduction = work->reductions[worker];
+	unsigned int tilesX = work->tilesX, x = index % tilesX, y = index / tilesX;
+
+	RxiTile *tile = &work->tiles[index];
+	const COLOR32 *pxOrigin = work->imgBits + x * 8 + (y * 8 * tilesX * 8);
+	RxiTileCopy(tile, pxOrigin, tilesX * 8);
+
+	RxHistClear(reduction);
+	RxHistAdd(reduction, tile->rgb, 8, 8);
+	RxHistFinalize(reduction);
+	RxComputePalette(reduction, work->nColsPerPalette);
+
+	//keep the histogram so the tile's pixels need not be read again
+	tile->nHistEntries = reduction->histogram->nEntries;
+	memcpy(tile->histColors, reduction->histogram->colors, tile->nHistEntries * sizeof(RxYiqColor));
+	memcpy(tile->histWeights, reduction->histogram->weights, tile->nHistEntries * sizeof(double));
+	for (unsigned int i = 0; i < RX_PALETTE_MAX_SIZE; i++) {
+		RxiColorCopy(&tile->palette[i], &reduction->paletteYiq[i][0]);
+	}
+
+	tile->nUsedColors = reduction->nUsedColors;
+
+	//match pixels to palette indices
+	RxYiqColor pxYiq[64];
+	RxiConvertRgbToYiqBatch(tile->rgb, pxYiq, 1, 64);
+	for (unsigned int i = 0; i < 64; i++) {
+		unsigned int index = RxiPaletteFindClosestColor(reduction, &tile->palette[0], tile->nUsedColors, &pxYiq[i], NULL);
+		if ((tile->rgb[i] >> 24) == 0) index = RX_PALETTE_MAX_SIZE - 1;
+		tile->indices[i] = (uint8_t) index;
+		tile->useCounts[index]++;
+	}
+	tile->palIndex = index;
+	tile->nextMember = RX_TILE_NONE;
+	tile->firstMember = index;
+	tile->nSwallowed = 1;
+}
+
+static void RxiTileChoosePalette(void *param, unsigned int index, unsigned int worker) {
+	//find the palette best suited to one tile
+	RxiTileWork *work = (RxiTileWork *) param;
+	RxReduction *reduction = work->reductions[worker];
+	const RxiTile *t = &work->tiles[index];
+	int best = 0;
+	double bestError = RX_LARGE_NUMBER;
+
+	//compute histogram for the tile
+	RxHistClear(reduction);
+	RxiTileHistLoad(reduction, t->histColors, t->histWeights, t->nHistEntries);
+	RxHistFinalize(reduction);
+
+	//determine which palette is best for this tile for remap
+	for (int j = 0; j < work->nPalettes; j++) {
+		double error = RxHistComputePaletteErrorYiq(reduction, work->yiqPalette + (j * RX_PALETTE_MAX_SIZE), work->nColsPerPalette, bestError);
+		if (error < bestError) {
+			bestError = error;
+			best = j;
+		}
+	}
+	work->bestPalettes[index] = best;
+}
+
+static void RxiTileRebuildPalette(void *param, unsigned int index, unsigned int worker) {
+	//create a palette from the tiles it is best suited to
+	RxiTileWork *work = (RxiTileWork *) param;
+	RxReduction *reduction = work->reductions[worker];
+	const RxiTile *tiles = work->tiles;
+
+	RxHistClear(reduction);
+	for (unsigned int j = 0; j < work->nTiles; j++) {
+		if (work->bestPalettes[j] != (int) index) continue;
+		RxiTileHistLoad(reduction, tiles[j].histColors, tiles[j].histWeights, tiles[j].nHistEntries);
+	}
+	RxHistFinalize(reduction);
+	RxComputePalette(reduction, work->nColsPerPalette);
+
+	//write back
+	RxiGetPalette0Rgb(reduction, work->palettes + index * RX_PALETTE_MAX_SIZE, work->nColsPerPalette);
+}
+
 static int RxiPaletteLightnessComparator(const void *e1, const void *e2) {
 	const COLOR32 *p1 = (const COLOR32 *) e1;
 	const COLOR32 *p2 = (const COLOR32 *) e2;
@@ -2317,8 +4028,8 @@ static int RxiPaletteLightnessComparator(const void *e1, const void *e2) {
 	//average lightness per palette
 	for (unsigned int i = 0; i < RX_PALETTE_MAX_SIZE; i++) {
 		RxYiqColor yiq1, yiq2;
-		RxConvertRgbToYiq(p1[i], &yiq1);
-		RxConvertRgbToYiq(p2[i], &yiq2);
+		RxiConvertRgbToYiq(p1[i], &yiq1);
+		RxiConvertRgbToYiq(p2[i], &yiq2);
 
 		y1 += yiq1.y; a1 += yiq1.a;
 		y2 += yiq2.y; a2 += yiq2.a;
@@ -2348,8 +4059,12 @@ void RX_API RxCreateMultiplePalettes(
 	int                     paletteOffset,
 	RxBool                  useColor0,
 	const RxBalanceSetting *balance,
-	volatile int           *progress
+	volatile int           *progress,
+	unsigned int           *pReclusterRuns,
+	unsigned int           *pReclusterIterations
 ) {
+	if (pReclusterRuns != NULL) *pReclusterRuns = 0;
+	if (pReclusterIterations != NULL) *pReclusterIterations = 0;
 	if (nPalettes == 0) return;
 
 	//in the case of one palette, call to the faster single-palette routines.
@@ -2361,7 +4076,7 @@ void RX_API RxCreateMultiplePalettes(
 			effectivePaletteSize--;
 		}
 
-		RxGlbCreatePalette(
+		RxiGlbCreatePalette(
 			imgBits,
 			tilesX * 8,
 			tilesY * 8,
@@ -2369,7 +4084,9 @@ void RX_API RxCreateMultiplePalettes(
 			effectivePaletteSize,
 			balance,
 			RX_FLAG_SORT_ALL | RX_FLAG_ALPHA_MODE_NONE,
-			NULL
+			NULL,
+			pReclusterRuns,
+			pReclusterIterations
 		);
 		if (paletteOffset == 0 && !useColor0) dest[(paletteBase * paletteSize)] = 0xFF00FF; // transparent fill
 		return;
@@ -2388,63 +4105,49 @@ void RX_API RxCreateMultiplePalettes(
 	RxiTile *tiles = (RxiTile *) RxMemCalloc(nTiles, sizeof(RxiTile));
 	RxReduction *reduction = RxNew(balance);
 
-	for (unsigned int y = 0; y < tilesY; y++) {
-		for (unsigned int x = 0; x < tilesX; x++) {
-			RxiTile *tile = &tiles[x + (y * tilesX)];
-			const COLOR32 *pxOrigin = imgBits + x * 8 + (y * 8 * tilesX * 8);
-			RxiTileCopy(tile, pxOrigin, tilesX * 8);
-
-			RxHistClear(reduction);
-			RxHistAdd(reduction, tile->rgb, 8, 8);
-			RxHistFinalize(reduction);
-			RxComputePalette(reduction, nColsPerPalette);
-			for (unsigned int i = 0; i < RX_PALETTE_MAX_SIZE; i++) {
-				RxiColorCopy(&tile->palette[i], &reduction->paletteYiq[i][0]);
-			}
-
-			tile->nUsedColors = reduction->nUsedColors;
-
-			//match pixels to palette indices
-			for (unsigned int i = 0; i < 64; i++) {
-				unsigned int index = RxiPaletteFindClosestRgbColor(reduction, &tile->palette[0], tile->nUsedColors, tile->rgb[i], NULL);
-				if ((tile->rgb[i] >> 24) == 0) index = RX_PALETTE_MAX_SIZE - 1;
-				tile->indices[i] = (uint8_t) index;
-				tile->useCounts[index]++;
-			}
-			tile->palIndex = x + y * tilesX;
-			tile->nSwallowed = 1;
-		}
-	}
-
-	// ----- STAGE 2: create difference map
-	// We'll determine candidacy for palette merges using an nxn matrix of differences. Each entry
-	// in the diagonal is necessarily 0 since any palette is merged with itself without cost. The
-	// matrix is not symmetric, however, representing the different directions in which this relation
-	// is calculated.
-	double *diffBuff = (double *) calloc(nTiles * nTiles, sizeof(double));
-	for (unsigned int i = 0; i < nTiles; i++) {
-		RxiTile *tile1 = &tiles[i];
-		for (unsigned int j = 0; j < nTiles; j++) {
-			RxiTile *tile2 = &tiles[j];
-
-			//write difference
-			if (i == j) {
-				diffBuff[i + j * nTiles] = 0.0;
-			} else {
-				diffBuff[i + j * nTiles] = RxiTileComputePaletteDifference(reduction, tile1, tile2);
-			}
-		}
-		(*progress)++;
-	}
+	//tiles are processed in parallel, each worker with its own reduction. Each task writes only the
+	//results of its own tile or palette, so the output does not depend on the thread count.
+	unsigned int nWorkers = TpGetThreadCount();
+	RxReduction **reductions = (RxReduction **) calloc(nWorkers, sizeof(RxReduction *));
+	reductions[0] = reduction;
+	for (unsigned int i = 1; i < nWorkers; i++) reductions[i] = RxNew(balance);
+	for (unsigned int i = 0; i < nWorkers; i++) RxHistInit(reductions[i]);
+
+	RxiTileWork work = { 0 };
+	work.reductions = reductions;
+	work.tiles = tiles;
+	work.nTiles = nTiles;
+	work.imgBits = imgBits;
+	work.tilesX = tilesX;
+	work.nColsPerPalette = nColsPerPalette;
+	TpParallelFor(nTiles, RxiTileCreatePalette, &work);
+
+	// ----- STAGE 2: find merge candidates
+	// Comparing every pair of palettes takes quadratic time and memory, so each palette is linked only
+	// with the palettes nearest to it by a summary of its colors. The links are symmetric, and each end
+	// holds the cost of absorbing the palette at the other, since the relation is not symmetric.
+	RxiTileLinks *graph = (RxiTileLinks *) calloc(nTiles, sizeof(RxiTileLinks));
+	RxiTileBuildCandidates(&work, graph, progress);
 
 	// ----- STAGE 3: merge palettes
 	// We'll select the most highly mergeable two palettes and merge them by creating a new palette
-	// using the combined histograms of represented tiles.
+	// using the combined histograms of represented tiles. The merged palette inherits the candidates of
+	// both. When no candidates remain, candidates are found again among the remaining palettes.
+	// Candidate merges are queued by cost, and a queued merge is discarded once either palette changes.
+	RxiTileMergeQueue queue = { 0 };
+	queue.nCompact = 2 * nTiles * RX_TILE_CANDIDATES;
+	RxiTileMergeQueueAll(&queue, tiles, graph, nTiles);
+
 	int nCurrentPalettes = nTiles;
 	while (nCurrentPalettes > 1) {
 		//find two best palettes to merge
 		unsigned int index1, index2;
-		double cost = RxiTileFindSimilarTiles(tiles, diffBuff, nTiles, &index1, &index2);
+		double cost;
+		if (!RxiTileMergePop(&queue, tiles, &index1, &index2, &cost)) {
+			RxiTileBuildCandidates(&work, graph, NULL);
+			RxiTileMergeQueueAll(&queue, tiles, graph, nTiles);
+			if (!RxiTileMergePop(&queue, tiles, &index1, &index2, &cost)) break;
+		}
 
 		//we will continue to merge palettes even when we have are at or below the target count when
 		//we may merge more palettes at 0 cost, or when there exist palettes which may be merged losslessly
@@ -2454,59 +4157,46 @@ void RX_API RxCreateMultiplePalettes(
 		}
 
 		//find all instances of index2, replace with index1
-		int nSwitched = 0;
-		for (unsigned int i = 0; i < nTiles; i++) {
-			if (tiles[i].palIndex == index2) {
-				tiles[i].palIndex = index1;
-				nSwitched++;
-			}
-		}
+		int nSwitched = tiles[index2].nSwallowed;
+		RxiTileMergeMembers(tiles, index1, index2);
 
-		//build new palette
+		//build new palette from the histograms of the tiles of both palettes
 		RxHistClear(reduction);
-		for (unsigned int i = 0; i < nTiles; i++) {
-			if (tiles[i].palIndex == index1) {
-				RxHistAdd(reduction, tiles[i].rgb, 8, 8);
-			}
-		}
+		RxiTileHistLoadPalette(reduction, tiles, index1);
 		RxHistFinalize(reduction);
 		RxComputePalette(reduction, nColsPerPalette);
 
 		//write over the palette of the tile
 		RxiTile *palTile = &tiles[index1];
 		for (int i = 0; i < RX_PALETTE_MAX_SIZE - 1; i++) {
-			RxConvertRgbToYiq(reduction->paletteRgb[i][0], &palTile->palette[i]);
+			RxiConvertRgbToYiq(reduction->paletteRgb[i][0], &palTile->palette[i]);
 		}
 		palTile->nUsedColors = reduction->nUsedColors;
 		palTile->nSwallowed += nSwitched;
+		palTile->version++;
 
 		//get new use count
 		RxiTile *rep = &tiles[index1];
 		memset(rep->useCounts, 0, sizeof(rep->useCounts));
-		for (unsigned int i = 0; i < nTiles; i++) {
+		for (unsigned int i = rep->firstMember; i != RX_TILE_NONE; i = tiles[i].nextMember) {
 			RxiTile *tile = &tiles[i];
-			if (tile->palIndex != index1) continue;
 
+			RxYiqColor pxYiq[64];
+			RxiConvertRgbToYiqBatch(tile->rgb, pxYiq, 1, 64);
 			for (int j = 0; j < 64; j++) {
 				COLOR32 col = tile->rgb[j];
-				int index = RxiPaletteFindClosestRgbColor(reduction, tile->palette, tile->nUsedColors, tile->rgb[j], NULL);
+				int index = RxiPaletteFindClosestColor(reduction, tile->palette, tile->nUsedColors, &pxYiq[j], NULL);
 				if ((col >> 24) == 0) index = RX_PALETTE_MAX_SIZE - 1;
 				tile->indices[j] = (uint8_t) index;
 				rep->useCounts[index]++;
 			}
 		}
 
-		//recompute differences for index1 and representative tiles
-		for (unsigned int i = 0; i < nTiles; i++) {
-			RxiTile *t = &tiles[i];
-			if (t->palIndex != i) continue;
-
-			double diff1 = RxiTileComputePaletteDifference(reduction, t, rep);
-			double diff2 = RxiTileComputePaletteDifference(reduction, rep, t);
-			diffBuff[i + index1 * nTiles] = diff1;
-			diffBuff[index1 + i * nTiles] = diff2;
-		}
-
+		//recompute differences for index1 and its candidates
+		RxiTileMergeLinks(graph, index1, index2);
+		RxiTileUpdateLinks(reduction, tiles, nColsPerPalette, graph, index1);
+		RxiTileMergePushLinks(&queue, tiles, graph, index1);
+
 		nCurrentPalettes--;
 		(*progress)++;
 	}
@@ -2522,11 +4212,7 @@ void RX_API RxCreateMultiplePalettes(
 
 		//rebuild palette but with masking enabled
 		RxHistClear(reduction);
-		for (unsigned int j = 0; j < nTiles; j++) {
-			if (tiles[j].palIndex == t->palIndex) {
-				RxHistAdd(reduction, tiles[j].rgb, 8, 8);
-			}
-		}
+		RxiTileHistLoadPalette(reduction, tiles, i);
 		RxHistFinalize(reduction);
 		RxComputePalette(reduction, nColsPerPalette);
 		
@@ -2543,47 +4229,20 @@ void RX_API RxCreateMultiplePalettes(
 		//palette to YIQ
 		for (int i = 0; i < nPalettes; i++) {
 			for (int j = 0; j < nColsPerPalette; j++) {
-				RxConvertRgbToYiq(palettes[i * RX_PALETTE_MAX_SIZE + j], &yiqPalette[i * RX_PALETTE_MAX_SIZE + j]);
+				RxiConvertRgbToYiq(palettes[i * RX_PALETTE_MAX_SIZE + j], &yiqPalette[i * RX_PALETTE_MAX_SIZE + j]);
 			}
 		}
 
 		//find best palette for each tile again
-		for (unsigned int i = 0; i < nTiles; i++) {
-			RxiTile *t = &tiles[i];
-			COLOR32 *px = t->rgb;
-			int best = 0;
-			double bestError = RX_LARGE_NUMBER;
-
-			//compute histogram for the tile
-			RxHistClear(reduction);
-			RxHistAdd(reduction, px, 8, 8);
-			RxHistFinalize(reduction);
-
-			//determine which palette is best for this tile for remap
-			for (int j = 0; j < nPalettes; j++) {
-				double error = RxHistComputePaletteErrorYiq(reduction, yiqPalette + (j * RX_PALETTE_MAX_SIZE), nColsPerPalette, bestError);
-				if (error < bestError) {
-					bestError = error;
-					best = j;
-				}
-			}
-			bestPalettes[i] = best;
-		}
+		work.yiqPalette = yiqPalette;
+		work.nPalettes = nPalettes;
+		work.bestPalettes = bestPalettes;
+		work.palettes = palettes;
+		TpParallelFor(nTiles, RxiTileChoosePalette, &work);
 
 		//now that we have the new best palette indices, begin regenerating the palettes
 		//in a way pretty similar to before
-		for (int i = 0; i < nPalettes; i++) {
-			RxHistClear(reduction);
-			for (unsigned int j = 0; j < nTiles; j++) {
-				if (bestPalettes[j] != i) continue;
-				RxHistAdd(reduction, tiles[j].rgb, 8, 8);
-			}
-			RxHistFinalize(reduction);
-			RxComputePalette(reduction, nColsPerPalette);
-
-			//write back
-			RxiGetPalette0Rgb(reduction, palettes + i * RX_PALETTE_MAX_SIZE, nColsPerPalette);
-		}
+		TpParallelFor(nPalettes, RxiTileRebuildPalette, &work);
 	}
 	RxMemFree(yiqPalette);
 
@@ -2609,19 +4268,20 @@ void RX_API RxCreateMultiplePalettes(
 				if (bestPalettes[j] != i) continue;
 
 				//error for each color in the block
+				RxYiqColor pxYiq[64];
+				RxiConvertRgbToYiqBatch(tiles[j].rgb, pxYiq, 1, 64);
 				for (unsigned int k = 0; k < 64; k++) {
 					double diff = 0.0;
 					RxPaletteFindClosestColor(errHist, tiles[j].rgb[k], &diff);
 
 					//want only the error in excess of what may be achieved by masking
-					RxYiqColor yiqCol, yiqMask;
-					RxConvertRgbToYiq(tiles[j].rgb[k], &yiqCol);
-					RxConvertRgbToYiq(RxiMaskYiqToRgb(reduction, &yiqCol), &yiqMask);
-					diff -= RxiComputeColorDifference(reduction, &yiqCol, &yiqMask);
+					RxYiqColor yiqMask;
+					RxiConvertRgbToYiq(RxiMaskYiqToRgb(reduction, &pxYiq[k]), &yiqMask);
+					diff -= RxiComputeColorDifference(reduction, &pxYiq[k], &yiqMask);
 					if (diff < 0.0) diff = 0.0;
 
 					//accumulate error
-					RxHistAddColor(errHist, &yiqCol, diff);
+					RxHistAddColor(errHist, &pxYiq[k], diff);
 				}
 			}
 			RxPaletteFree(errHist);
@@ -2642,7 +4302,7 @@ void RX_API RxCreateMultiplePalettes(
 			//build histogram
 			RxHistClear(reduction);
 			for (unsigned int j = 0; j < nTiles; j++) {
-				if (bestPalettes[j] == i) RxHistAdd(reduction, tiles[j].rgb, 8, 8);
+				if (bestPalettes[j] == i) RxiTileHistLoad(reduction, tiles[j].histColors, tiles[j].histWeights, tiles[j].nHistEntries);
 			}
 			RxHistFinalize(reduction);
 
@@ -2657,12 +4317,23 @@ void RX_API RxCreateMultiplePalettes(
 		}
 	}
 
+	//the palettes were refined on all of the worker reductions
+	for (unsigned int i = 0; i < nWorkers; i++) {
+		unsigned int nRuns, nIterations;
+		RxGetReclusterStats(reductions[i], &nRuns, &nIterations);
+		if (pReclusterRuns != NULL) *pReclusterRuns += nRuns;
+		if (pReclusterIterations != NULL) *pReclusterIterations += nIterations;
+	}
+
 	free(palettes);
 	free(bestPalettes);
 	RxFree(errHist);
-	RxFree(reduction);
+	for (unsigned int i = 0; i < nWorkers; i++) RxFree(reductions[i]);
+	free(reductions);
+	for (unsigned int i = 0; i < nTiles; i++) free(graph[i].links);
+	free(graph);
+	free(queue.entries);
 	RxMemFree(tiles);
-	free(diffBuff);
 }
 
 static inline double RxiDiffuseCurveY(double x) {
@@ -2716,6 +4387,509 @@ RxStatus RX_API RxGlbReduceImage(
 	return status;
 }
 
+static void RxiReducePutPixel(RxReduction *reduction, COLOR32 *img, int *indices, unsigned int width, unsigned int height, unsigned int x, unsigned int y, RxFlag flag, unsigned int matched) {
+	//put pixel
+	if (!(flag & RX_FLAG_NO_WRITEBACK)) {
+		int touchAlpha = (flag & RX_FLAG_NO_PRESERVE_ALPHA);
+		unsigned int nPxSrc = width * height;
+
+		for (unsigned int i = 0; i < reduction->paletteLayers; i++) {
+			COLOR32 chosen = RxPaletteGetColor(reduction, i, matched);
+
+			COLOR32 *imgI = img + i * nPxSrc;
+			if (touchAlpha) imgI[x + y * width] = chosen;
+			else imgI[x + y * width] = (chosen & 0x00FFFFFF) | (imgI[x + y * width] & 0xFF000000);
+		}
+	}
+
+	//put palette index
+	if (indices != NULL) indices[x + y * width] = matched;
+}
+
+static void RxiReduceConvertRow(RxReduction *reduction, const COLOR32 *img, unsigned int width, unsigned int height, unsigned int y, RxYiqColor *row) {
+	//convert a row to YIQ, with the edge pixels duplicated into the padding on either side.
+	unsigned int nLayers = reduction->paletteLayers;
+	for (unsigned int i = 0; i < nLayers; i++) {
+		const COLOR32 *rgbRow = img + i * width * height + y * width;
+
+		RxiConvertRgbToYiqBatch(rgbRow, &row[nLayers * 1 + i], nLayers, width);
+	}
+	RxiColorVecCopy(&row[nLayers * (0)], &row[nLayers * 1], nLayers);
+	RxiColorVecCopy(&row[nLayers * (width + 1)], &row[nLayers * width], nLayers);
+}
+
+static void RxiDitherSample(RxReduction *reduction, const RxYiqColor *thisRow, const RxYiqColor *lastRow, unsigned int x, RxFlag flag, RxYiqColor *colorYiq) {
+	unsigned int nLayers = reduction->paletteLayers;
+	int adaptive = !(flag & RX_FLAG_NO_ADAPTIVE_DIFFUSE);
+
+	//take a sample of pixels nearby. This will be a gauge of variance around this pixel, and help
+	//determine if dithering should happen. Weight the sampled pixels with respect to distance from center.
+
+	if (adaptive) {
+		for (unsigned int i = 0; i < nLayers; i++) {
+#ifndef RX_SIMD
+			colorYiq[i].y = (thisRow[nLayers * (x + 1) + i].y + thisRow[nLayers * (x + 2) + i].y + thisRow[nLayers * x + i].y + lastRow[nLayers * (x + 1) + i].y)
+				* 0.1875f + (lastRow[nLayers * (x + 0) + i].y + lastRow[nLayers * (x + 2) + i].y) * 0.125f;
+			colorYiq[i].i = (thisRow[nLayers * (x + 1) + i].i + thisRow[nLayers * (x + 2) + i].i + thisRow[nLayers * x + i].i + lastRow[nLayers * (x + 1) + i].i)
+				* 0.1875f + (lastRow[nLayers * (x + 0) + i].i + lastRow[nLayers * (x + 2) + i].i) * 0.125f;
+			colorYiq[i].q = (thisRow[nLayers * (x + 1) + i].q + thisRow[nLayers * (x + 2) + i].q + thisRow[nLayers * x + i].q + lastRow[nLayers * (x + 1) + i].q)
+				* 0.1875f + (lastRow[nLayers * (x + 0) + i].q + lastRow[nLayers * (x + 2) + i].q) * 0.125f;
+			colorYiq[i].a = (thisRow[nLayers * (x + 1) + i].a + thisRow[nLayers * (x + 2) + i].a + thisRow[nLayers * x + i].a + lastRow[nLayers * (x + 1) + i].a)
+				* 0.1875f + (lastRow[nLayers * (x + 0) + i].a + lastRow[nLayers * (x + 2) + i].a) * 0.125f;
+#else
+			__m128 vec1 = _mm_add_ps(_mm_add_ps(thisRow[nLayers * (x + 1) + i].yiq, thisRow[nLayers * (x + 2) + i].yiq),
+				_mm_add_ps(thisRow[nLayers * x + i].yiq, lastRow[nLayers * (x + 1) + i].yiq));
+			__m128 vec2 = _mm_add_ps(lastRow[nLayers * x + i].yiq, lastRow[nLayers * (x + 2) + i].yiq);
+
+			colorYiq[i].yiq = _mm_add_ps(_mm_mul_ps(vec1, _mm_set1_ps(0.1875f)), _mm_mul_ps(vec2, _mm_set1_ps(0.125f)));
+#endif
+		}
+	} else {
+		//no adaptive diffuse -> no local noise checking
+		RxiColorVecCopy(colorYiq, &thisRow[nLayers * (x + 1)], nLayers);
+	}
+}
+
+static int RxiDitherTest(RxReduction *reduction, const RxYiqColor *centerYiq, const RxYiqColor *colorYiq, RxYiqColor *scratch) {
+	//match it to a palette color. We'll measure distance to it as well.
+	double paletteDistance = 0.0;
+	(void) RxiPaletteFindClosestColorYiq(reduction, colorYiq, scratch, &paletteDistance);
+
+	//now measure distance from the actual color to its average surroundings
+	double centerDistance = RxiComputeLayeredColorDifference(reduction, centerYiq, colorYiq) / reduction->paletteLayers;
+
+	//now test: Should we dither?
+	double yw2 = reduction->yWeight2;
+	return centerDistance < 110.0 * yw2 && paletteDistance > 2.0 * yw2;
+}
+
+static unsigned int RxiDitherPixel(
+	RxReduction      *reduction,
+	const RxYiqColor *thisRow,
+	const RxYiqColor *lastRow,
+	RxYiqColor       *thisDiffuse,
+	RxYiqColor       *nextDiffuse,
+	unsigned int      x,
+	int               hDirection,
+	RxFlag            flag,
+	float             diffuse,
+	RxYiqColor       *scratch,
+	int               tested      // the pixel is already known to be dithered
+) {
+	unsigned int nLayers = reduction->paletteLayers;
+	int adaptive = !(flag & RX_FLAG_NO_ADAPTIVE_DIFFUSE);
+
+	RxYiqColor colorYiq[RX_PALETTE_MAX_COUNT];
+	RxiDitherSample(reduction, thisRow, lastRow, x, flag, colorYiq);
+
+	const RxYiqColor *centerYiq = &thisRow[nLayers * (x + 1)];
+	unsigned int matched;
+	if (tested || !adaptive || RxiDitherTest(reduction, centerYiq, colorYiq, scratch)) {
+		RxYiqColor diffuseVec[RX_PALETTE_MAX_COUNT];
+		RxiColorVecCopy(diffuseVec, &thisDiffuse[nLayers * (x + 1)], nLayers);
+
+		for (unsigned int i = 0; i < nLayers; i++) {
+			RxiColorScale(&diffuseVec[i], diffuse);
+
+			//in adaptive diffusion mode, we apply a tapering curve to the diffusion amount. This has the effect
+			//of reducing extreme noise that may result from dithering. The curves limit both the immediate
+			//intensity of diffusion, as well as the distance the diffusion travels. In cases where this would
+			//appear, it's usually unsightly anyways. Adaptive diffusion does not work well when the palette is not
+			//well-fit to the image data however, and color reduction error tends to be larger.
+			if (adaptive) {
+				diffuseVec[i].y = (float) RxiDiffuseCurveY(diffuseVec[i].y);
+				diffuseVec[i].i = (float) RxiDiffuseCurveI(diffuseVec[i].i);
+				diffuseVec[i].q = (float) RxiDiffuseCurveQ(diffuseVec[i].q);
+				diffuseVec[i].a = (float) RxiDiffuseCurveA(diffuseVec[i].a);
+			}
+
+			if (flag & RX_FLAG_NO_ALPHA_DITHER) {
+				//diffuse into the current color. We must unmultiply and remultiply by alpha. Doing this scales the
+				//error diffused by the alpha value of the source pixel (i.e. more transparent pixels diffuse less
+				//error to their neighbors), and the alpha diffusion is canceled.
+				if (colorYiq[i].a != 0.0f) {
+					float aFactor = 1.0f + diffuseVec[i].a / colorYiq[i].a;
+					colorYiq[i].y *= aFactor;
+					colorYiq[i].i *= aFactor;
+					colorYiq[i].q *= aFactor;
+				}
+
+				RxiColorScale(&diffuseVec[i], colorYiq[i].a + diffuseVec[i].a);
+				diffuseVec[i].a = 0.0f;
+			} else {
+				//alpha dithering is enabled, so we diffuse directly without adjustment.
+			}
+
+			//apply the diffusion
+#ifndef RX_SIMD
+			colorYiq[i].y += diffuseVec[i].y;
+			colorYiq[i].i += diffuseVec[i].i;
+			colorYiq[i].q += diffuseVec[i].q;
+			colorYiq[i].a += diffuseVec[i].a;
+#else
+			colorYiq[i].yiq = _mm_add_ps(colorYiq[i].yiq, diffuseVec[i].yiq);
+#endif
+
+			if (colorYiq[i].a < 0.0f) {
+				//normalize to alpha=0
+				RxiColorMakeTransparent(&colorYiq[i]);
+			} else {
+				//clamp Y channel
+				if (colorYiq[i].y < 0.0f) {
+					RxiColorMakeBlack(&colorYiq[i]);
+				} else if (colorYiq[i].y > 511.0f * colorYiq[i].a) {
+					RxiColorMakeWhite(&colorYiq[i]);
+				}
+
+				if (colorYiq[i].a > 1.0f) {
+					//normalize to alpha=1
+					RxiColorMakeOpaque(&colorYiq[i]);
+				}
+			}
+		}
+
+		//match to palette color
+		matched = RxiPaletteFindClosestColorYiq(reduction, colorYiq, scratch, NULL);
+		RxYiqColor *chosenYiq = &reduction->accel.plttLarge[matched * nLayers];
+
+		//now diffuse to neighbors (mirrored with the scan direction):
+		//        X  7/16
+		// 3/16 5/16 1/16
+		RxYiqColor *diffuse21 = &thisDiffuse[nLayers * (x + 1 + hDirection)];
+		RxYiqColor *diffuse12 = &nextDiffuse[nLayers * (x + 1)];
+		RxYiqColor *diffuse22 = &nextDiffuse[nLayers * (x + 1 + hDirection)];
+		RxYiqColor *diffuse02 = &nextDiffuse[nLayers * (x + 1 - hDirection)];
+
+		for (unsigned int i = 0; i < nLayers; i++) {
+			RxYiqColor off;
+
+			if (flag & RX_FLAG_NO_ALPHA_DITHER) {
+				//alpha is not dithered, so we un-premultiply the colors and scale to palette alpha.
+				if (colorYiq[i].a > 0.0f) {
+					float chosenA = chosenYiq[i].a;
+					off.y = colorYiq[i].y * chosenA / colorYiq[i].a - chosenYiq[i].y;
+					off.i = colorYiq[i].i * chosenA / colorYiq[i].a - chosenYiq[i].i;
+					off.q = colorYiq[i].q * chosenA / colorYiq[i].a - chosenYiq[i].q;
+					off.a = 0.0f;
+				} else {
+					//zero alpha, no color information to dither.
+					RxiColorMakeTransparent(&off);
+				}
+			} else {
+				//alpha is dithered, so we take the straight preultiplied difference to diffuse
+				//signal intensity.
+				RxiColorSubtract(&off, &colorYiq[i], &chosenYiq[i]);
+			}
+
+#ifndef RX_SIMD
+			diffuse21[i].y += off.y * 0.4375f; // 7/16
+			diffuse21[i].i += off.i * 0.4375f;
+			diffuse21[i].q += off.q * 0.4375f;
+			diffuse21[i].a += off.a * 0.4375f;
+			diffuse12[i].y += off.y * 0.3125f; // 5/16
+			diffuse12[i].i += off.i * 0.3125f;
+			diffuse12[i].q += off.q * 0.3125f;
+			diffuse12[i].a += off.a * 0.3125f;
+			diffuse02[i].y += off.y * 0.1875f; // 3/16
+			diffuse02[i].i += off.i * 0.1875f;
+			diffuse02[i].q += off.q * 0.1875f;
+			diffuse02[i].a += off.a * 0.1875f;
+			diffuse22[i].y += off.y * 0.0625f; // 1/16
+			diffuse22[i].i += off.i * 0.0625f;
+			diffuse22[i].q += off.q * 0.0625f;
+			diffuse22[i].a += off.a * 0.0625f;
+#else
+			diffuse21[i].yiq = _mm_add_ps(diffuse21[i].yiq, _mm_mul_ps(off.yiq, _mm_set1_ps(0.4375f))); // 7/16
+			diffuse12[i].yiq = _mm_add_ps(diffuse12[i].yiq, _mm_mul_ps(off.yiq, _mm_set1_ps(0.3125f))); // 5/16
+			diffuse02[i].yiq = _mm_add_ps(diffuse02[i].yiq, _mm_mul_ps(off.yiq, _mm_set1_ps(0.1875f))); // 3/16
+			diffuse22[i].yiq = _mm_add_ps(diffuse22[i].yiq, _mm_mul_ps(off.yiq, _mm_set1_ps(0.0625f))); // 1/16
+#endif
+		}
+	} else {
+		//high noise area, do not diffuse
+		matched = RxiPaletteFindClosestColorYiq(reduction, centerYiq, scratch, NULL);
+	}
+	return matched;
+}
+
+//threshold matrices for ordered dithering, as ranks from 0 to n-1 for n cells
+static const unsigned char sBayer4x4[4 * 4] = {
+	 0,  8,  2, 10,
+	12,  4, 14,  6,
+	 3, 11,  1,  9,
+	15,  7, 13,  5,
+};
+
+static const unsigned char sBayer8x8[8 * 8] = {
+	 0, 32,  8, 40,  2, 34, 10, 42,
+	48, 16, 56, 24, 50, 18, 58, 26,
+	12, 44,  4, 36, 14, 46,  6, 38,
+	60, 28, 52, 20, 62, 30, 54, 22,
+	 3, 35, 11, 43,  1, 33,  9, 41,
+	51, 19, 59, 27, 49, 17, 57, 25,
+	15, 47,  7, 39, 13, 45,  5, 37,
+	63, 31, 55, 23, 61, 29, 53, 21,
+};
+
+//blue noise tile, generated by the void-and-cluster method (Gaussian sigma 1.5)
+static const unsigned char sBlueNoise16x16[16 * 16] = {
+	234,  50, 188,  19,  58, 171, 121,  47, 163,   1, 247, 104,  22, 132,  14,  65,
+	209,   8, 118,  97, 240, 205,  23, 228, 138,  64, 123, 170,  72, 224,  99, 149,
+	 85, 139, 229, 165,  78, 146, 111,  84, 176, 216,  30, 231, 153, 201,  42, 180,
+	 25,  62, 195,  29,  43, 185,   7, 249,  41, 100, 191,  48,  87,   5, 128, 243,
+	221, 152, 101, 253, 130, 220,  59, 200, 156,  12, 136, 112, 255, 174,  69, 109,
+	 46, 189,   0,  73, 172,  90, 142, 116,  80, 237, 210,  61, 147,  33, 206, 160,
+	 81, 124, 217, 113, 208,  15, 241,  27, 168,  45, 178,  20, 193,  96, 225,  18,
+	242, 164,  60,  35, 157,  53, 181,  68, 223, 105, 125,  83, 236, 131,  55, 141,
+	197,  10, 227, 134, 246,  95, 126, 198, 148,   3, 244, 161,  71,   9, 182, 106,
+	 40,  93, 179,  75, 192,   6, 218,  36,  91,  57, 202,  34, 215, 155, 233,  74,
+	252, 120, 150,  24, 110,  63, 166, 119, 232, 183, 133, 103,  49, 117,  31, 167,
+	 16, 212,  51, 238, 207, 137, 254,  21,  76, 151,  13, 250, 190,  88, 203, 135,
+	102, 184,  82, 169,  38,  89, 187,  52, 204,  98, 173,  67, 129,   4, 222,  56,
+	230, 144,   2, 127, 226,  11, 154, 114, 239,  39, 219,  28, 235, 145, 175,  77,
+	196,  37, 248,  70, 107, 199,  66, 177,  17, 143, 115, 159,  86,  44, 108,  26,
+	122,  92, 158, 214, 140,  32, 245,  94, 213,  79, 194,  54, 211, 186, 251, 162,
+};
+
+//workspace of RxReduceImage for pixels indexed independently: without dithering, or with ordered dithering
+typedef struct RxiReduceWork_ {
+	RxReduction *reduction;
+	COLOR32 *img;
+	int *indices;
+	unsigned int width;
+	unsigned int height;
+	RxFlag flag;
+	unsigned int firstBand;       // index of the first band of the current round
+	RxYiqColor *rowbufs;          // one row of YIQ colors per worker
+	unsigned int matrixBits;      // ordered dithering: log2 of the matrix size, or 0 when not dithering
+	float offsets[16 * 16];       // ordered dithering: lightness offset of each matrix cell
+} RxiReduceWork;
+
+static float RxiOrderedDitherSpread(RxReduction *reduction) {
+	//the dither pattern spans about the spacing of the palette colors, so that colors between two neighbors
+	//are mixed from both. This is taken as twice the mean distance from a palette color to its nearest
+	//neighbor, which at full strength dithers about as strongly as error diffusion. For large palettes, the
+	//spacing is estimated from the palette size, as though the colors were evenly spaced.
+	const RxPaletteAccelerator *accel = &reduction->accel;
+	unsigned int nLayers = reduction->paletteLayers;
+	unsigned int iStart = (accel->alphaMode == RX_ALPHA_RESERVE) ? 1 : 0;
+	if (accel->nPltt <= iStart + 1) return 0.0f;
+
+	unsigned int nColors = accel->nPltt - iStart;
+	if (nColors > RX_DITHER_SPREAD_MAX_COLORS) return 511.0f / cbrtf((float) nColors);
+
+	double total = 0.0;
+	unsigned int nTotal = 0;
+	for (unsigned int i = iStart; i < accel->nPltt; i++) {
+		const RxYiqColor *col1 = &accel->plttLarge[i * nLayers];
+
+		double best = 1e32;
+		for (unsigned int j = iStart; j < accel->nPltt; j++) {
+			double diff = RxiComputeLayeredColorDifference(reduction, col1, &accel->plttLarge[j * nLayers]);
+			if (diff > 0.0 && diff < best) best = diff;
+		}
+
+		//skip colors without a distinct neighbor
+		if (best == 1e32) continue;
+
+		//convert the weighted squared distance to units of Y.
+		total += sqrt(best / nLayers / reduction->yWeight2);
+		nTotal++;
+	}
+	return nTotal ? (float) (2.0 * total / nTotal) : 0.0f;
+}
+
+static void RxiOrderedDitherSetup(RxReduction *reduction, RxiReduceWork *work, float diffuse) {
+	const unsigned char *ranks = NULL;
+	switch (reduction->ditherMode) {
+		case RX_DITHER_BAYER4:     ranks = sBayer4x4;       work->matrixBits = 2; break;
+		case RX_DITHER_BAYER8:     ranks = sBayer8x8;       work->matrixBits = 3; break;
+		case RX_DITHER_BLUE_NOISE: ranks = sBlueNoise16x16; work->matrixBits = 4; break;
+		default: return;
+	}
+
+	//center the thresholds on 0, so that on average the colors are not shifted.
+	unsigned int nCells = 1 << (2 * work->matrixBits);
+	float amplitude = RxiOrderedDitherSpread(reduction) * diffuse;
+	for (unsigned int i = 0; i < nCells; i++) {
+		work->offsets[i] = (((float) ranks[i] + 0.5f) / (float) nCells - 0.5f) * amplitude;
+	}
+}
+
+static unsigned int RxiReduceOrderedPixel(RxiReduceWork *work, const RxYiqColor *color, unsigned int x, unsigned int y, RxYiqColor *scratch) {
+	RxReduction *reduction = work->reduction;
+	unsigned int nLayers = reduction->paletteLayers, bits = work->matrixBits, mask = (1 << bits) - 1;
+
+	x = (x + reduction->ditherOriginX) & mask;
+	y = (y + reduction->ditherOriginY) & mask;
+	float offset = work->offsets[x + (y << bits)];
+
+	//shift the lightness (scaled by alpha) by the threshold. Alpha is not dithered.
+	RxYiqColor dithered[RX_PALETTE_MAX_COUNT];
+	for (unsigned int i = 0; i < nLayers; i++) {
+		dithered[i] = color[i];
+		dithered[i].y += offset * dithered[i].a;
+		if (dithered[i].y < 0.0f) dithered[i].y = 0.0f;
+		else if (dithered[i].y > 511.0f * dithered[i].a) dithered[i].y = 511.0f * dithered[i].a;
+	}
+	return RxiPaletteFindClosestColorYiq(reduction, dithered, scratch, NULL);
+}
+
+static void RxiReduceBand(void *param, unsigned int index, unsigned int worker) {
+	RxiReduceWork *work = (RxiReduceWork *) param;
+	RxReduction *reduction = work->reduction;
+	unsigned int nLayers = reduction->paletteLayers, width = work->width, nPxSrc = width * work->height;
+
+	unsigned int yStart = (work->firstBand + index) * RX_REDUCE_BAND_ROWS, yEnd = yStart + RX_REDUCE_BAND_ROWS;
+	if (yEnd > work->height) yEnd = work->height;
+
+	RxYiqColor *row = &work->rowbufs[worker * width * nLayers];
+	RxIndexCache *cache = RxiGetIndexCache(reduction, worker);
+	RxYiqColor scratch[RX_PALETTE_MAX_COUNT];
+
+	for (unsigned int y = yStart; y < yEnd; y++) {
+		for (unsigned int i = 0; i < nLayers; i++) {
+			RxiConvertRgbToYiqBatch(work->img + i * nPxSrc + y * width, &row[i], nLayers, width);
+		}
+
+		for (unsigned int x = 0; x < width; x++) {
+			unsigned int matched;
+			if (work->matrixBits) {
+				matched = RxiReduceOrderedPixel(work, &row[x * nLayers], x, y, scratch);
+			} else {
+				matched = RxiPaletteFindClosestColorCached(reduction, cache, work->img[x + y * width], &row[x * nLayers], scratch);
+			}
+			RxiReducePutPixel(reduction, work->img, work->indices, width, work->height, x, y, work->flag, matched);
+		}
+	}
+}
+
+static RxStatus RxiReduceImageIndependent(RxReduction *reduction, COLOR32 *img, int *indices, unsigned int width, unsigned int height, RxFlag flag, float diffuse) {
+	//rows do not depend on each other, so the image is indexed in bands of rows in parallel.
+	unsigned int nBands = (height + RX_REDUCE_BAND_ROWS - 1) / RX_REDUCE_BAND_ROWS;
+	unsigned int nWorkers = (nBands > 1) ? TpGetThreadCount() : 1;
+
+	//a row buffer per worker
+	unsigned int rowbufSize = nWorkers * width * reduction->paletteLayers;
+	RxYiqColor *rowbufs = reduction->imgBuffer;
+	if (rowbufSize > RX_TEMP_IMG_BUF_SIZE) {
+		rowbufs = (RxYiqColor *) RxMemAlloc(rowbufSize * sizeof(RxYiqColor));
+		if (rowbufs == NULL) return RX_STATUS_NOMEM;
+	}
+
+	RxiReduceWork work = { 0 };
+	work.reduction = reduction;
+	work.img = img;
+	work.indices = indices;
+	work.width = width;
+	work.height = height;
+	work.flag = flag;
+	work.rowbufs = rowbufs;
+	if (diffuse > 0.0f) RxiOrderedDitherSetup(reduction, &work, diffuse);
+
+	//without dithering, the matches are cached. Without a cache, every pixel is searched.
+	if (!work.matrixBits) (void) RxiIndexCacheReserve(reduction);
+
+	if (nBands == 1) {
+		RxiReduceBand(&work, 0, 0);
+	} else {
+		//bands are run in rounds, so that progress can be reported from this thread.
+		unsigned int nBandsRound = 2 * nWorkers;
+		for (work.firstBand = 0; work.firstBand < nBands; work.firstBand += nBandsRound) {
+			unsigned int nRound = nBands - work.firstBand;
+			if (nRound > nBandsRound) nRound = nBandsRound;
+
+			TpParallelFor(nRound, RxiReduceBand, &work);
+
+			unsigned int yEnd = (work.firstBand + nRound) * RX_REDUCE_BAND_ROWS;
+			RxiUpdateProgress(reduction, (yEnd < height) ? yEnd : height, height);
+		}
+	}
+	RxiUpdateProgress(reduction, height, height);
+
+	if (rowbufs != reduction->imgBuffer) RxMemFree(rowbufs);
+	return RX_STATUS_OK;
+}
+
+//workspace of RxReduceImage for classifying pixels before dithering
+typedef struct RxiDitherWork_ {
+	RxReduction *reduction;
+	COLOR32 *img;
+	int *classes;                 // per pixel: the matched index, or -1 if the pixel is dithered
+	unsigned int width;
+	unsigned int height;
+	RxFlag flag;
+	RxYiqColor *rowbufs;          // current and previous row of YIQ colors per worker
+} RxiDitherWork;
+
+static void RxiDitherClassifyBand(void *param, unsigned int index, unsigned int worker) {
+	RxiDitherWork *work = (RxiDitherWork *) param;
+	RxReduction *reduction = work->reduction;
+	unsigned int nLayers = reduction->paletteLayers, width = work->width, height = work->height;
+	unsigned int rowSize = (width + 2) * nLayers;
+
+	unsigned int yStart = index * RX_REDUCE_BAND_ROWS, yEnd = yStart + RX_REDUCE_BAND_ROWS;
+	if (yEnd > height) yEnd = height;
+
+	RxYiqColor *thisRow = &work->rowbufs[2 * worker * rowSize];
+	RxYiqColor *lastRow = thisRow + rowSize;
+	RxIndexCache *cache = RxiGetIndexCache(reduction, worker);
+	RxYiqColor scratch[RX_PALETTE_MAX_COUNT];
+
+	RxiReduceConvertRow(reduction, work->img, width, height, (yStart > 0) ? (yStart - 1) : 0, thisRow);
+	for (unsigned int y = yStart; y < yEnd; y++) {
+		RxYiqColor *temp = thisRow;
+		thisRow = lastRow;
+		lastRow = temp;
+		RxiReduceConvertRow(reduction, work->img, width, height, y, thisRow);
+
+		for (unsigned int x = 0; x < width; x++) {
+			//the dither decision only depends on the source image, so it may be made out of scan order.
+			RxYiqColor colorYiq[RX_PALETTE_MAX_COUNT];
+			RxiDitherSample(reduction, thisRow, lastRow, x, work->flag, colorYiq);
+
+			const RxYiqColor *centerYiq = &thisRow[nLayers * (x + 1)];
+			if (RxiDitherTest(reduction, centerYiq, colorYiq, scratch)) {
+				work->classes[x + y * width] = -1;
+			} else {
+				work->classes[x + y * width] = RxiPaletteFindClosestColorCached(reduction, cache, work->img[x + y * width], centerYiq, scratch);
+			}
+		}
+	}
+}
+
+static int *RxiDitherClassify(RxReduction *reduction, COLOR32 *img, int *indices, unsigned int width, unsigned int height, RxFlag flag) {
+	//the classes are held in the index buffer when there is one, since each is overwritten only after it is read.
+	int *classes = indices;
+	if (classes == NULL) {
+		classes = (int *) RxMemAlloc(width * height * sizeof(int));
+		if (classes == NULL) return NULL;
+	}
+
+	unsigned int nBands = (height + RX_REDUCE_BAND_ROWS - 1) / RX_REDUCE_BAND_ROWS;
+	unsigned int nWorkers = (nBands > 1) ? TpGetThreadCount() : 1;
+	RxYiqColor *rowbufs = (RxYiqColor *) RxMemAlloc(2 * nWorkers * (width + 2) * reduction->paletteLayers * sizeof(RxYiqColor));
+	if (rowbufs == NULL) {
+		if (classes != indices) RxMemFree(classes);
+		return NULL;
+	}
+
+	(void) RxiIndexCacheReserve(reduction);
+
+	RxiDitherWork work = { 0 };
+	work.reduction = reduction;
+	work.img = img;
+	work.classes = classes;
+	work.width = width;
+	work.height = height;
+	work.flag = flag;
+	work.rowbufs = rowbufs;
+	TpParallelFor(nBands, RxiDitherClassifyBand, &work);
+
+	RxMemFree(rowbufs);
+	return classes;
+}
+
 RxStatus RX_API RxReduceImage(
 	RxReduction *reduction,
 	COLOR32     *img,
@@ -2725,10 +4899,6 @@ RxStatus RX_API RxReduceImage(
 	RxFlag       flag,
 	float        diffuse
 ) {
-	//decode flags
-	int touchAlpha = (flag & RX_FLAG_NO_PRESERVE_ALPHA);
-	int adaptive = !(flag & RX_FLAG_NO_ADAPTIVE_DIFFUSE);
-
 	//initial progress
 	RxiUpdateProgress(reduction, 0, height);
 
@@ -2736,8 +4906,21 @@ RxStatus RX_API RxReduceImage(
 	//a 0-line bitmap may be trivially indexed.
 	if (height == 0) return RX_STATUS_OK;
 
+	//without dithering, every pixel is matched on its own color alone. With ordered dithering, every pixel
+	//is matched on its own color and position.
+	if (!(diffuse > 0.0f) || reduction->ditherMode != RX_DITHER_DIFFUSE) {
+		return RxiReduceImageIndependent(reduction, img, indices, width, height, flag, diffuse);
+	}
+
 	unsigned int nLayers = reduction->paletteLayers;
-	unsigned int nPxSrc = width * height;
+
+	//with adaptive diffusion, whether a pixel is dithered is decided on the source image alone. When requested,
+	//these decisions are made up front in parallel, leaving the serial scan with only the dithered pixels.
+	int *classes = NULL;
+	if ((flag & RX_FLAG_PARALLEL_DIFFUSE) && !(flag & RX_FLAG_NO_ADAPTIVE_DIFFUSE)) {
+		classes = RxiDitherClassify(reduction, img, indices, width, height, flag);
+		if (classes == NULL) return RX_STATUS_NOMEM;
+	}
 
 	//allocate the 4 row buffers
 	unsigned int linebufSize = 4 * (width + 2) * nLayers;
@@ -2749,6 +4932,7 @@ RxStatus RX_API RxReduceImage(
 		if (rowbuf == NULL) {
 			//no memory
 			RxMemFree(rowbuf);
+			if (classes != NULL && classes != indices) RxMemFree(classes);
 			return RX_STATUS_NOMEM;
 		}
 	} else {
@@ -2763,213 +4947,26 @@ RxStatus RX_API RxReduceImage(
 	RxYiqColor *nextDiffuse = thisDiffuse + (width + 2) * nLayers;  // the diffuse vector for the next scanline
 
 	//fill the previous-row buffer with the first row, to make sure we don't run out of bounds
-	for (unsigned int i = 0; i < nLayers; i++) {
-		COLOR32 *rgbRow = img + i * nPxSrc + 0 * width;
-
-		for (unsigned int x = 0; x < width; x++) {
-			RxConvertRgbToYiq(rgbRow[x], &lastRow[nLayers * (x + 1) + i]);
-		}
-	}
-	RxiColorVecCopy(&lastRow[nLayers * (0)], &lastRow[nLayers * 1], nLayers);
-	RxiColorVecCopy(&lastRow[nLayers * (width + 1)], &lastRow[nLayers * width], nLayers);
+	RxiReduceConvertRow(reduction, img, width, height, 0, lastRow);
 
 	//start dithering, do so in a serpentine path.
 	for (unsigned int y = 0; y < height; y++) {
 
 		//which direction?
 		int hDirection = (y & 1) ? -1 : 1;
-
-		for (unsigned int i = 0; i < nLayers; i++) {
-			COLOR32 *rgbRow = img + i * nPxSrc + y * width;
-
-			for (unsigned int x = 0; x < width; x++) {
-				RxConvertRgbToYiq(rgbRow[x], &thisRow[nLayers * (x + 1) + i]);
-			}
-		}
-		RxiColorVecCopy(&thisRow[nLayers * (0)], &thisRow[nLayers * 1], nLayers);
-		RxiColorVecCopy(&thisRow[nLayers * (width + 1)], &thisRow[nLayers * width], nLayers);
+		RxiReduceConvertRow(reduction, img, width, height, y, thisRow);
 
 		//scan across
 		unsigned int startPos = (hDirection == 1) ? 0 : (width - 1);
 		unsigned int x = startPos;
 		for (unsigned int xPx = 0; xPx < width; xPx++) {
-			//take a sample of pixels nearby. This will be a gauge of variance around this pixel, and help
-			//determine if dithering should happen. Weight the sampled pixels with respect to distance from center.
-
-			RxYiqColor colorYiq[RX_PALETTE_MAX_COUNT];
-			if (adaptive) {
-				for (unsigned int i = 0; i < nLayers; i++) {
-#ifndef RX_SIMD
-					colorYiq[i].y = (thisRow[nLayers * (x + 1) + i].y + thisRow[nLayers * (x + 2) + i].y + thisRow[nLayers * x + i].y + lastRow[nLayers * (x + 1) + i].y)
-						* 0.1875f + (lastRow[nLayers * (x + 0) + i].y + lastRow[nLayers * (x + 2) + i].y) * 0.125f;
-					colorYiq[i].i = (thisRow[nLayers * (x + 1) + i].i + thisRow[nLayers * (x + 2) + i].i + thisRow[nLayers * x + i].i + lastRow[nLayers * (x + 1) + i].i)
-						* 0.1875f + (lastRow[nLayers * (x + 0) + i].i + lastRow[nLayers * (x + 2) + i].i) * 0.125f;
-					colorYiq[i].q = (thisRow[nLayers * (x + 1) + i].q + thisRow[nLayers * (x + 2) + i].q + thisRow[nLayers * x + i].q + lastRow[nLayers * (x + 1) + i].q)
-						* 0.1875f + (lastRow[nLayers * (x + 0) + i].q + lastRow[nLayers * (x + 2) + i].q) * 0.125f;
-					colorYiq[i].a = (thisRow[nLayers * (x + 1) + i].a + thisRow[nLayers * (x + 2) + i].a + thisRow[nLayers * x + i].a + lastRow[nLayers * (x + 1) + i].a)
-						* 0.1875f + (lastRow[nLayers * (x + 0) + i].a + lastRow[nLayers * (x + 2) + i].a) * 0.125f;
-#else
-					__m128 vec1 = _mm_add_ps(_mm_add_ps(thisRow[nLayers * (x + 1) + i].yiq, thisRow[nLayers * (x + 2) + i].yiq),
-						_mm_add_ps(thisRow[nLayers * x + i].yiq, lastRow[nLayers * (x + 1) + i].yiq));
-					__m128 vec2 = _mm_add_ps(lastRow[nLayers * x + i].yiq, lastRow[nLayers * (x + 2) + i].yiq);
-
-					colorYiq[i].yiq = _mm_add_ps(_mm_mul_ps(vec1, _mm_set1_ps(0.1875f)), _mm_mul_ps(vec2, _mm_set1_ps(0.125f)));
-#endif
-				}
-			} else {
-				//no adaptive diffuse -> no local noise checking
-				RxiColorVecCopy(colorYiq, &thisRow[nLayers * (x + 1)], nLayers);
-			}
-
-			//match it to a palette color. We'll measure distance to it as well.
-			double paletteDistance = 0.0;
-			unsigned int matched = RxPaletteFindClosestColorYiq(reduction, colorYiq, &paletteDistance);
-
-			//now measure distance from the actual color to its average surroundings
-			RxYiqColor *centerYiq = &thisRow[nLayers * (x + 1)];
-			double centerDistance = RxiComputeLayeredColorDifference(reduction, centerYiq, colorYiq) / nLayers;
-
-			//now test: Should we dither?
-			double yw2 = reduction->yWeight2;
-			if (diffuse > 0.0f && (!adaptive || (centerDistance < 110.0 * yw2 && paletteDistance >  2.0 * yw2))) {
-				RxYiqColor diffuseVec[RX_PALETTE_MAX_COUNT];
-				RxiColorVecCopy(diffuseVec, &thisDiffuse[nLayers * (x + 1)], nLayers);
-
-				for (unsigned int i = 0; i < nLayers; i++) {
-					RxiColorScale(&diffuseVec[i], diffuse);
-
-					//in adaptive diffusion mode, we apply a tapering curve to the diffusion amount. This has the effect
-					//of reducing extreme noise that may result from dithering. The curves limit both the immediate
-					//intensity of diffusion, as well as the distance the diffusion travels. In cases where this would
-					//appear, it's usually unsightly anyways. Adaptive diffusion does not work well when the palette is not
-					//well-fit to the image data however, and color reduction error tends to be larger.
-					if (adaptive) {
-						diffuseVec[i].y = (float) RxiDiffuseCurveY(diffuseVec[i].y);
-						diffuseVec[i].i = (float) RxiDiffuseCurveI(diffuseVec[i].i);
-						diffuseVec[i].q = (float) RxiDiffuseCurveQ(diffuseVec[i].q);
-						diffuseVec[i].a = (float) RxiDiffuseCurveA(diffuseVec[i].a);
-					}
-
-					if (flag & RX_FLAG_NO_ALPHA_DITHER) {
-						//diffuse into the current color. We must unmultiply and remultiply by alpha. Doing this scales the
-						//error diffused by the alpha value of the source pixel (i.e. more transparent pixels diffuse less
-						//error to their neighbors), and the alpha diffusion is canceled.
-						if (colorYiq[i].a != 0.0f) {
-							float aFactor = 1.0f + diffuseVec[i].a / colorYiq[i].a;
-							colorYiq[i].y *= aFactor;
-							colorYiq[i].i *= aFactor;
-							colorYiq[i].q *= aFactor;
-						}
-
-						RxiColorScale(&diffuseVec[i], colorYiq[i].a + diffuseVec[i].a);
-						diffuseVec[i].a = 0.0f;
-					} else {
-						//alpha dithering is enabled, so we diffuse directly without adjustment.
-					}
-
-					//apply the diffusion
-#ifndef RX_SIMD
-					colorYiq[i].y += diffuseVec[i].y;
-					colorYiq[i].i += diffuseVec[i].i;
-					colorYiq[i].q += diffuseVec[i].q;
-					colorYiq[i].a += diffuseVec[i].a;
-#else
-					colorYiq[i].yiq = _mm_add_ps(colorYiq[i].yiq, diffuseVec[i].yiq);
-#endif
-
-					if (colorYiq[i].a < 0.0f) {
-						//normalize to alpha=0
-						RxiColorMakeTransparent(&colorYiq[i]);
-					} else {
-						//clamp Y channel
-						if (colorYiq[i].y < 0.0f) {
-							RxiColorMakeBlack(&colorYiq[i]);
-						} else if (colorYiq[i].y > 511.0f * colorYiq[i].a) {
-							RxiColorMakeWhite(&colorYiq[i]);
-						}
-
-						if (colorYiq[i].a > 1.0f) {
-							//normalize to alpha=1
-							RxiColorMakeOpaque(&colorYiq[i]);
-						}
-					}
-				}
-
-				//match to palette color
-				matched = RxPaletteFindClosestColorYiq(reduction, colorYiq, NULL);
-				RxYiqColor *chosenYiq = &reduction->accel.plttLarge[matched * nLayers];
-
-				//now diffuse to neighbors (mirrored with the scan direction):
-				//        X  7/16
-				// 3/16 5/16 1/16
-				RxYiqColor *diffuse21 = &thisDiffuse[nLayers * (x + 1 + hDirection)];
-				RxYiqColor *diffuse12 = &nextDiffuse[nLayers * (x + 1)];
-				RxYiqColor *diffuse22 = &nextDiffuse[nLayers * (x + 1 + hDirection)];
-				RxYiqColor *diffuse02 = &nextDiffuse[nLayers * (x + 1 - hDirection)];
-
-				for (unsigned int i = 0; i < nLayers; i++) {
-					RxYiqColor off;
-
-					if (flag & RX_FLAG_NO_ALPHA_DITHER) {
-						//alpha is not dithered, so we un-premultiply the colors and scale to palette alpha.
-						if (colorYiq[i].a > 0.0f) {
-							float chosenA = chosenYiq[i].a;
-							off.y = colorYiq[i].y * chosenA / colorYiq[i].a - chosenYiq[i].y;
-							off.i = colorYiq[i].i * chosenA / colorYiq[i].a - chosenYiq[i].i;
-							off.q = colorYiq[i].q * chosenA / colorYiq[i].a - chosenYiq[i].q;
-							off.a = 0.0f;
-						} else {
-							//zero alpha, no color information to dither.
-							RxiColorMakeTransparent(&off);
-						}
-					} else {
-						//alpha is dithered, so we take the straight preultiplied difference to diffuse
-						//signal intensity.
-						RxiColorSubtract(&off, &colorYiq[i], &chosenYiq[i]);
-					}
-
-#ifndef RX_SIMD
-					diffuse21[i].y += off.y * 0.4375f; // 7/16
-					diffuse21[i].i += off.i * 0.4375f;
-					diffuse21[i].q += off.q * 0.4375f;
-					diffuse21[i].a += off.a * 0.4375f;
-					diffuse12[i].y += off.y * 0.3125f; // 5/16
-					diffuse12[i].i += off.i * 0.3125f;
-					diffuse12[i].q += off.q * 0.3125f;
-					diffuse12[i].a += off.a * 0.3125f;
-					diffuse02[i].y += off.y * 0.1875f; // 3/16
-					diffuse02[i].i += off.i * 0.1875f;
-					diffuse02[i].q += off.q * 0.1875f;
-					diffuse02[i].a += off.a * 0.1875f;
-					diffuse22[i].y += off.y * 0.0625f; // 1/16
-					diffuse22[i].i += off.i * 0.0625f;
-					diffuse22[i].q += off.q * 0.0625f;
-					diffuse22[i].a += off.a * 0.0625f;
-#else
-					diffuse21[i].yiq = _mm_add_ps(diffuse21[i].yiq, _mm_mul_ps(off.yiq, _mm_set1_ps(0.4375f))); // 7/16
-					diffuse12[i].yiq = _mm_add_ps(diffuse12[i].yiq, _mm_mul_ps(off.yiq, _mm_set1_ps(0.3125f))); // 5/16
-					diffuse02[i].yiq = _mm_add_ps(diffuse02[i].yiq, _mm_mul_ps(off.yiq, _mm_set1_ps(0.1875f))); // 3/16
-					diffuse22[i].yiq = _mm_add_ps(diffuse22[i].yiq, _mm_mul_ps(off.yiq, _mm_set1_ps(0.0625f))); // 1/16
-#endif
-				}
+			unsigned int matched;
+			if (classes != NULL && classes[x + y * width] >= 0) {
+				matched = classes[x + y * width];
 			} else {
-				//high noise area or dithering disabled, do not diffuse
-				matched = RxPaletteFindClosestColorYiq(reduction, centerYiq, NULL);
-			}
-
-			//put pixel
-			if (!(flag & RX_FLAG_NO_WRITEBACK)) {
-				for (unsigned int i = 0; i < nLayers; i++) {
-					COLOR32 chosen = RxPaletteGetColor(reduction, i, matched);
-
-					COLOR32 *imgI = img + i * nPxSrc;
-					if (touchAlpha) imgI[x + y * width] = chosen;
-					else imgI[x + y * width] = (chosen & 0x00FFFFFF) | (imgI[x + y * width] & 0xFF000000);
-				}
+				matched = RxiDitherPixel(reduction, thisRow, lastRow, thisDiffuse, nextDiffuse, x, hDirection, flag, diffuse, reduction->tempLayeredColor, classes != NULL);
 			}
-
-			//put palette index
-			if (indices != NULL) indices[x + y * width] = matched;
+			RxiReducePutPixel(reduction, img, indices, width, height, x, y, flag, matched);
 
 			x += hDirection;
 		}
@@ -2986,6 +4983,7 @@ RxStatus RX_API RxReduceImage(
 	}
 
 	if (rowbuf != reduction->imgBuffer) RxMemFree(rowbuf);
+	if (classes != NULL && classes != indices) RxMemFree(classes);
 	return RX_STATUS_OK;
 }
 
@@ -3201,13 +5199,71 @@ static unsigned int RxiPaletteFindClosestColorAccelerated(RxReduction *reduction
 	return iBest;
 }
 
+#ifdef RX_SIMD
+RX_TARGET_AVX2 static unsigned int RxiPaletteFindClosestColorAvx2(RxReduction *reduction, const RxYiqColor *color, double *outDiff) {
+	RxPaletteAccelerator *accel = &reduction->accel;
+
+	//the difference is computed with the same operations as RxiComputeColorDifference, for 8 palette colors
+	//at a time, so the differences are bit-identical to those of the linear search.
+	float weight[4], inter[4];
+	_mm_storeu_ps(weight, reduction->yiqaWeight2);
+	_mm_storeu_ps(inter, reduction->interactionYIQA);
+
+	__m256 cy = _mm256_set1_ps(color->y), wy = _mm256_set1_ps(weight[0]), iy = _mm256_set1_ps(inter[0]);
+	__m256 ci = _mm256_set1_ps(color->i), wi = _mm256_set1_ps(weight[1]), ii = _mm256_set1_ps(inter[1]);
+	__m256 cq = _mm256_set1_ps(color->q), wq = _mm256_set1_ps(weight[2]), iq = _mm256_set1_ps(inter[2]);
+	__m256 ca = _mm256_set1_ps(color->a), wa = _mm256_set1_ps(weight[3]), ia = _mm256_set1_ps(inter[3]);
+
+	__m256 bestDiff = _mm256_set1_ps((float) RX_LARGE_NUMBER);
+	__m256i bestIndex = _mm256_setzero_si256();
+	__m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	for (unsigned int i = 0; i < accel->nPlttSoa; i += 8) {
+		__m256 dy = _mm256_sub_ps(cy, _mm256_loadu_ps(&accel->plttSoa[0][i]));
+		__m256 di = _mm256_sub_ps(ci, _mm256_loadu_ps(&accel->plttSoa[1][i]));
+		__m256 dq = _mm256_sub_ps(cq, _mm256_loadu_ps(&accel->plttSoa[2][i]));
+		__m256 da = _mm256_sub_ps(ca, _mm256_loadu_ps(&accel->plttSoa[3][i]));
+
+		__m256 ty = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(dy, wy), _mm256_mul_ps(da, iy)), dy);
+		__m256 ti = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(di, wi), _mm256_mul_ps(da, ii)), di);
+		__m256 tq = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(dq, wq), _mm256_mul_ps(da, iq)), dq);
+		__m256 ta = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(da, wa), _mm256_mul_ps(da, ia)), da);
+		__m256 diff = _mm256_add_ps(_mm256_add_ps(ty, ti), _mm256_add_ps(tq, ta));
+
+		//each lane keeps the first of its colors with the least difference
+		__m256 less = _mm256_cmp_ps(diff, bestDiff, _CMP_LT_OQ);
+		bestDiff = _mm256_blendv_ps(bestDiff, diff, less);
+		bestIndex = _mm256_blendv_epi8(bestIndex, index, _mm256_castps_si256(less));
+		index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+	}
+
+	//take the least difference of the lanes, with the lowest index on a tie like the linear search.
+	float diffs[8];
+	unsigned int indices[8];
+	_mm256_storeu_ps(diffs, bestDiff);
+	_mm256_storeu_si256((__m256i *) indices, bestIndex);
+
+	float leastDiff = diffs[0];
+	unsigned int leastIndex = indices[0];
+	for (unsigned int i = 1; i < 8; i++) {
+		if (diffs[i] < leastDiff || (diffs[i] == leastDiff && indices[i] < leastIndex)) {
+			leastDiff = diffs[i];
+			leastIndex = indices[i];
+		}
+	}
+
+	if (outDiff != NULL) *outDiff = (leastDiff < (float) RX_LARGE_NUMBER) ? (double) leastDiff : RX_LARGE_NUMBER;
+	return leastIndex;
+}
+#endif
+
 unsigned int RX_API RxPaletteFindClosestColor(RxReduction *reduction, COLOR32 color, double *outDiff) {
 	RxYiqColor yiq;
-	RxConvertRgbToYiq(color, &yiq);
+	RxiConvertRgbToYiq(color, &yiq);
 	return RxPaletteFindClosestColorYiq(reduction, &yiq, outDiff);
 }
 
-unsigned int RX_API RxPaletteFindClosestColorYiq(RxReduction *reduction, const RxYiqColor *color, double *outDiff) {
+static unsigned int RxiPaletteFindClosestColorYiq(RxReduction *reduction, const RxYiqColor *color, RxYiqColor *scratch, double *outDiff) {
+	//the search only reads the context, so it may run on several threads with their own scratch colors.
 	RxPaletteAccelerator *accel = &reduction->accel;
 	if (!accel->initialized) {
 		//not initialized
@@ -3215,7 +5271,7 @@ unsigned int RX_API RxPaletteFindClosestColorYiq(RxReduction *reduction, const R
 		return 0;
 	}
 
-	RxYiqColor *cpy = reduction->tempLayeredColor;
+	RxYiqColor *cpy = scratch;
 	RxiColorVecCopy(cpy, color, reduction->paletteLayers);
 
 	//processing for alpha mode
@@ -3249,6 +5305,13 @@ unsigned int RX_API RxPaletteFindClosestColorYiq(RxReduction *reduction, const R
 			break;
 	}
 
+#ifdef RX_SIMD
+	if (accel->useBruteForce) {
+		//vectorized search
+		return RxiPaletteFindClosestColorAvx2(reduction, cpy, outDiff) + plttStart;
+	}
+#endif
+
 	if (accel->useAccelerator) {
 		//accelerated search
 		return RxiPaletteFindClosestColorAccelerated(reduction, cpy, outDiff) + plttStart;
@@ -3259,6 +5322,28 @@ unsigned int RX_API RxPaletteFindClosestColorYiq(RxReduction *reduction, const R
 	}
 }
 
+unsigned int RX_API RxPaletteFindClosestColorYiq(RxReduction *reduction, const RxYiqColor *color, double *outDiff) {
+	return RxiPaletteFindClosestColorYiq(reduction, color, reduction->tempLayeredColor, outDiff);
+}
+
+static unsigned int RxiPaletteFindClosestColorCached(RxReduction *reduction, RxIndexCache *cache, COLOR32 rgb, const RxYiqColor *color, RxYiqColor *scratch) {
+	//only single-layer colors are cached, since the key is one RGB color.
+	if (cache == NULL || reduction->paletteLayers != 1) {
+		return RxiPaletteFindClosestColorYiq(reduction, color, scratch, NULL);
+	}
+
+	unsigned int slot = (rgb * 0x9E3779B1u) >> (32 - RX_INDEX_CACHE_BITS);
+	if (cache->generation[slot] == reduction->paletteGeneration && cache->rgb[slot] == rgb) {
+		return cache->index[slot];
+	}
+
+	unsigned int index = RxiPaletteFindClosestColorYiq(reduction, color, scratch, NULL);
+	cache->rgb[slot] = rgb;
+	cache->index[slot] = index;
+	cache->generation[slot] = reduction->paletteGeneration;
+	return index;
+}
+
 static RxStatus RxiPaletteAlloc(RxReduction *reduction, unsigned int nCol) {
 	RxPaletteAccelerator *accel = &reduction->accel;
 	RX_ASSUME(accel->plttLarge == NULL);
@@ -3276,6 +5361,33 @@ static RxStatus RxiPaletteAlloc(RxReduction *reduction, unsigned int nCol) {
 	return reduction->status;
 }
 
+#ifdef RX_SIMD
+static RxBool RxiPaletteLoadBruteForce(RxReduction *reduction, RxBool opaque) {
+	//the vectorized scan handles single-layer palettes up to a size where the K-D tree becomes faster.
+	RxPaletteAccelerator *accel = &reduction->accel;
+	if (reduction->paletteLayers != 1 || RxiGetSimdLevel() < RXI_SIMD_LEVEL_AVX2) return RX_FALSE;
+
+	unsigned int iStart = (accel->alphaMode == RX_ALPHA_RESERVE) ? 1 : 0;
+	if (accel->nPltt <= iStart) return RX_FALSE;
+
+	unsigned int nColors = accel->nPltt - iStart;
+	if (nColors > RX_BRUTE_FORCE_MAX_COLORS) return RX_FALSE;
+
+	//pad to a multiple of 8 with copies of the first color. Padding never wins over the first color.
+	accel->nPlttSoa = (nColors + 7) & ~7;
+	for (unsigned int i = 0; i < accel->nPlttSoa; i++) {
+		RxYiqColor yiq;
+		RxiColorCopy(&yiq, &accel->plttLarge[iStart + ((i < nColors) ? i : 0)]);
+		if (opaque) RxiColorMakeOpaque(&yiq);
+
+		for (unsigned int j = 0; j < 4; j++) accel->plttSoa[j][i] = yiq.vec[j];
+	}
+
+	accel->useBruteForce = RX_TRUE;
+	return RX_TRUE;
+}
+#endif
+
 static RxStatus RxiPaletteLoadAccelerated(RxReduction *reduction) {
 	//the K-D tree is incompatible with the palette with palette alpha.
 	RxAlphaMode alphaMode = reduction->accel.alphaMode;
@@ -3303,6 +5415,12 @@ static RxStatus RxiPaletteLoadAccelerated(RxReduction *reduction) {
 		}
 	}
 
+#ifdef RX_SIMD
+	//small palettes are scanned faster than the tree is searched. Like the tree, the scan then compares
+	//against opaque palette colors in the per-pixel alpha mode.
+	if (RxiPaletteLoadBruteForce(reduction, alphaMode == RX_ALPHA_PIXEL)) return RX_STATUS_OK;
+#endif
+
 	//working memory for accelerator
 	accel->pltt = (RxPaletteMapEntry *) RxMemCalloc(nColors, sizeof(RxPaletteMapEntry));
 	accel->nodebuf = (RxPaletteAccelNode *) calloc(nColors, sizeof(RxPaletteAccelNode));
@@ -3342,7 +5460,7 @@ static RxStatus RxiPaletteLoadUnaccelerated(RxReduction *reduction, const COLOR3
 
 	for (unsigned int j = 0; j < reduction->paletteLayers; j++) {
 		for (unsigned int i = 0; i < nColors; i++) {
-			RxConvertRgbToYiq(pltt[j * nColors + i], &reduction->accel.plttLarge[i * reduction->paletteLayers + j]);
+			RxiConvertRgbToYiq(pltt[j * nColors + i], &reduction->accel.plttLarge[i * reduction->paletteLayers + j]);
 		}
 	}
 
@@ -3374,6 +5492,7 @@ RxStatus RX_API RxPaletteLoad(RxReduction *reduction, const COLOR32 *pltt, unsig
 
 	//if an accelerator is loaded already, unload it.
 	RxPaletteFree(reduction);
+	RxiIndexCacheInvalidate(reduction);
 
 	//set alpha mode
 	accel->alphaMode = reduction->alphaMode;
@@ -3386,6 +5505,12 @@ RxStatus RX_API RxPaletteLoad(RxReduction *reduction, const COLOR32 *pltt, unsig
 		//number of colors is high enough to benefit from acceleration
 		RxiPaletteLoadAccelerated(reduction);
 	}
+#ifdef RX_SIMD
+	if (!accel->useAccelerator && !accel->useBruteForce) {
+		//replace the linear search with the vectorized scan over the same colors
+		RxiPaletteLoadBruteForce(reduction, RX_FALSE);
+	}
+#endif
 
 	accel->initialized = RX_TRUE;
 	return reduction->status;
@@ -3396,6 +5521,7 @@ static RxStatus RxiPaletteLoadYiq(RxReduction *reduction, const RxYiqColor *pltt
 
 	//if an accelerator is loaded already, unload it.
 	RxPaletteFree(reduction);
+	RxiIndexCacheInvalidate(reduction);
 
 	//set alpha mode
 	accel->alphaMode = reduction->alphaMode;
@@ -3415,6 +5541,12 @@ static RxStatus RxiPaletteLoadYiq(RxReduction *reduction, const RxYiqColor *pltt
 		//number of colors is high enough to benefit from acceleration
 		RxiPaletteLoadAccelerated(reduction);
 	}
+#ifdef RX_SIMD
+	if (!accel->useAccelerator && !accel->useBruteForce) {
+		//replace the linear search with the vectorized scan over the same colors
+		RxiPaletteLoadBruteForce(reduction, RX_FALSE);
+	}
+#endif
 
 	accel->initialized = RX_TRUE;
 	return reduction->status;
@@ -3459,7 +5591,7 @@ double RX_API RxComputePaletteError(RxReduction *reduction, const COLOR32 *px, u
 
 	//palette to YIQ
 	for (unsigned int i = 0; i < nColors; i++) {
-		RxConvertRgbToYiq(pal[i], &paletteYiq[i]);
+		RxiConvertRgbToYiq(pal[i], &paletteYiq[i]);
 	}
 
 	for (unsigned int i = 0; i < (width * height); i++) {
@@ -3469,7 +5601,7 @@ double RX_API RxComputePaletteError(RxReduction *reduction, const COLOR32 *px, u
 		p |= 0xFF000000;
 
 		RxYiqColor yiq;
-		RxConvertRgbToYiq(p, &yiq);
+		RxiConvertRgbToYiq(p, &yiq);
 		double bestDiff;
 		(void) RxiPaletteFindClosestColor(reduction, paletteYiq, nColors, &yiq, &bestDiff);
 
@@ -12,6 +12,7 @@
 #include "gdip.h"
 #include "bstream.h"
 #include "nns.h"
+#include "threadpool.h"
 
 //ensure TCHAR and related macros are defined
 #ifdef _WIN32
@@ -29,6 +30,7 @@
 #   define _tcsdup strdup
 #   define _tcsrchr strrchr
 #   define _ttoi atoi
+#   define _tcstod strtod
 #endif
 
 //MinGW's wprintf is defective. Account for this here.
@@ -82,19 +84,23 @@ typedef struct PtcOptions_ {
 	CxCompressionPolicy compressionPolicy;
 	RxBalanceSetting balance;
 	int outFixedPalette;
+	int nThreads;     // number of worker threads (0 for one per processor)
 	
 	int useAlphaKey;
 	COLOR32 alphaKey;
 	
 	//file names for conversion
-	const TCHAR *(srcFiles[PTC_INFILE_MAX]);  // path of input image
+	const TCHAR **srcFiles;                   // path of input images
 	const TCHAR *outBase;                     // base file output name
 	const TCHAR *fixedPalette;                // file name of fixed palette
+	const TCHAR *seedPalette;                 // file name of palette to start palette generation from
 	int nSrcFile;                             // number of input files
 	
 	//dithering options
 	int diffuse;      // the diffusion amount, in percent
 	int ditherAlpha;  // when dithering is enabled, controls dithering in the alpha channel
+	int ditherParallel; // when dithering is enabled, prepares dithering in parallel
+	RxDitherMode ditherMode; // dithering mode (error diffusion or ordered)
 	
 	//options for BG
 	int bgType;
@@ -118,6 +124,7 @@ typedef struct PtcOptions_ {
 	int trimT;               // Trim texture data on T axis
 	int noLimitPaletteSize;  // Limit palette size for tex4x4 conversion
 	int tex4x4Threshold;     // Palette merge threshold for tex4x4 conversion
+	int sharedPalette;       // Create one palette shared by all input images
 } PtcOptions;
 
 
@@ -160,10 +167,13 @@ static const char *g_helpString = ""
 	"   -og     Output as GRIT GRF file\n"
 	"   -k  <c> Specify alpha key as 24-bit RRGGBB hex color\n"
 	"   -d  <n> Use dithering of n% (default 0%)\n"
+	"   -dm <m> Dither mode {diffuse, bayer4, bayer8, bluenoise} (default diffuse)\n"
 	"   -cm <n> Limit palette colors to n, regardless of bit depth\n"
 	"   -bb <n> Lightness-Color balance [1, 39] (default 20)\n"
 	"   -bc <n> Red-Green color balance [1, 39] (default 20)\n"
 	"   -be     Enhance colors in gradients (off by default)\n"
+	"   -ri <p> End palette refinement when error improves by less than p% (default 0)\n"
+	"   -j  <n> Use n threads (default: all cores)\n"
 	"   -v      Verbose\n"
 	"   -h      Display help text\n"
 	"\n"
@@ -197,8 +207,11 @@ static const char *g_helpString = ""
 	"   -t0x    Color 0 is transparent     (default: inferred)\n"
 	"   -t0o    Color 0 is not transparent (default: inferred)\n"
 	"   -da     Apply dithering in the alpha  channel (a3i5, a5i3)\n"
+	"   -dp     Prepare dithering in parallel (same output)\n"
 	"   -fp <f> Specify fixed palette file\n"
 	"   -fpo    Outputs the fixed palette among other output files when used\n"
+	"   -fs <f> Refine palette file f instead of creating a new palette (animation frames)\n"
+	"   -sp     Create one palette shared by all input images (any count or size)\n"
 	"\n"
 	"Compression Options:\n"
 	"   -cbios  Enable use of all BIOS compression types (valid for binary, C, GRF)\n"
@@ -283,6 +296,12 @@ static void PtcPrint(PtcLevel level, const TCHAR *msg, ...) {
 	if (level == PTC_LEVEL_STOP) exit(1);
 }
 
+static void PtcPrintReclusterStats(unsigned int nRuns, unsigned int nIterations) {
+	if (nRuns == 0) return;
+	PtcPrint(PTC_LEVEL_INFO, _T("Palette refinement: %u runs, %u iterations (%.2f per run)\n\n"),
+		nRuns, nIterations, (double) nIterations / nRuns);
+}
+
 #define PTC_FAIL_IF(cond,...)  if (cond) { \
 	PtcPrint(PTC_LEVEL_STOP, __VA_ARGS__); \
 }
@@ -631,6 +650,23 @@ static TCHAR *PtcGetFileName(const TCHAR *path) {
 	return (TCHAR *) start;
 }
 
+static TCHAR *PtcImageFileName(const TCHAR *base, const TCHAR *srcPath, const TCHAR *suffix) {
+	//strip suffix from the input image file name
+	TCHAR *imageName = _tcsdup(PtcGetFileName(srcPath));
+	if (_tcsrchr(imageName, _T('.')) != NULL) {
+		*_tcsrchr(imageName, _T('.')) = _T('\0');
+	}
+	
+	//suffix file name: base_imageName followed by suffix
+	TCHAR *name1 = PtcSuffixFileName(base, _T("_"));
+	TCHAR *name2 = PtcSuffixFileName(name1, imageName);
+	TCHAR *name = PtcSuffixFileName(name2, suffix);
+	free(name1);
+	free(name2);
+	free(imageName);
+	return name;
+}
+
 
 // ----- file output routines
 
@@ -992,6 +1028,185 @@ static void *PtcPadBuffer(void *buf, unsigned int size, unsigned int newSize) {
 
 
 
+// ----- texture conversion routines
+
+static void PtcPreprocessImage(const PtcOptions *opt, PtcImage *image) {
+	for (int i = 0; i < image->width * image->height; i++) {
+		COLOR32 c = image->px[i];
+		
+		//apply alpha key
+		if (opt->useAlphaKey && (c & 0xFFFFFF) == (opt->alphaKey & 0xFFFFFF)) c = 0;
+		
+		//zero RGB color channels of transparent pixels
+		if (((c >> 24) & 0xFF) == 0) c = 0;
+		image->px[i] = c;
+	}
+}
+
+static void PtcPackTexels(TEXELS *texels, const int *indices, int width, int height, int texFmt, unsigned int bpp, int c0xp) {
+	int padHeight = 1;
+	while (padHeight < height) padHeight <<= 1;
+	
+	//pack the indices of the image. Rows past the image height are left as index 0.
+	unsigned int texelSize = (width * padHeight * bpp) / 8;
+	unsigned char *texel = (unsigned char *) calloc(texelSize, 1);
+
+	unsigned int pxPerByte = 8 / bpp;
+	for (unsigned int i = 0; i < (unsigned int) (width * height); i++) {
+		unsigned char icol = (unsigned char) indices[i];
+
+		unsigned int iPx = i / pxPerByte;
+		unsigned int shift = (i % pxPerByte) * bpp;
+		texel[iPx] |= icol << shift;
+	}
+
+	//compute the TEXIMAGE_PARAM
+	uint32_t texImageParam = 0;
+	if (c0xp) texImageParam |= (1 << 29);
+	texImageParam |= (1 << 17) | (1 << 16);
+	texImageParam |= (ilog2(width >> 3) << 20) | (ilog2(padHeight >> 3) << 23);
+	texImageParam |= texFmt << 26;
+	
+	texels->name = strdup("");
+	texels->height = height;
+	texels->texel = texel;
+	texels->cmp = NULL;
+	texels->texImageParam = texImageParam;
+}
+
+static int PtcReadPaddedImage(const PtcOptions *opt, const TCHAR *path, PtcImage *image) {
+	//read an image and pad it to a valid texture size, as the texture converter does. Returns the height
+	//of the image before padding.
+	PtcImage src;
+	src.px = tgdipReadImage(path, &src.width, &src.height);
+	PTC_FAIL_IF(src.px == NULL, _T("Failed to read the image file '") TC_STR _T("'.\n"), path);
+	PtcPreprocessImage(opt, &src);
+	
+	unsigned int padWidth, padHeight;
+	image->px = TxPadTextureImage(src.px, src.width, src.height, &padWidth, &padHeight);
+	PTC_FAIL_IF(image->px == NULL, _T("Error converting '") TC_STR _T("': insufficient system resources.\n"), path);
+	image->width = padWidth;
+	image->height = padHeight;
+	
+	free(src.px);
+	return src.height;
+}
+
+static void PtcConvertSharedPalette(PtcOptions *opt) {
+	//Creates one palette for any number of input images, each converted to its own texture. Only one
+	//image is held in memory at a time: the images are read once to accumulate a single histogram, and
+	//once more to be indexed against the finished palette.
+	static const int colorMaxes[] = { 0, 32, 4, 16, 256, 32768, 8,  0 };
+	static const int bppArray[]   = { 0,  8, 2,  4,   8,     2, 8, 16 };
+	
+	if (opt->texFmt == -1) opt->texFmt = CT_256COLOR;
+	switch (opt->texFmt) {
+		case CT_4COLOR:
+		case CT_16COLOR:
+		case CT_256COLOR:
+			//OK
+			break;
+		default:
+			PtcPrint(PTC_LEVEL_STOP, _T("The ") MB_STR _T(" texture format is not supported for shared palette generation.\n"),
+				TxNameFromTexFormat(opt->texFmt));
+			break;
+	}
+	PTC_FAIL_IF(opt->outMode != PTC_OUT_MODE_BINARY, _T("Shared palette generation only supports binary output.\n"));
+	PTC_FAIL_IF(opt->fixedPalette != NULL, _T("Shared palette generation does not support the fixed palette.\n"));
+	PTC_FAIL_IF(opt->seedPalette != NULL, _T("Shared palette generation does not support the seed palette.\n"));
+	
+	if (opt->nMaxColors == -1) opt->nMaxColors = colorMaxes[opt->texFmt];
+	if (opt->nMaxColors > colorMaxes[opt->texFmt]) {
+		opt->nMaxColors = colorMaxes[opt->texFmt];
+		PtcPrint(PTC_LEVEL_WARN, _T("Color count truncated to %d.\n"), opt->nMaxColors);
+	}
+	PtcPrint(PTC_LEVEL_INFO, _T("Generating shared palette\nMax colors: %d\nFormat: ") MB_STR _T("\nImages: %d\n\n"),
+		opt->nMaxColors, TxNameFromTexFormat(opt->texFmt), opt->nSrcFile);
+	
+	RxReduction *reduction = RxNew(&opt->balance);
+	RxSetDitherMode(reduction, opt->ditherMode);
+	
+	//accumulate the histogram of all images. Transparent pixels are excluded from the histogram in either
+	//color 0 mode, so the mode can be inferred once every image has been seen.
+	int hasTransparent = 0;
+	for (int i = 0; i < opt->nSrcFile; i++) {
+		PtcImage image;
+		PtcReadPaddedImage(opt, opt->srcFiles[i], &image);
+		
+		for (int j = 0; j < image.width * image.height && !hasTransparent; j++) {
+			if ((image.px[j] >> 24) < 0x80) hasTransparent = 1;
+		}
+		
+		RxHistAdd(reduction, image.px, image.width, image.height);
+		free(image.px);
+	}
+	if (opt->c0xp == -1) opt->c0xp = hasTransparent;
+	
+	RxFlag flag = RX_FLAG_NO_WRITEBACK | RX_FLAG_NO_ALPHA_DITHER;
+	if (opt->c0xp) flag |= RX_FLAG_ALPHA_MODE_RESERVE;
+	else           flag |= RX_FLAG_ALPHA_MODE_NONE;
+	if (opt->ditherParallel) flag |= RX_FLAG_PARALLEL_DIFFUSE;
+	RxApplyFlags(reduction, flag);
+	
+	//create the palette
+	RxHistFinalize(reduction);
+	RxComputePalette(reduction, opt->nMaxColors - (opt->c0xp ? 1 : 0));
+	
+	unsigned int reclusterRuns, reclusterIterations;
+	RxGetReclusterStats(reduction, &reclusterRuns, &reclusterIterations);
+	PtcPrintReclusterStats(reclusterRuns, reclusterIterations);
+	
+	COLOR32 *pltt = (COLOR32 *) calloc(opt->nMaxColors, sizeof(COLOR32));
+	RxSortPalette(reduction, RX_FLAG_SORT_ONLY_USED | RX_FLAG_SORT_END_DIFFER);
+	RxGetPalette(reduction, pltt, 0);
+	RxPaletteLoad(reduction, pltt, opt->nMaxColors);
+	
+	//output the shared palette: outBase_pal.bin
+	COLOR *pal = (COLOR *) calloc(opt->nMaxColors, sizeof(COLOR));
+	for (int i = 0; i < opt->nMaxColors; i++) {
+		pal[i] = ColorConvertToDS(pltt[i]);
+	}
+	
+	TCHAR *pltName = PtcSuffixFileName(opt->outBase, NTFP_EXTENSION);
+	PtcEmitBinaryDataByPath(pltName, pal, opt->nMaxColors * sizeof(COLOR), opt->compressionPolicy);
+	free(pltName);
+	free(pal);
+	free(pltt);
+	
+	//convert each image against the shared palette
+	float diffuse = (float) opt->diffuse / 100.0f;
+	for (int i = 0; i < opt->nSrcFile; i++) {
+		PtcImage image;
+		int srcHeight = PtcReadPaddedImage(opt, opt->srcFiles[i], &image);
+		
+		int *indices = (int *) calloc(image.width * image.height, sizeof(int));
+		RxReduceImage(reduction, image.px, indices, image.width, image.height, flag, diffuse);
+		free(image.px);
+		
+		TEXELS texels = { 0 };
+		PtcPackTexels(&texels, indices, image.width, image.height, opt->texFmt, bppArray[opt->texFmt], opt->c0xp);
+		free(indices);
+		
+		//trim texture data by height
+		if (opt->trimT) texels.height = (srcHeight < image.height) ? srcHeight : image.height;
+		else            texels.height = TEXH(texels.texImageParam);
+		PtcTrimTextureData(&texels);
+		int texelSize = TEXW(texels.texImageParam) * texels.height * bppArray[opt->texFmt] / 8;
+		
+		//output texel: outBase_imageName_tex.bin
+		TCHAR *texName = PtcImageFileName(opt->outBase, opt->srcFiles[i], NTFT_EXTENSION);
+		PtcEmitBinaryDataByPath(texName, texels.texel, texelSize, opt->compressionPolicy);
+		free(texName);
+		
+		free(texels.texel);
+		free(texels.name);
+	}
+	
+	RxFree(reduction);
+}
+
+
+
 // ----- main command line routine
 
 typedef void (*PtcSwitchProc) (PtcOptions *options, TCHAR **argv);
@@ -1043,6 +1258,17 @@ static void PtcSwitch_d(PtcOptions *options, TCHAR **argv) {
 	options->diffuse = _ttoi(argv[0]);
 }
 
+static void PtcSwitch_dm(PtcOptions *options, TCHAR **argv) {
+	const TCHAR *modeString = argv[0];
+
+	//set the dithering mode
+	if      (_tcscmp(modeString, _T("diffuse"  )) == 0) options->ditherMode = RX_DITHER_DIFFUSE;
+	else if (_tcscmp(modeString, _T("bayer4"   )) == 0) options->ditherMode = RX_DITHER_BAYER4;
+	else if (_tcscmp(modeString, _T("bayer8"   )) == 0) options->ditherMode = RX_DITHER_BAYER8;
+	else if (_tcscmp(modeString, _T("bluenoise")) == 0) options->ditherMode = RX_DITHER_BLUE_NOISE;
+	else PtcPrint(PTC_LEVEL_STOP, _T("Invalid dither mode '") TC_STR _T("'.\n"), modeString);
+}
+
 static void PtcSwitch_bb(PtcOptions *options, TCHAR **argv) {
 	//set lightness-color balance
 	options->balance.balance = _ttoi(argv[0]);
@@ -1060,11 +1286,21 @@ static void PtcSwitch_be(PtcOptions *options, TCHAR **argv) {
 	options->balance.enhanceColors = 1;
 }
 
+static void PtcSwitch_ri(PtcOptions *options, TCHAR **argv) {
+	//set the least error improvement, in percent, to continue palette refinement
+	options->balance.reclusterImprovement = _tcstod(argv[0], NULL) / 100.0;
+}
+
 static void PtcSwitch_cm(PtcOptions *options, TCHAR **argv) {
 	//set max colors
 	options->nMaxColors = _ttoi(argv[0]);
 }
 
+static void PtcSwitch_j(PtcOptions *options, TCHAR **argv) {
+	//set thread count
+	options->nThreads = _ttoi(argv[0]);
+}
+
 static void PtcSwitch_gb(PtcOptions *options, TCHAR **argv) {
 	(void) argv;
 	
@@ -1337,6 +1573,11 @@ static void PtcSwitch_fp(PtcOptions *options, TCHAR **argv) {
 	options->fixedPalette = argv[0];
 }
 
+static void PtcSwitch_fs(PtcOptions *options, TCHAR **argv) {
+	//set the path to the seed palette file
+	options->seedPalette = argv[0];
+}
+
 static void PtcSwitch_fpo(PtcOptions *options, TCHAR **argv) {
 	(void) argv;
 	
@@ -1372,6 +1613,20 @@ static void PtcSwitch_da(PtcOptions *options, TCHAR **argv) {
 	options->ditherAlpha = 1;
 }
 
+static void PtcSwitch_dp(PtcOptions *options, TCHAR **argv) {
+	(void) argv;
+	
+	//enable parallel dither preparation
+	options->ditherParallel = 1;
+}
+
+static void PtcSwitch_sp(PtcOptions *options, TCHAR **argv) {
+	(void) argv;
+	
+	//enable shared palette generation for all input images
+	options->sharedPalette = 1;
+}
+
 
 static const PtcSwitch sSwitches[] = {
 	// ----- Global switches
@@ -1381,10 +1636,13 @@ static const PtcSwitch sSwitches[] = {
 	{ _T("o") ,    1, PtcSwitch_o  },
 	{ _T("k") ,    1, PtcSwitch_k  },
 	{ _T("d") ,    1, PtcSwitch_d  },
+	{ _T("dm"),    1, PtcSwitch_dm },
 	{ _T("bb"),    1, PtcSwitch_bb },
 	{ _T("bc"),    1, PtcSwitch_bc },
 	{ _T("be"),    0, PtcSwitch_be },
+	{ _T("ri"),    1, PtcSwitch_ri },
 	{ _T("cm"),    1, PtcSwitch_cm },
+	{ _T("j"),     1, PtcSwitch_j  },
 	
 	// ----- Generate mode switches
 	{ _T("gb"),    0, PtcSwitch_gb },
@@ -1434,10 +1692,13 @@ static const PtcSwitch sSwitches[] = {
 	{ _T("ct"),    1, PtcSwitch_ct  },
 	{ _T("fp"),    1, PtcSwitch_fp  },
 	{ _T("fpo"),   0, PtcSwitch_fpo },
+	{ _T("fs"),    1, PtcSwitch_fs  },
 	{ _T("tt"),    0, PtcSwitch_tt  },
 	{ _T("t0o"),   0, PtcSwitch_t0o },
 	{ _T("t0x"),   0, PtcSwitch_t0x },
-	{ _T("da"),    0, PtcSwitch_da  }
+	{ _T("da"),    0, PtcSwitch_da  },
+	{ _T("dp"),    0, PtcSwitch_dp  },
+	{ _T("sp"),    0, PtcSwitch_sp  }
 };
 
 static void PtcOptParse(PtcOptions *opt, int argc, TCHAR **argv) {
@@ -1453,14 +1714,18 @@ static void PtcOptParse(PtcOptions *opt, int argc, TCHAR **argv) {
 	//data output settings
 	opt->genMode = PTC_GMODE_BG;                        // default output type (BG graphics)
 	opt->outMode = PTC_OUT_MODE_BINARY;                 // default output format (raw binary data)
+	opt->nThreads = 0;                                  // default thread count (one per processor)
 	opt->compressionPolicy = CX_COMPRESSION_VRAM_SAFE;  // default compression (none explicit, VRAM safety required)
 	
 	//color conversion options
 	opt->balance.balance       = RX_BALANCE_DEFAULT;       // default lightness-color balance setting
 	opt->balance.colorBalance  = RX_COLORBALANCE_DEFAULT;  // default color balance setting (neutral)
 	opt->balance.enhanceColors = RX_FALSE;                 // enhance largely used colors
+	opt->balance.reclusterImprovement = RECLUSTER_IMPROVEMENT_DEFAULT; // refine palettes until no color moves
 	opt->diffuse = 0;                                      // default error diffusion amount (0%)
 	opt->ditherAlpha = 0;                                  // dither the alpha channel?
+	opt->ditherParallel = 0;                               // prepare dithering in parallel?
+	opt->ditherMode = RX_DITHER_DIFFUSE;                   // default dither mode (error diffusion)
 	
 	//begin processing arguments. First, determine global settings and conversion mode.
 	opt->nMaxColors = -1;                // default. 256 for BG, automatic for texture
@@ -1485,6 +1750,10 @@ static void PtcOptParse(PtcOptions *opt, int argc, TCHAR **argv) {
 	opt->trimT = 0;                      // trim texture in the T axis if not a power of 2 in height
 	opt->outFixedPalette = 0;            // output fixed palette among other output files
 	opt->c0xp = -1;                      // is color 0 transparent reserved?
+	opt->sharedPalette = 0;              // create one palette shared by all input images
+
+	//input file list, at most one per argument
+	opt->srcFiles = (const TCHAR **) calloc(argc, sizeof(const TCHAR *));
 
 	for (int i = 0; i < argc; i++) {
 		const TCHAR *arg = argv[i];
@@ -1518,9 +1787,6 @@ static void PtcOptParse(PtcOptions *opt, int argc, TCHAR **argv) {
 			
 		} else {
 			//add input file
-			PTC_FAIL_IF(opt->nSrcFile >= PTC_INFILE_MAX, _T("The number of input files (%d) exceeds the maximum allowed (%d).\n"),
-				opt->nSrcFile, PTC_INFILE_MAX);
-			
 			opt->srcFiles[opt->nSrcFile++] = arg;
 		}
 	}
@@ -1538,6 +1804,12 @@ int _tmain(int argc, TCHAR **argv) {
 	PTC_FAIL_IF(opt.nSrcFile == 0,                    _T("No source image specified.\n"));
 	PTC_FAIL_IF(opt.outBase == NULL,                  _T("No output name specified.\n"));
 	PTC_FAIL_IF(opt.diffuse < 0 || opt.diffuse > 100, _T("Diffuse amount (%d) must be between 0 and 100.\n"), opt.diffuse);
+	PTC_FAIL_IF(opt.nThreads < 0,                     _T("Thread count (%d) must not be negative.\n"), opt.nThreads);
+	PTC_FAIL_IF(!opt.sharedPalette && opt.nSrcFile > PTC_INFILE_MAX, _T("The number of input files (%d) exceeds the maximum allowed (%d).\n"),
+		opt.nSrcFile, PTC_INFILE_MAX);
+
+	//start worker threads
+	TpInit(opt.nThreads);
 	
 	if (opt.genMode == PTC_GMODE_BG) {
 		//BG mode paramter checks
@@ -1576,10 +1848,21 @@ int _tmain(int argc, TCHAR **argv) {
 		PTC_FAIL_IF(maxPlttAddr > maxPltt,                             _T("Invalid palette count or base specified for BG (%d).\n"), opt.nPalettes);
 		PTC_FAIL_IF(opt.nMaxChars > maxCharsFmt || opt.nMaxChars < -1, _T("Invalid maximum character count specified for BG (%d).\n"), opt.nMaxChars);
 		PTC_FAIL_IF(opt.screenExclusive && (opt.srcChrFile == NULL || opt.srcPalFile == NULL), _T("Palette and character file required for this command.\n"));
+		PTC_FAIL_IF(opt.seedPalette != NULL,                           _T("BG mode conversion does not support the seed palette.\n"));
 	} else if (opt.genMode == PTC_GMODE_TEXTURE) {
 		//texture mode paramter checks
 		PTC_FAIL_IF(opt.outMode == PTC_OUT_MODE_DIB,              _T("DIB output is not applicable for texture mode conversion.\n"));
 	}
+	
+	if (opt.sharedPalette) {
+		//shared palette mode reads the input images one at a time
+		PTC_FAIL_IF(opt.genMode != PTC_GMODE_TEXTURE, _T("Shared palette generation is only supported in texture mode.\n"));
+		PtcConvertSharedPalette(&opt);
+		
+		TpShutdown();
+		free(opt.srcFiles);
+		return 0;
+	}
 
 	//MBS copy of base
 	int baseLength = _tcslen(opt.outBase);
@@ -1597,22 +1880,9 @@ int _tmain(int argc, TCHAR **argv) {
 		}
 	}
 	
-	//apply alpha key
-	if (opt.useAlphaKey) {
-		for (int j = 0; j < opt.nSrcFile; j++) {
-			for (int i = 0; i < images[j].width * images[j].height; i++) {
-				COLOR32 c = images[j].px[i];
-				if ((c & 0xFFFFFF) == (opt.alphaKey & 0xFFFFFF)) images[j].px[i] = 0;
-			}
-		}
-	}
-	
-	//preprocess transparent pixels by zeroing RGB color channels of transparent pixels
+	//apply alpha key and clear transparent pixels
 	for (int j = 0; j < opt.nSrcFile; j++) {
-		for (int i = 0; i < images[j].width * images[j].height; i++) {
-			COLOR32 c = images[j].px[i];
-			if (((c >> 24) & 0xFF) == 0) images[j].px[i] = 0;
-		}
+		PtcPreprocessImage(&opt, &images[j]);
 	}
 	
 	if (opt.genMode == PTC_GMODE_BG) {
@@ -1711,17 +1981,26 @@ int _tmain(int argc, TCHAR **argv) {
 			params.color0Mode = (opt.bgColor0Use ? BGGEN_COLOR0_USE : BGGEN_COLOR0_FIXED);
 			params.dither.dither = (opt.diffuse != 0);
 			params.dither.diffuse = ((float) opt.diffuse) / 100.0f;
+			params.dither.mode = opt.ditherMode;
 			params.characterSetting.base = opt.charBase;
 			params.characterSetting.compress = (opt.nMaxChars != -1);
 			params.characterSetting.nMax = opt.nMaxChars;
 			params.characterSetting.alignment = 1;
+			unsigned int reclusterRuns, reclusterIterations;
 			BgGenerate(pal, &chars, &screen, &palSize, &charSize, &screenSize, images[0].px, images[0].width, images[0].height,
-				&params, &p1, &p1max, &p2, &p2max);
+				&params, &p1, &p1max, &p2, &p2max, &reclusterRuns, &reclusterIterations);
+			PtcPrintReclusterStats(reclusterRuns, reclusterIterations);
 		} else {
 			//from existing palette+char
+			unsigned long long cacheHits, cacheLookups;
 			BgAssemble(images[0].px, images[0].width, images[0].height, depth, pal, opt.nPalettes, existingChars,
 				existingCharsSize / (8 * depth), &screen, &screenSize,
-				opt.balance.balance, opt.balance.colorBalance, opt.balance.enhanceColors);
+				opt.balance.balance, opt.balance.colorBalance, opt.balance.enhanceColors, &cacheHits, &cacheLookups);
+			
+			if (cacheLookups > 0) {
+				PtcPrint(PTC_LEVEL_INFO, _T("Color conversion cache: %llu of %llu lookups hit (%.1f%%)\n\n"),
+					cacheHits, cacheLookups, 100.0 * cacheHits / cacheLookups);
+			}
 		}
 		
 		//convert BG format
@@ -2064,6 +2343,8 @@ int _tmain(int argc, TCHAR **argv) {
 			params.diffuseAmount = (float) opt.diffuse / 100.0f;
 			params.dither = !!opt.diffuse;
 			params.ditherAlpha = params.dither && opt.ditherAlpha && (opt.texFmt == CT_A3I5 || opt.texFmt == CT_A5I3);
+			params.ditherParallel = opt.ditherParallel;
+			params.ditherMode = opt.ditherMode;
 			params.fixedPalette = NULL;
 			params.fmt = opt.texFmt;
 			params.width = width;
@@ -2085,32 +2366,44 @@ int _tmain(int argc, TCHAR **argv) {
 				}
 			}
 			
+			//read the seed palette file, if one was specified
+			if (opt.seedPalette != NULL) {
+				int size;
+				params.seedPalette = (COLOR *) PtcReadFile(opt.seedPalette, &size);
+				params.seedColors = size >> 1;
+			}
+			
 			TxConvert(&params);
+			PtcPrintReclusterStats(params.reclusterRuns, params.reclusterIterations);
 			
 			if (params.fixedPalette != NULL) free(params.fixedPalette);
+			if (params.seedPalette != NULL) free(params.seedPalette);
 		} else {
 			//generation mode for multiple input images
 			PTC_FAIL_IF(opt.fixedPalette != NULL, _T("Multiple image generation texture mode does not support the fixed palette.\n"));
+			PTC_FAIL_IF(opt.seedPalette != NULL, _T("Multiple image generation texture mode does not support the seed palette.\n"));
 			
 			RxFlag flag = RX_FLAG_NO_WRITEBACK | RX_FLAG_NO_ALPHA_DITHER;
 			if (opt.c0xp) flag |= RX_FLAG_ALPHA_MODE_RESERVE;
 			else          flag |= RX_FLAG_ALPHA_MODE_NONE;
-			
-			int padHeight = 1;
-			while (padHeight < height) padHeight <<= 1;
-			unsigned int nPx = width * padHeight;
+			if (opt.ditherParallel) flag |= RX_FLAG_PARALLEL_DIFFUSE;
 			
 			float diffuse = (float) opt.diffuse / 100.0f;
 			
 			RxReduction *reduction = RxNew(&opt.balance);
 			RxSetPaletteLayers(reduction, opt.nSrcFile);
 			RxApplyFlags(reduction, flag);
+			RxSetDitherMode(reduction, opt.ditherMode);
 			
 			//build histogram and create the palette
 			RxHistAdd(reduction, px, width, height);
 			RxHistFinalize(reduction);
 			RxComputePalette(reduction, opt.nMaxColors - (opt.c0xp ? 1 : 0));
 			
+			unsigned int reclusterRuns, reclusterIterations;
+			RxGetReclusterStats(reduction, &reclusterRuns, &reclusterIterations);
+			PtcPrintReclusterStats(reclusterRuns, reclusterIterations);
+			
 			//get the palette data
 			COLOR32 *pltt = (COLOR32 *) calloc(opt.nSrcFile * opt.nMaxColors, sizeof(COLOR32));
 			RxSortPalette(reduction, RX_FLAG_SORT_ONLY_USED | RX_FLAG_SORT_END_DIFFER);
@@ -2124,32 +2417,8 @@ int _tmain(int argc, TCHAR **argv) {
 			RxFree(reduction);
 			
 			//create the texel data
-			unsigned int bpp = bppArray[opt.texFmt];
-			unsigned int texelSize = (width * padHeight * bpp) / 8;
-			unsigned char *texel = (unsigned char *) calloc(texelSize, 1);
-
-			unsigned int pxPerByte = 8 / bpp;
-			for (unsigned int i = 0; i < nPx; i++) {
-				unsigned char icol = (unsigned char) indices[i];
-
-				unsigned int iPx = i / pxPerByte;
-				unsigned int shift = (i % pxPerByte) * bpp;
-				texel[iPx] |= icol << shift;
-			}
+			PtcPackTexels(&texture.texels, indices, width, height, opt.texFmt, bppArray[opt.texFmt], opt.c0xp);
 			free(indices);
-
-			//compute the TEXIMAGE_PARAM
-			uint32_t texImageParam = 0;
-			if (opt.c0xp) texImageParam |= (1 << 29);
-			texImageParam |= (1 << 17) | (1 << 16);
-			texImageParam |= (ilog2(width >> 3) << 20) | (ilog2(padHeight >> 3) << 23);
-			texImageParam |= opt.texFmt << 26;
-			
-			texture.texels.name = strdup("");
-			texture.texels.height = height;
-			texture.texels.texel = texel;
-			texture.texels.cmp = NULL;
-			texture.texels.texImageParam = texImageParam;
 			
 			texture.palette.name = strdup("");
 			texture.palette.nColors = opt.nSrcFile * opt.nMaxColors;
@@ -2208,26 +2477,13 @@ int _tmain(int argc, TCHAR **argv) {
 				} else {
 					//suffix _imageName_pal.bin for multiple palette
 					for (int i = 0; i < opt.nSrcFile; i++) {
-						const TCHAR *imageFileName = PtcGetFileName(opt.srcFiles[i]);
-						
-						//strip suffix
-						TCHAR *imageName = _tcsdup(imageFileName);
-						if (_tcsrchr(imageName, _T('.')) != NULL) {
-							*_tcsrchr(imageName, _T('.')) = _T('\0');
-						}
-						
 						//suffix file name: outBase_imageName_pal.bin
-						TCHAR *pltName1 = PtcSuffixFileName(opt.outBase, _T("_"));
-						TCHAR *pltName2 = PtcSuffixFileName(pltName1, imageName);
-						TCHAR *pltName = PtcSuffixFileName(pltName2, NTFP_EXTENSION);
-						free(pltName1);
-						free(pltName2);
+						TCHAR *pltName = PtcImageFileName(opt.outBase, opt.srcFiles[i], NTFP_EXTENSION);
 						
 						//put data
 						PtcEmitBinaryDataByPath(pltName, texture.palette.pal + i * opt.nMaxColors,
 							opt.nMaxColors * sizeof(COLOR), opt.compressionPolicy);
 						free(pltName);
-						free(imageName);
 					}
 				}
 			}
@@ -2323,6 +2579,7 @@ int _tmain(int argc, TCHAR **argv) {
 		free(px);
 	}
 
+	TpShutdown();
 	return 0;
 }
 
@@ -79,9 +79,12 @@
 
 #include "color.h"
 
-//use of intrinsics under x86
-#if defined(_M_IX86) || defined(_M_X64)
+//use of intrinsics under x86 (SSE2 is the baseline, wider instruction sets are selected at runtime)
+#if defined(_M_IX86) || defined(_M_X64) || defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
 #define RX_SIMD
+#if defined(_M_X64) || defined(__x86_64__)
+#define RX_SIMD_X64 // 64-bit heap allocations are already 16-byte aligned
+#endif
 #ifdef _MSC_VER
 #include <intrin.h>
 #else // _MSC_VER
@@ -98,13 +101,16 @@
 #define BALANCE_MAX               39  // Balance/Color Balance maximum setting
 
 #define RECLUSTER_DEFAULT          8  // Default number of reclusters applied to the color palette
+#define RECLUSTER_IMPROVEMENT_DEFAULT 0.0 // Default least relative error improvement to continue reclustering
 
 #define RX_PALETTE_MAX_SIZE      256  // Maximum created color palette size
 #define RX_PALETTE_MAX_COUNT      16  // Maximum simultaneously generated palettes
 
-#define RX_HISTOGRAM_SIZE    0x20000  // size of the histogram in slots
-#define RX_HISTOGRAM_SMALL       256  // size of a "small" histogram
+#define RX_HISTOGRAM_SIZE    0x20000  // range of the histogram color hash
+#define RX_HISTOGRAM_SMALL       256  // number of distinct hashes in a "small" histogram
 #define RX_TEMP_IMG_BUF_SIZE (10*10)  // buffer for holding YIQ image color data
+#define RX_YIQ_CACHE_BITS         12  // log2 of the number of entries of the RGB to YIQ conversion cache
+#define RX_INDEX_CACHE_BITS       12  // log2 of the number of entries of the color to palette index cache
 
 
 typedef struct RxReduction_ RxReduction;
@@ -192,6 +198,9 @@ typedef enum RxStatus_ {
 //   RX_FLAG_NO_ADAPTIVE_DIFFUSE Do not use adaptive error diffusion. The adaptive error diffusion
 //                               will reduce the amount of noise from dithering, but may at times
 //                               be undesirable.
+//   RX_FLAG_PARALLEL_DIFFUSE    With adaptive error diffusion, decide which pixels are dithered in
+//                               parallel before the serial scan. Uses an extra index buffer when no
+//                               index output is given. The output is identical.
 // -----------------------------------------------------------------------------------------------
 typedef enum RxFlag_ {
 	RX_FLAG_SORT_ALL            = (0x00<< 0), // sort the entire output palette
@@ -212,6 +221,7 @@ typedef enum RxFlag_ {
 	RX_FLAG_NO_WRITEBACK        = (0x01<< 6), // suppresses writeback of RGB pixel data in color reduction
 	RX_FLAG_NO_ALPHA_DITHER     = (0x01<< 7), // the alpha channel will not be dithered
 	RX_FLAG_NO_ADAPTIVE_DIFFUSE = (0x01<< 8), // do not use the adaptive error diffusion
+	RX_FLAG_PARALLEL_DIFFUSE    = (0x01<< 9), // classify pixels for dithering in parallel
 } RxFlag;
 
 typedef enum RxAlphaMode_ {
@@ -225,11 +235,20 @@ typedef struct RxBalanceSetting_ {
 	int balance;           // relative priority of lightness over color information (1-39)
 	int colorBalance;      // relative priority of reds over greens                 (1-39)
 	RxBool enhanceColors;  // enhance largely used colors
+	double reclusterImprovement; // least relative error improvement to continue palette refinement (see RxSetReclusterPolicy)
 } RxBalanceSetting;
 
+typedef enum RxDitherMode_ {
+	RX_DITHER_DIFFUSE,    // Floyd-Steinberg error diffusion
+	RX_DITHER_BAYER4,     // ordered dithering with a 4x4 Bayer matrix
+	RX_DITHER_BAYER8,     // ordered dithering with an 8x8 Bayer matrix
+	RX_DITHER_BLUE_NOISE  // ordered dithering with a 16x16 blue noise tile
+} RxDitherMode;
+
 typedef struct RxDitherSetting_ {
 	RxBool dither;        // enable dithering
 	float diffuse;        // dithering amount (0-1)
+	RxDitherMode mode;    // dithering mode
 } RxDitherSetting;
 
 typedef union RxYiqColor_ {
@@ -261,15 +280,6 @@ typedef union RxLongColor_ {
 #endif
 } RxLongColor;
 
-//histogram linked list entry as secondary sorting
-typedef struct RxHistEntry_ {
-	int entry;                    // nearest cluster index mapped to
-	struct RxHistEntry_ *next;    // pointer to the next histogram entry in the bucket
-	double weight;                // weight of this histogram entry
-	double value;                 // used for PCA: dot product with PC1
-	RxYiqColor color[];           // color of this histogram node
-} RxHistEntry;
-
 //structure for a node in the color tree
 typedef struct RxColorNode_ {
 	double weight;                 // weight associated with this node
@@ -278,27 +288,71 @@ typedef struct RxColorNode_ {
 	int pivotIndex;                // calculated pivot index for this node
 	int startIndex;                // starting index in the flat histogram
 	int endIndex;                  // ending index (non-inclusive) for this node
-	RxYiqColor color[];            // this node's color information
+	int heapIndex;                 // position in the split heap, or -1 when not queued for splitting
+	unsigned int serial;           // creation order of the node, breaks ties of priority
+	RxBool dupChecked;             // color was checked against all other nodes for duplicates
+	RxYiqColor color[];            // this node's color information, followed by its masked RGB
 } RxColorNode;
 
-//allocator for allocating the linked lists
-typedef struct RxSlab_ {
-	void *allocation;
-	unsigned int pos;
-	struct RxSlab_ *next;
-} RxSlab;
+//slot of the histogram hash table. A slot is empty unless it was written in the histogram's current
+//generation, so the table needn't be zeroed when the histogram is cleared.
+typedef struct RxHistSlot_ {
+	unsigned int generation;      // generation the slot was written in
+	unsigned int index;           // index of the histogram entry in this slot
+} RxHistSlot;
 
-//histogram structure
+//histogram structure. Colors are kept in an open-addressed hash table, with the colors, weights and
+//hashes of the entries stored contiguously in the order they were added.
 typedef struct RxHistogram_ {
-	RxSlab allocator;
-	RxHistEntry *entries[RX_HISTOGRAM_SIZE];
+	RxHistSlot *table;            // hash table of entry indices
+	unsigned int tableBits;       // log2 of the hash table size
+	unsigned int generation;      // current generation of the hash table
+	unsigned int nLayers;         // number of colors per entry
+	int capacity;                 // number of entries allocated
+	RxYiqColor *colors;           // entry colors, nLayers per entry
+	double *weights;              // entry weights
+	unsigned int *hashes;         // entry color hashes
 	double totalWeight;
 	int nEntries;
-	int firstSlot;
-	int nSlotsUsed;
-	int slotIndices[RX_HISTOGRAM_SMALL];
 } RxHistogram;
 
+//histogram entry that could be moved to seed a degenerate cluster in Voronoi iteration
+typedef struct RxVoronoiCandidate_ {
+	int index;                    // histogram entry index, or -1 once the entry has been moved
+	double diff;                  // weighted difference to the entry's current centroid
+	double newDiff;               // weighted difference to the entry's own masked color
+} RxVoronoiCandidate;
+
+//finalized histogram, as a structure of arrays sorted into histogram order
+typedef struct RxHistFlat_ {
+	RxYiqColor *color;            // colors, paletteLayers per entry
+	double *weight;               // weights
+	double *value;                // used for PCA: dot product with PC1
+	int *entry;                   // nearest cluster index mapped to
+	double *diff;                 // difference to the nearest cluster
+	int *member;                  // entry indices grouped by nearest cluster, in entry order
+	RxVoronoiCandidate *candidate; // entries that may seed a degenerate cluster, in entry order
+	int nEntries;                 // number of entries, 0 when the histogram is not finalized
+	int capacity;                 // number of entries allocated
+} RxHistFlat;
+
+//direct-mapped cache of RGB to YIQ conversions. Every entry holds a valid conversion, starting out
+//with that of transparent black.
+typedef struct RxYiqCache_ {
+	RxYiqColor yiq[1 << RX_YIQ_CACHE_BITS];   // converted colors
+	COLOR32 rgb[1 << RX_YIQ_CACHE_BITS];      // source colors of the entries
+	unsigned long long nLookups;              // number of conversions requested
+	unsigned long long nHits;                 // number of conversions found in the cache
+} RxYiqCache;
+
+//direct-mapped cache of colors matched to the loaded palette. An entry is valid only while its generation
+//matches that of the loaded palette, so loading a palette invalidates the cache without clearing it.
+typedef struct RxIndexCache_ {
+	COLOR32 rgb[1 << RX_INDEX_CACHE_BITS];               // source colors of the entries
+	unsigned int index[1 << RX_INDEX_CACHE_BITS];        // palette indices the colors were matched to
+	unsigned int generation[1 << RX_INDEX_CACHE_BITS];   // palette generation the entries belong to
+} RxIndexCache;
+
 typedef struct RxPcaWork_ {
 	double x[4 * RX_PALETTE_MAX_COUNT];
 	double means[4 * RX_PALETTE_MAX_COUNT];
@@ -315,6 +369,7 @@ typedef struct {
 	double weight;
 	double error;
 	unsigned int count;
+	unsigned int start;    // index of the first member in histogramFlat.member
 } RxTotalBuffer;
 
 typedef struct RxPaletteMapEntry_ {
@@ -345,6 +400,11 @@ typedef struct RxPaletteAccelerator_ {
 	RxYiqColor *plttLarge;                            // pointer to palette buffer (heap allocated or pointer to small)
 	unsigned int nPltt;                               // number of palette colors loaded
 	RxAlphaMode alphaMode;                            // alpha processing mode used by the accelerator
+#ifdef RX_SIMD
+	RxBool useBruteForce;                             // marks that the loaded palette is searched by the vectorized scan
+	unsigned int nPlttSoa;                            // number of colors in plttSoa, padded to a multiple of 8
+	float plttSoa[4][RX_PALETTE_MAX_SIZE];            // Y, I, Q and A of the palette colors for the vectorized scan
+#endif
 } RxPaletteAccelerator;
 
 //reduction workspace structure
@@ -392,22 +452,39 @@ struct RxReduction_ {
 	RxBool enhanceColors;
 	int nReclusters;
 	int reclusterIteration;
+	double reclusterMinImprovement; // least relative error improvement of an iteration to continue
+	double reclusterError;          // total error of the palette before the last iteration
+	unsigned int nReclusterRuns;    // number of Voronoi refinements run
+	unsigned int nReclusterIterations; // total number of Voronoi iterations applied
 	unsigned int nPinnedClusters;
+	unsigned int moveTolerance;     // largest RGB channel change of a centroid not counted as a move
 	COLOR32 (*maskColors) (COLOR32 col);
+	int (*histAddColor) (RxHistogram *histogram, const RxYiqColor *col, double weight, RxBool *pCreated); // specialized for the layer count
+	void (*computePrincipal) (RxReduction *reduction, int startIndex, int endIndex, double *axis, double *pVar);
 	RxAlphaMode alphaMode;
 	float fAlphaThreshold;
 	RxHistogram *histogram;
-	RxHistEntry **histogramFlat;
+	RxHistFlat histogramFlat;
 	RxPcaWork pcaWork;
 	RxPaletteAccelerator accel;
 	unsigned int newCentroids[RX_PALETTE_MAX_SIZE];
 	RxTotalBuffer blockTotals[RX_PALETTE_MAX_SIZE];
 	RxYiqColor imgBuffer[RX_TEMP_IMG_BUF_SIZE];
 	RxColorNode *colorNodes[RX_PALETTE_MAX_SIZE];
+	RxColorNode *splitHeap[RX_PALETTE_MAX_SIZE]; // splittable nodes, max-heap by priority
+	unsigned int nSplitHeap;
+	unsigned int nodeSerial;
 	COLOR32 paletteRgb[RX_PALETTE_MAX_SIZE][RX_PALETTE_MAX_COUNT];
 	RxYiqColor paletteYiq[RX_PALETTE_MAX_SIZE][RX_PALETTE_MAX_COUNT];
 	RxProgressCallback progressCallback;
 	void *progressCallbackData;
+	RxYiqCache *yiqCache;           // RGB to YIQ conversion cache of RxConvertRgbToYiqCached
+	RxIndexCache *indexCaches;      // color to palette index caches, one per worker thread
+	unsigned int nIndexCaches;
+	unsigned int paletteGeneration; // incremented on every palette load
+	RxDitherMode ditherMode;        // dithering mode used by RxReduceImage
+	unsigned int ditherOriginX;     // position of the reduced image's origin in the ordered dither pattern
+	unsigned int ditherOriginY;
 	double meanY;
 	double meanI;
 	double meanQ;
@@ -417,7 +494,7 @@ struct RxReduction_ {
 };
 
 
-#if defined(RX_SIMD) && !defined(_M_X64)
+#if defined(RX_SIMD) && !defined(RX_SIMD_X64)
 void *RxMemAlloc(size_t size);
 void *RxMemCalloc(size_t nMemb, size_t size);
 void RxMemFree(void *p);
@@ -465,6 +542,40 @@ COLOR32 RX_API RxConvertYiqToRgb(
 	const RxYiqColor *yiq
 );
 
+// -----------------------------------------------------------------------------------------------
+// Name: RxConvertRgbToYiqBatch
+//
+// Encode an array of RGBA colors to YIQA colors. Each color is encoded exactly as it would be by
+// RxConvertRgbToYiq, but several colors are processed at once.
+//
+// Parameters:
+//   rgb           The input RGB colors.
+//   yiq           The output YIQ colors.
+//   n             The number of colors to convert.
+// -----------------------------------------------------------------------------------------------
+void RX_API RxConvertRgbToYiqBatch(
+	const COLOR32 *rgb,
+	RxYiqColor    *yiq,
+	unsigned int   n
+);
+
+// -----------------------------------------------------------------------------------------------
+// Name: RxConvertYiqToRgbBatch
+//
+// Decode an array of YIQ colors to RGB. Each color is decoded exactly as it would be by
+// RxConvertYiqToRgb, but several colors are processed at once.
+//
+// Parameters:
+//   yiq           The input YIQ colors.
+//   rgb           The output RGB colors.
+//   n             The number of colors to convert.
+// -----------------------------------------------------------------------------------------------
+void RX_API RxConvertYiqToRgbBatch(
+	const RxYiqColor *yiq,
+	COLOR32          *rgb,
+	unsigned int      n
+);
+
 // -----------------------------------------------------------------------------------------------
 // Name: RxGetDefaultBalance
 //
@@ -589,6 +700,116 @@ void RX_API RxSetProgressCallback(
 	void              *userData
 );
 
+// -----------------------------------------------------------------------------------------------
+// Name: RxSetDitherMode
+//
+// Sets the dithering mode used by RxReduceImage when a nonzero diffusion amount is given. With an
+// ordered dithering mode, each pixel is indexed independently of the others, and the diffusion
+// amount scales the strength of the dither pattern. Ordered dithering does not dither the alpha
+// channel.
+//
+// Parameters:
+//   reduction     The color reduction context
+//   mode          The dithering mode
+// -----------------------------------------------------------------------------------------------
+void RX_API RxSetDitherMode(
+	RxReduction *reduction,
+	RxDitherMode mode
+);
+
+// -----------------------------------------------------------------------------------------------
+// Name: RxSetDitherOrigin
+//
+// Sets the position of the next reduced images in the ordered dither pattern. Use this to keep
+// the pattern continuous when an image is reduced in separate blocks. The default is (0, 0).
+//
+// Parameters:
+//   reduction     The color reduction context
+//   x             The X position of the image's top-left pixel
+//   y             The Y position of the image's top-left pixel
+// -----------------------------------------------------------------------------------------------
+void RX_API RxSetDitherOrigin(
+	RxReduction *reduction,
+	unsigned int x,
+	unsigned int y
+);
+
+// -----------------------------------------------------------------------------------------------
+// Name: RxSetReclusterPolicy
+//
+// Sets how the Voronoi refinement of created palettes terminates. The refinement stops after the
+// maximum number of iterations, when no palette color moves, or when an iteration reduces the
+// total error of the palette by less than the given fraction of it. With color masking, the
+// last iterations often only move a few colors back and forth by one step, so a small fraction
+// such as 0.001 saves most of them. The defaults are RECLUSTER_DEFAULT iterations and
+// RECLUSTER_IMPROVEMENT_DEFAULT (no threshold). RxSetBalance also sets the threshold, from the
+// reclusterImprovement field of the balance settings.
+//
+// Parameters:
+//   reduction      The color reduction context
+//   nReclusters    The maximum number of iterations. Set to 0 to not refine palettes.
+//   minImprovement The least relative improvement of the total error for the refinement to
+//                  continue. Set to 0 to continue until no palette color moves.
+// -----------------------------------------------------------------------------------------------
+void RX_API RxSetReclusterPolicy(
+	RxReduction *reduction,
+	int          nReclusters,
+	double       minImprovement
+);
+
+// -----------------------------------------------------------------------------------------------
+// Name: RxGetReclusterStats
+//
+// Get the counters of the Voronoi refinement of palettes created on a color reduction context.
+// The average number of iterations reached is the number of iterations divided by the number of
+// refinements.
+//
+// Parameters:
+//   reduction     The color reduction context
+//   pRuns         The output number of palette refinements run. This may be NULL.
+//   pIterations   The output total number of iterations applied. This may be NULL.
+// -----------------------------------------------------------------------------------------------
+void RX_API RxGetReclusterStats(
+	RxReduction  *reduction,
+	unsigned int *pRuns,
+	unsigned int *pIterations
+);
+
+// -----------------------------------------------------------------------------------------------
+// Name: RxConvertRgbToYiqCached
+//
+// Encode an RGBA color to a YIQA color, using the conversion cache of a color reduction context.
+// This is faster than RxConvertRgbToYiq when the same colors are converted repeatedly. The cache
+// is not safe for concurrent use, so the context must not be used by another thread meanwhile.
+//
+// Parameters:
+//   reduction     The color reduction context
+//   rgb           The input RGB color.
+//   yiq           The output YIQ color.
+// -----------------------------------------------------------------------------------------------
+void RX_API RxConvertRgbToYiqCached(
+	RxReduction *reduction,
+	COLOR32      rgb,
+	RxYiqColor  *yiq
+);
+
+// -----------------------------------------------------------------------------------------------
+// Name: RxGetConversionCacheStats
+//
+// Get the usage counters of the RGB to YIQ conversion cache of a color reduction context. The hit
+// rate of the cache is the number of hits divided by the number of lookups.
+//
+// Parameters:
+//   reduction     The color reduction context
+//   pHits         The output number of conversions found in the cache. This may be NULL.
+//   pLookups      The output number of conversions requested from the cache. This may be NULL.
+// -----------------------------------------------------------------------------------------------
+void RX_API RxGetConversionCacheStats(
+	RxReduction        *reduction,
+	unsigned long long *pHits,
+	unsigned long long *pLookups
+);
+
 // -----------------------------------------------------------------------------------------------
 // Name: RxHistAddColor
 //
@@ -712,6 +933,37 @@ RxStatus RX_API RxComputePalette(
 	unsigned int nColors
 );
 
+// -----------------------------------------------------------------------------------------------
+// Name: RxComputePaletteFrom
+//
+// Compute a color palette using the histogram held by the color reduction context, starting from
+// a seed palette instead of splitting the histogram. Only the Voronoi refinement is run, so this
+// is much faster than RxComputePalette when the seed is already close, such as the palette of the
+// previous frame of an animation. The histogram must be finalized by a call to RxHistFinalize.
+//
+// The refinement stops when no centroid's masked RGB color changes by more than the tolerance in
+// any channel, or when the recluster count is reached. If fewer seed colors than palette colors
+// are given, the remaining colors are created from the colors worst represented by the seed.
+//
+// On successful return, the created palette is loaded and active, as with RxComputePalette.
+//
+// Parameters:
+//   reduction     The color reduction context.
+//   seed          The seed palette. Its ordering is [layer][i], as for RxCreatePalette.
+//   nSeedColors   The number of seed palette colors per layer.
+//   nColors       The number of palette colors. This does not include the transparent slot, if
+//                 RX_ALPHA_RESERVE mode is used, which the seed palette must not include either.
+//   tolerance     The largest change of a centroid's RGB channel (0-255) that still counts as
+//                 settled. Set to 0 to refine until no centroid moves.
+// -----------------------------------------------------------------------------------------------
+RxStatus RX_API RxComputePaletteFrom(
+	RxReduction   *reduction,
+	const COLOR32 *seed,
+	unsigned int   nSeedColors,
+	unsigned int   nColors,
+	unsigned int   tolerance
+);
+
 // -----------------------------------------------------------------------------------------------
 // Name: RxSortPalette
 //
@@ -907,7 +1159,8 @@ double RX_API RxHistComputePaletteErrorYiq(
 //   width         The image width.
 //   height        The image height.
 //   flag          Color reduction flag.
-//   diffuse       The error diffusion amount, from 0 to 1. Set to 0 to disable dithering.
+//   diffuse       The error diffusion amount, from 0 to 1. Set to 0 to disable dithering. For
+//                 ordered dithering modes, this is the strength of the dither pattern.
 // -----------------------------------------------------------------------------------------------
 RxStatus RX_API RxReduceImage(
 	RxReduction   *reduction,
@@ -1148,6 +1401,9 @@ RxStatus RX_API RxGlbReduceImage(
 //   useColor0       Enables using color 0 of the palette as an opaque color.
 //   balance         The balance settings. This may be NULL to use the default settings.
 //   progress        The output progress.
+//   pReclusterRuns  The output number of palette refinements run (see RxGetReclusterStats). This
+//                   may be NULL.
+//   pReclusterIterations The output total number of refinement iterations. This may be NULL.
 // -----------------------------------------------------------------------------------------------
 void RX_API RxCreateMultiplePalettes(
 	const COLOR32          *px,
@@ -1161,5 +1417,7 @@ void RX_API RxCreateMultiplePalettes(
 	int                     paletteOffset,
 	RxBool                  useColor0,
 	const RxBalanceSetting *balance,
-	volatile int           *progress
+	volatile int           *progress,
+	unsigned int           *pReclusterRuns,
+	unsigned int           *pReclusterIterations
 );
@@ -55,6 +55,8 @@
 #define TEXCONV_THROW_STATUS(status) do { result = status; goto Cleanup; } while (0)
 #define TEXCONV_CHECK_ABORT(flag) do { if (flag) { TEXCONV_THROW_STATUS(TEXCONV_ABORT); } } while (0)
 
+#define TX_SEED_TOLERANCE 9 // centroid moves up to one 5-bit color step end a seeded palette's refinement
+
 
 int ilog2(int x);
 
@@ -126,7 +128,30 @@ static void TxiConvertProgressUpdate(RxReduction *reduction, unsigned int progre
 	params->progressMax = 1000;
 }
 
+static void TxiCreatePalette(TxConversionParameters *params, RxReduction *reduction, COLOR32 *palette, unsigned int nColors, unsigned int seedOffset, RxFlag flag) {
+	if (params->seedPalette == NULL || params->seedColors <= seedOffset) {
+		//create a new palette
+		RxCreatePalette(reduction, params->px, params->width, params->height, palette, nColors, flag, NULL);
+		return;
+	}
+
+	//refine the seed palette, skipping its reserved colors
+	COLOR32 seed[256];
+	unsigned int nSeed = params->seedColors - seedOffset;
+	if (nSeed > nColors) nSeed = nColors;
+	for (unsigned int i = 0; i < nSeed; i++) {
+		seed[i] = ColorConvertFromDS(params->seedPalette[i + seedOffset]) | 0xFF000000;
+	}
 
+	RxHistAdd(reduction, params->px, params->width, params->height);
+	RxHistFinalize(reduction);
+	RxComputePaletteFrom(reduction, seed, nSeed, nColors, TX_SEED_TOLERANCE);
+
+	//extract the created palette and sort it as RxCreatePalette would
+	unsigned int nUsed = reduction->nUsedColors;
+	for (unsigned int i = 0; i < nUsed; i++) palette[i] = reduction->paletteRgb[i][0];
+	qsort(palette, (flag & RX_FLAG_SORT_ONLY_USED) ? nUsed : nColors, sizeof(COLOR32), RxColorLightnessComparator);
+}
 
 static int TxiConvertDirect(TxConversionParameters *params, RxReduction *reduction) {
 	//convert to direct color.
@@ -150,6 +175,7 @@ static int TxiConvertDirect(TxConversionParameters *params, RxReduction *reducti
 	RxFlag flag = RX_FLAG_ALPHA_MODE_RESERVE | RX_FLAG_NO_WRITEBACK;
 	if (!params->ditherAlpha) flag |= RX_FLAG_NO_ALPHA_DITHER;      // diable alpha dither
 	else                      flag |= RX_FLAG_NO_ADAPTIVE_DIFFUSE;  // disable adaptive diffusion for alpha dither
+	if (params->ditherParallel) flag |= RX_FLAG_PARALLEL_DIFFUSE;   // prepare dithering in parallel
 
 	RxApplyFlags(reduction, flag);
 	RxSetProgressCallback(reduction, TxiConvertProgressUpdate, params);
@@ -219,14 +245,15 @@ static int TxiConvertPlttN(TxConversionParameters *params, RxReduction *reductio
 	RxFlag flag = (hasTransparent ? RX_FLAG_ALPHA_MODE_RESERVE : RX_FLAG_ALPHA_MODE_NONE);
 	if (!params->ditherAlpha) flag |= RX_FLAG_NO_ALPHA_DITHER;      // diable alpha dither
 	else                      flag |= RX_FLAG_NO_ADAPTIVE_DIFFUSE;  // disable adaptive diffusion for alpha dither
+	if (params->ditherParallel) flag |= RX_FLAG_PARALLEL_DIFFUSE;   // prepare dithering in parallel
 
 	RxApplyFlags(reduction, flag);
 
 	RxSetProgressCallback(reduction, TxiConvertProgressUpdate1, params);
 	if (params->fixedPalette == NULL) {
 		//generate a palette, making sure to leave a transparent color, if applicable.
-		RxCreatePalette(reduction, params->px, width, height, palette + hasTransparent, nColors - hasTransparent,
-			flag | RX_FLAG_SORT_ONLY_USED, NULL);
+		TxiCreatePalette(params, reduction, palette + hasTransparent, nColors - hasTransparent, hasTransparent,
+			flag | RX_FLAG_SORT_ONLY_USED);
 	} else {
 		for (unsigned int i = 0; i < nColors; i++) {
 			palette[i] = ColorConvertFromDS(params->fixedPalette[i]) | 0xFF000000;
@@ -304,8 +331,7 @@ static int TxiConvertAxIy(TxConversionParameters *params, RxReduction *reduction
 	RxSetProgressCallback(reduction, TxiConvertProgressUpdate1, params);
 	if (params->fixedPalette == NULL) {
 		//generate a palette, making sure to leave a transparent color, if applicable.
-		RxCreatePalette(reduction, params->px, width, height, palette, nColors,
-			RX_FLAG_SORT_ONLY_USED | RX_FLAG_ALPHA_MODE_PIXEL, NULL);
+		TxiCreatePalette(params, reduction, palette, nColors, 0, RX_FLAG_SORT_ONLY_USED | RX_FLAG_ALPHA_MODE_PIXEL);
 	} else {
 		for (unsigned int i = 0; i < nColors; i++) {
 			palette[i] = ColorConvertFromDS(params->fixedPalette[i]) | 0xFF000000;
@@ -329,6 +355,7 @@ static int TxiConvertAxIy(TxConversionParameters *params, RxReduction *reduction
 
 	if (!params->dither || !params->ditherAlpha) {
 		RxFlag flag = RX_FLAG_ALPHA_MODE_NONE | RX_FLAG_PRESERVE_ALPHA | RX_FLAG_NO_ALPHA_DITHER;
+		if (params->ditherParallel) flag |= RX_FLAG_PARALLEL_DIFFUSE;
 		RxApplyFlags(reduction, flag);
 
 		//set the alpha channel for the texel data
@@ -346,6 +373,7 @@ static int TxiConvertAxIy(TxConversionParameters *params, RxReduction *reduction
 		RxReduceImage(reduction, params->px, idxs, width, height, flag, diffuse);
 	} else {
 		RxFlag flag = RX_FLAG_ALPHA_MODE_PALETTE | RX_FLAG_PRESERVE_ALPHA;
+		if (params->ditherParallel) flag |= RX_FLAG_PARALLEL_DIFFUSE;
 		RxApplyFlags(reduction, flag);
 
 		//dithering with alpha: use alpha dithered mode
@@ -403,6 +431,7 @@ typedef struct TxiTileErrorMpEntry_ {
 typedef struct TxiConversionWork_ {
 	RxReduction *reduction;          // the color reduction context
 	float diffuse;                   // error diffusion amount
+	unsigned int tilesX;             // the number of tiles per row
 	double threshold;                // 4x4 conversion threshold setting (0-1)
 
 	TxTileData *tiles;               // the texture tile data
@@ -564,7 +593,7 @@ static void Txi4x4ComputeEndpointsFromHistogram(
 	COLOR32 colors[2] = { 0 };
 	int nColors = 0;
 	for (int i = 0; i < reduction->histogram->nEntries; i++) {
-		COLOR32 col = RxConvertYiqToRgb(&reduction->histogramFlat[i]->color[0]);
+		COLOR32 col = RxConvertYiqToRgb(&reduction->histogramFlat.color[i]);
 
 		//round to 15-bit color for counting
 		col = ColorRoundToDS15(col) | 0xFF000000;
@@ -605,11 +634,8 @@ static void Txi4x4ComputeEndpointsFromHistogram(
 	//use principal component analysis to determine endpoints.
 	//choose first and last colors along the principal axis (greatest Y is at the end)
 	RxHistSort(reduction, 0, reduction->histogram->nEntries);
-	RxHistEntry *firstEntry = reduction->histogramFlat[0];
-	RxHistEntry *lastEntry = reduction->histogramFlat[reduction->histogram->nEntries - 1];
-
-	COLOR32 full1 = RxConvertYiqToRgb(&firstEntry->color[0]);
-	COLOR32 full2 = RxConvertYiqToRgb(&lastEntry->color[0]);
+	COLOR32 full1 = RxConvertYiqToRgb(&reduction->histogramFlat.color[0]);
+	COLOR32 full2 = RxConvertYiqToRgb(&reduction->histogramFlat.color[reduction->histogram->nEntries - 1]);
 
 	//round to nearest colors.
 	COLOR c1 = ColorConvertToDS(full1);
@@ -1233,6 +1259,8 @@ static void Txi4x4IndexTile(
 	unsigned int       baseIndex
 ) {
 	int idxbuf[16];
+	unsigned int iTile = (unsigned int) (tile - work->tiles);
+	RxSetDitherOrigin(work->reduction, (iTile % work->tilesX) * 4, (iTile / work->tilesX) * 4);
 	RxPaletteLoad(work->reduction, effPltt, nEffPltt);
 	RxReduceImage(work->reduction, tile->rgb, idxbuf, 4, 4, RX_FLAG_ALPHA_MODE_NONE | RX_FLAG_NO_WRITEBACK, work->diffuse);
 
@@ -1892,6 +1920,7 @@ static int TxConvert4x4(TxConversionParameters *params, RxReduction *reduction)
 	TxiConversionWork work = { 0 };
 	work.reduction = reduction;
 	work.diffuse = params->dither ? params->diffuseAmount : 0.0f;
+	work.tilesX = tilesX;
 	work.threshold = ((double) params->threshold) / 100.0;
 	work.nTiles = nTiles;
 	work.plttSize = params->colorEntries;
@@ -1975,6 +2004,8 @@ TxConversionResult TxConvert(TxConversionParameters *params) {
 	params->complete = 0;     // not complete
 	params->progressMax = 1;  // dummy progress max
 	params->progress = 0;     // progress=0
+	params->reclusterRuns = 0;       // no palette refined yet
+	params->reclusterIterations = 0;
 
 	//pad texture if needed
 	unsigned int padWidth, padHeight, sourceWidth = params->width, sourceHeight = params->height;
@@ -1983,6 +2014,7 @@ TxConversionResult TxConvert(TxConversionParameters *params) {
 
 	RxReduction *reduction = RxNew(&params->balance);
 	if (padded == NULL || reduction == NULL) TEXCONV_THROW_STATUS(TEXCONV_NOMEM); // no memory
+	RxSetDitherMode(reduction, params->ditherMode);
 
 	params->width = padWidth;
 	params->height = padHeight;
@@ -2023,7 +2055,10 @@ TxConversionResult TxConvert(TxConversionParameters *params) {
 Cleanup:
 	//free resources
 	free(padded);
-	if (reduction != NULL) RxFree(reduction);
+	if (reduction != NULL) {
+		RxGetReclusterStats(reduction, &params->reclusterRuns, &params->reclusterIterations);
+		RxFree(reduction);
+	}
 
 	//mark progress complete
 	params->result = result;
@@ -83,6 +83,13 @@ typedef enum TxConversionResult_ {
 // conversion. Read out the number of colors in the returned palette to determine the actual size
 // of the returned palette.
 //
+// To start palette generation from an existing palette, such as the previous frame's palette when
+// converting an animation, set the seedPalette field to it and seedColors to its number of colors.
+// The palette is then only refined to fit the image, which is faster than creating a new palette
+// and keeps consecutive frames' palettes similar. The seed is laid out as the converted texture's
+// palette would be, including its transparent color. It is ignored when a fixed palette is used,
+// and by the tex4x4 and direct formats.
+//
 // During texture conversion, the progress and progressMax fields indicate the level of progress
 // of the texture conversion. When displaying progress, the calling thread should wait for the
 // progressMax field to be nonzero. When the conversion is completed (whether successfully or
@@ -104,9 +111,13 @@ typedef struct TxConversionParameters_ {
 	int dither;                     // enable dithering of color
 	float diffuseAmount;            // dithering level (0-1)
 	int ditherAlpha;                // enable dithering of the alpha channel
+	int ditherParallel;             // prepare dithering in parallel (same result)
+	RxDitherMode ditherMode;        // dithering mode (error diffusion or ordered)
 	int c0xp;                       // enable color-0 transparency (supported for palette4, palette16, palette256 formats)
 	unsigned int colorEntries;      // number of palette colors in the target texture (size of fixed palette, if used)
 	COLOR *fixedPalette;            // pointer to fixed palette (set to NULL to not use)
+	COLOR *seedPalette;             // pointer to palette to start palette generation from (set to NULL to not use)
+	unsigned int seedColors;        // number of colors in the seed palette
 	int threshold;                  // 4x4 compression threshold (0-100)
 	RxBalanceSetting balance;       // balance setting
 	TEXTURE *dest;                  // pointer to destination texture object
@@ -120,6 +131,8 @@ typedef struct TxConversionParameters_ {
 	volatile int progressMax;       // max conversion progress
 	volatile int complete;          // conversion completion flag
 	volatile TxConversionResult result;
+	unsigned int reclusterRuns;     // number of palette refinements run (see RxGetReclusterStats)
+	unsigned int reclusterIterations; // total number of palette refinement iterations
 } TxConversionParameters;
 
 
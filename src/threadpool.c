@@ -0,0 +1,282 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "threadpool.h"
+
+#ifdef _WIN32
+#	include <windows.h>
+#else
+#	include <pthread.h>
+#	include <unistd.h>
+#endif
+
+
+// ----- platform threading primitives
+
+#ifdef _WIN32
+
+typedef HANDLE             TpiThread;
+typedef CRITICAL_SECTION   TpiMutex;
+typedef CONDITION_VARIABLE TpiCond;
+
+#define TpiMutexInit(m)     InitializeCriticalSection(m)
+#define TpiMutexDestroy(m)  DeleteCriticalSection(m)
+#define TpiLock(m)          EnterCriticalSection(m)
+#define TpiUnlock(m)        LeaveCriticalSection(m)
+#define TpiCondInit(c)      InitializeConditionVariable(c)
+#define TpiCondDestroy(c)   ((void) (c))
+#define TpiWait(c,m)        SleepConditionVariableCS((c),(m),INFINITE)
+#define TpiSignal(c)        WakeConditionVariable(c)
+#define TpiBroadcast(c)     WakeAllConditionVariable(c)
+
+#define TpiTryClaim(p)      (InterlockedCompareExchange((p), 1, 0) == 0)
+#define TpiRelease(p)       InterlockedExchange((p), 0)
+
+#else
+
+typedef pthread_t          TpiThread;
+typedef pthread_mutex_t    TpiMutex;
+typedef pthread_cond_t     TpiCond;
+
+#define TpiMutexInit(m)     pthread_mutex_init((m),NULL)
+#define TpiMutexDestroy(m)  pthread_mutex_destroy(m)
+#define TpiLock(m)          pthread_mutex_lock(m)
+#define TpiUnlock(m)        pthread_mutex_unlock(m)
+#define TpiCondInit(c)      pthread_cond_init((c),NULL)
+#define TpiCondDestroy(c)   pthread_cond_destroy(c)
+#define TpiWait(c,m)        pthread_cond_wait((c),(m))
+#define TpiSignal(c)        pthread_cond_signal(c)
+#define TpiBroadcast(c)     pthread_cond_broadcast(c)
+
+#define TpiTryClaim(p)      __sync_bool_compare_and_swap((p), 0, 1)
+#define TpiRelease(p)       __sync_lock_release(p)
+
+#endif
+
+
+// ----- pool state
+
+typedef struct TpiWorkerRange_ {
+	TpiMutex lock;                  // guards next and end
+	unsigned int next;              // next task index this worker runs
+	unsigned int end;               // end of this worker's task range (exclusive)
+} TpiWorkerRange;
+
+typedef struct TpiPool_ {
+	int initialized;                // pool has been initialized
+	unsigned int nThreads;          // number of threads, including the thread submitting loops
+	TpiThread threads[TP_MAX_THREADS];
+
+	TpiMutex lock;                  // guards the fields below
+	TpiCond wake;                   // signaled when a loop is submitted or the pool shuts down
+	TpiCond done;                   // signaled when the last worker finishes its part of a loop
+	unsigned int generation;        // incremented per submitted loop
+	unsigned int nRunning;          // number of worker threads still running the current loop
+	int shutdown;                   // set to stop the worker threads
+
+#ifdef _WIN32
+	volatile LONG busy;             // set while a loop is running
+#else
+	volatile int busy;              // set while a loop is running
+#endif
+	TpTaskProc proc;                // task callback of the current loop
+	void *param;                    // task parameter of the current loop
+	TpiWorkerRange ranges[TP_MAX_THREADS];
+} TpiPool;
+
+static TpiPool sPool;
+
+
+// ----- task scheduling
+
+static int TpiTakeTask(unsigned int worker, unsigned int *pIndex) {
+	TpiWorkerRange *range = &sPool.ranges[worker];
+	int found = 0;
+
+	TpiLock(&range->lock);
+	if (range->next < range->end) {
+		*pIndex = range->next++;
+		found = 1;
+	}
+	TpiUnlock(&range->lock);
+	return found;
+}
+
+static int TpiStealTasks(unsigned int worker) {
+	//scan the other workers, starting from the next one, and take the upper half of the first non-empty range
+	for (unsigned int i = 1; i < sPool.nThreads; i++) {
+		TpiWorkerRange *victim = &sPool.ranges[(worker + i) % sPool.nThreads];
+		unsigned int start = 0, end = 0;
+
+		TpiLock(&victim->lock);
+		if (victim->next < victim->end) {
+			end = victim->end;
+			start = victim->next + (victim->end - victim->next) / 2;
+			victim->end = start;
+		}
+		TpiUnlock(&victim->lock);
+
+		if (start < end) {
+			TpiWorkerRange *range = &sPool.ranges[worker];
+			TpiLock(&range->lock);
+			range->next = start;
+			range->end = end;
+			TpiUnlock(&range->lock);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void TpiRunTasks(unsigned int worker) {
+	TpTaskProc proc = sPool.proc;
+	void *param = sPool.param;
+
+	for (;;) {
+		unsigned int index;
+		if (!TpiTakeTask(worker, &index)) {
+			if (!TpiStealTasks(worker)) break;
+			continue;
+		}
+
+		proc(param, index, worker);
+	}
+}
+
+static void TpiWorkerMain(unsigned int worker) {
+	unsigned int generation = 0;
+
+	TpiLock(&sPool.lock);
+	for (;;) {
+		while (!sPool.shutdown && sPool.generation == generation) TpiWait(&sPool.wake, &sPool.lock);
+		if (sPool.shutdown) break;
+
+		generation = sPool.generation;
+		TpiUnlock(&sPool.lock);
+
+		TpiRunTasks(worker);
+
+		TpiLock(&sPool.lock);
+		if (--sPool.nRunning == 0) TpiSignal(&sPool.done);
+	}
+	TpiUnlock(&sPool.lock);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI TpiThreadProc(LPVOID lpParam) {
+	TpiWorkerMain((unsigned int) (uintptr_t) lpParam);
+	return 0;
+}
+#else
+static void *TpiThreadProc(void *param) {
+	TpiWorkerMain((unsigned int) (uintptr_t) param);
+	return NULL;
+}
+#endif
+
+
+// ----- public interface
+
+unsigned int TpGetProcessorCount(void) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	long n = (long) info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (n < 1) n = 1;
+	return (unsigned int) n;
+}
+
+unsigned int TpInit(unsigned int nThreads) {
+	if (sPool.initialized) TpShutdown();
+
+	if (nThreads == 0) nThreads = TpGetProcessorCount();
+	if (nThreads > TP_MAX_THREADS) nThreads = TP_MAX_THREADS;
+
+	memset(&sPool, 0, sizeof(sPool));
+	TpiMutexInit(&sPool.lock);
+	TpiCondInit(&sPool.wake);
+	TpiCondInit(&sPool.done);
+	for (unsigned int i = 0; i < TP_MAX_THREADS; i++) TpiMutexInit(&sPool.ranges[i].lock);
+	sPool.initialized = 1;
+
+	//the calling thread is worker 0, so create the remaining workers
+	sPool.nThreads = 1;
+	for (unsigned int i = 1; i < nThreads; i++) {
+#ifdef _WIN32
+		sPool.threads[i] = CreateThread(NULL, 0, TpiThreadProc, (LPVOID) (uintptr_t) i, 0, NULL);
+		if (sPool.threads[i] == NULL) break;
+#else
+		if (pthread_create(&sPool.threads[i], NULL, TpiThreadProc, (void *) (uintptr_t) i) != 0) break;
+#endif
+		sPool.nThreads++;
+	}
+
+	return sPool.nThreads;
+}
+
+void TpShutdown(void) {
+	if (!sPool.initialized) return;
+
+	TpiLock(&sPool.lock);
+	sPool.shutdown = 1;
+	TpiBroadcast(&sPool.wake);
+	TpiUnlock(&sPool.lock);
+
+	for (unsigned int i = 1; i < sPool.nThreads; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(sPool.threads[i], INFINITE);
+		CloseHandle(sPool.threads[i]);
+#else
+		pthread_join(sPool.threads[i], NULL);
+#endif
+	}
+
+	for (unsigned int i = 0; i < TP_MAX_THREADS; i++) TpiMutexDestroy(&sPool.ranges[i].lock);
+	TpiCondDestroy(&sPool.done);
+	TpiCondDestroy(&sPool.wake);
+	TpiMutexDestroy(&sPool.lock);
+	sPool.initialized = 0;
+	sPool.nThreads = 0;
+}
+
+unsigned int TpGetThreadCount(void) {
+	if (!sPool.initialized) return 1;
+	return sPool.nThreads;
+}
+
+void TpParallelFor(unsigned int nTasks, TpTaskProc proc, void *param) {
+	if (nTasks == 0) return;
+
+	//run serially when there's nothing to split, or when the pool is already running a loop
+	if (!sPool.initialized || sPool.nThreads <= 1 || nTasks == 1 || !TpiTryClaim(&sPool.busy)) {
+		for (unsigned int i = 0; i < nTasks; i++) proc(param, i, 0);
+		return;
+	}
+
+	//split the tasks evenly among the workers
+	unsigned int nThreads = sPool.nThreads;
+	for (unsigned int i = 0; i < nThreads; i++) {
+		sPool.ranges[i].next = (unsigned int) (((uint64_t) nTasks * (i + 0)) / nThreads);
+		sPool.ranges[i].end  = (unsigned int) (((uint64_t) nTasks * (i + 1)) / nThreads);
+	}
+
+	TpiLock(&sPool.lock);
+	sPool.proc = proc;
+	sPool.param = param;
+	sPool.nRunning = nThreads - 1;
+	sPool.generation++;
+	TpiBroadcast(&sPool.wake);
+	TpiUnlock(&sPool.lock);
+
+	//participate as worker 0, then wait for the others to run out of work
+	TpiRunTasks(0);
+
+	TpiLock(&sPool.lock);
+	while (sPool.nRunning > 0) TpiWait(&sPool.done, &sPool.lock);
+	TpiUnlock(&sPool.lock);
+
+	TpiRelease(&sPool.busy);
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+// -----------------------------------------------------------------------------------------------
+// Thread Pool Module
+//
+// This header provides a small process-wide pool of worker threads. Work is submitted as a
+// parallel loop over a range of task indices with TpParallelFor. The range is split evenly among
+// the workers, and a worker that runs out of tasks steals half of the remaining range of another
+// worker, so uneven tasks are balanced without a central queue.
+//
+// Tasks may complete in any order and on any worker. A caller that needs reproducible output
+// must make each task's result depend only on its task index, never on the worker index or the
+// order of completion. The worker index is provided only to select per-worker scratch memory.
+//
+// When the pool is not initialized, has a single thread, or is already running a loop (for
+// example when TpParallelFor is called from inside a task), the loop runs serially on the
+// calling thread with a worker index of 0. Per-worker scratch memory should therefore belong to
+// the object a loop operates on, so that two nested loops running serially on different threads
+// never share it.
+// -----------------------------------------------------------------------------------------------
+
+#define TP_MAX_THREADS          64  // maximum number of threads in the pool (including the caller)
+
+// -----------------------------------------------------------------------------------------------
+// Name: TpTaskProc
+//
+// Callback for one task of a parallel loop.
+//
+// Parameters:
+//   param       The user parameter passed to TpParallelFor.
+//   index       The task index, in the range [0, nTasks).
+//   worker      The index of the worker running the task, in the range [0, TpGetThreadCount()).
+// -----------------------------------------------------------------------------------------------
+typedef void (*TpTaskProc) (void *param, unsigned int index, unsigned int worker);
+
+
+// -----------------------------------------------------------------------------------------------
+// Name: TpGetProcessorCount
+//
+// Get the number of logical processors available to the process.
+//
+// Returns:
+//   The number of logical processors, at least 1.
+// -----------------------------------------------------------------------------------------------
+unsigned int TpGetProcessorCount(void);
+
+// -----------------------------------------------------------------------------------------------
+// Name: TpInit
+//
+// Initialize the thread pool. The calling thread counts as one of the threads of the pool, so
+// nThreads - 1 worker threads are created. If worker threads cannot be created, the pool falls
+// back to the threads it could create.
+//
+// Parameters:
+//   nThreads    The number of threads to use. Pass 0 to use one per logical processor.
+//
+// Returns:
+//   The number of threads the pool runs with.
+// -----------------------------------------------------------------------------------------------
+unsigned int TpInit(
+	unsigned int nThreads
+);
+
+// -----------------------------------------------------------------------------------------------
+// Name: TpShutdown
+//
+// Stop and join all worker threads. The pool may be initialized again afterwards.
+// -----------------------------------------------------------------------------------------------
+void TpShutdown(void);
+
+// -----------------------------------------------------------------------------------------------
+// Name: TpGetThreadCount
+//
+// Get the number of threads loops are split across. This is 1 when the pool is not initialized.
+// Use this to size arrays of per-worker scratch memory.
+//
+// Returns:
+//   The thread count of the pool.
+// -----------------------------------------------------------------------------------------------
+unsigned int TpGetThreadCount(void);
+
+// -----------------------------------------------------------------------------------------------
+// Name: TpParallelFor
+//
+// Run a task for every index in [0, nTasks) and wait for all of them to complete. The calling
+// thread runs tasks as worker 0.
+//
+// Parameters:
+//   nTasks      The number of tasks.
+//   proc        The task callback.
+//   param       The user parameter passed to each task.
+// -----------------------------------------------------------------------------------------------
+void TpParallelFor(
+	unsigned int nTasks,
+	TpTaskProc   proc,
+	void        *param
+);